@@ -0,0 +1,144 @@
+//
+// Load generator for bufu_filebroker
+//
+// Every thread keeps one HTTP/1.1 keep-alive connection and sends GET requests
+// one after another for the given time (the connection is opened again when
+// the server closes it). At the end the request rate and
+// the latency percentiles are printed.
+//
+// Usage: load_generator <address> <port> <path> [threads] [seconds]
+//   e.g. load_generator localhost 8080 "/popfile?runnumber=100400" 8 10
+//
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+namespace http = boost::beast::http;
+
+typedef std::chrono::steady_clock clock_type;
+
+
+struct worker_result {
+    std::vector<uint32_t> latencies;     // in microseconds
+    uint64_t errors = 0;
+    uint64_t reconnects = 0;           // Connections closed by the server
+};
+
+
+void http_load(const std::string& address, const std::string& port, const std::string& path, clock_type::time_point end, worker_result& result)
+{
+    boost::asio::io_context ioc;
+    tcp::resolver resolver(ioc);
+
+    http::request<http::empty_body> req{http::verb::get, path, 11};
+    req.set(http::field::host, address);
+    req.keep_alive(true);
+
+    // Reconnects when the server closes the connection (e.g. during a restart)
+    while (clock_type::now() < end) {
+        try {
+            tcp::socket socket(ioc);
+            boost::asio::connect(socket, resolver.resolve(address, port));
+            socket.set_option(tcp::no_delay(true));
+
+            boost::beast::flat_buffer buffer;
+            bool keepAlive = true;
+
+            while (keepAlive && clock_type::now() < end) {
+                const auto start = clock_type::now();
+
+                http::write(socket, req);
+                http::response<http::string_body> res;
+                http::read(socket, buffer, res);
+
+                const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start);
+                result.latencies.push_back( (uint32_t)latency.count() );
+
+                if (res.result() != http::status::ok) {
+                    result.errors++;
+                }
+                keepAlive = res.keep_alive();
+            }
+
+            boost::system::error_code ec;
+            socket.shutdown(tcp::socket::shutdown_both, ec);
+            if (!keepAlive) {
+                result.reconnects++;
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << "Exception: " << e.what() << std::endl;
+            result.errors++;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " <address> <port> <path> [threads] [seconds]\n";
+        std::cout << "Example:\n";
+        std::cout << "  " << argv[0] << " localhost 8080 /index.html 8 10\n";
+        return 1;
+    }
+
+    const std::string address = argv[1];
+    const std::string port = argv[2];
+    const std::string path = argv[3];
+    const int threads = (argc > 4) ? std::atoi(argv[4]) : 1;
+    const int seconds = (argc > 5) ? std::atoi(argv[5]) : 10;
+
+    std::vector<worker_result> results(threads);
+    std::vector<std::thread> runners;
+
+    const auto start = clock_type::now();
+    const auto end = start + std::chrono::seconds(seconds);
+
+    for (int i = 0; i < threads; i++) {
+        runners.emplace_back( http_load, address, port, path, end, std::ref(results[i]) );
+    }
+    for (auto& runner : runners) {
+        runner.join();
+    }
+
+    const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    std::vector<uint32_t> latencies;
+    uint64_t errors = 0;
+    uint64_t reconnects = 0;
+    for (auto& result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+        reconnects += result.reconnects;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&latencies](double p) -> uint32_t {
+        if (latencies.empty()) {
+            return 0;
+        }
+        return latencies[ std::min(latencies.size() - 1, (std::size_t)(p * latencies.size())) ];
+    };
+
+    std::cout << "requests=" << latencies.size() << '\n';
+    std::cout << "errors=" << errors << '\n';
+    std::cout << "reconnects=" << reconnects << '\n';
+    std::cout << "requestsPerSecond=" << (uint64_t)(latencies.size() / elapsed) << '\n';
+    std::cout << "latencyP50us=" << percentile(0.50) << '\n';
+    std::cout << "latencyP90us=" << percentile(0.90) << '\n';
+    std::cout << "latencyP99us=" << percentile(0.99) << '\n';
+    std::cout << "latencyMaxUs=" << (latencies.empty() ? 0 : latencies.back()) << '\n';
+
+    return 0;
+}
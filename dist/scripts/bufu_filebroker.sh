@@ -11,10 +11,16 @@ SERVICE="/opt/bufu_filebroker/bin/bufu_filebroker"
 # Path to all required libraries
 LIB="/opt/bufu_filebroker/lib"
 
+# A new process takes over the running one through this socket (zero-downtime restart)
+HANDOFF_SOCKET="/run/bufu_filebroker.sock"
+
+# Main PID of the service, updated after every takeover
+PID_FILE="/run/bufu_filebroker.pid"
+
 ################################################################################
 
 export LD_LIBRARY_PATH="${LIB}:$LD_LIBRARY_PATH"
-$SERVICE &
+$SERVICE --handoff-socket "${HANDOFF_SOCKET}" &
 PID="$!"
 
 # Not really necessary, but prevents misaligned output 
@@ -30,4 +36,5 @@ if [ $? -ne 0 ]; then
     exit 1
 fi
 
+echo "$PID" > "${PID_FILE}"
 echo "$0: INFO: ${SERVICE} started."
@@ -15,6 +15,12 @@ LOG="${LOG_DIR}/$(hostname)--failure.log"
 MSG="bufu_filebroker: Service failure detected, dumping last $LINES lines of journal:"
 BODY="$(echo "$MSG"; journalctl -n $LINES -u $SERVICE)"
 
+# The flight recorder dump of the crashed process (see --recorder-file), decode it with bufu_recorder_decode
+RECORDER="$(ls -t /tmp/bufu_filebroker-*.recorder 2>/dev/null | head -1)"
+if [ -n "${RECORDER}" ]; then
+    BODY="$(echo "$BODY"; echo "Flight recorder dump: $(hostname):${RECORDER}")"
+fi
+
 echo "-- START ----------------------------------------------------------------- $(date): $(hostname): $0: $BODY" >> $LOG
 
 ## Notify F3Mon
@@ -0,0 +1,127 @@
+#include <boost/range.hpp>      // For boost::make_iterator_range
+#include <algorithm>
+#include <regex>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+#include "tools/inotify/INotify.h"
+#include "tools/tools.h"
+#include "tools/log.h"
+#include "bu/bu.h"
+#include "bu/BaseDirectoryWatcher.h"
+
+
+namespace bu {
+
+// Run directories, e.g. run100400 (bounded, so stoi does not throw and stop the watcher)
+static const std::regex runDirectoryFilter( "run([0-9]{1,9})" );
+
+
+BaseDirectoryWatcher::BaseDirectoryWatcher(int nbRuns, OnNewRun_t&& onNewRun)
+    : nbRuns(nbRuns), onNewRun(std::move(onNewRun))
+{
+}
+
+
+BaseDirectoryWatcher::~BaseDirectoryWatcher()
+{
+    LOG(DEBUG) << "BaseDirectoryWatcher::~BaseDirectoryWatcher().";
+}
+
+
+void BaseDirectoryWatcher::start()
+{
+    runnerThread = std::thread(&BaseDirectoryWatcher::runner, this);
+    // FIXME: We detach because at the moment we don't have a way how to stop the thread (same as RunDirectoryObserver)
+    runnerThread.detach();
+}
+
+
+std::string BaseDirectoryWatcher::getStats() const
+{
+    const char *sep = "  ";
+    std::ostringstream os;
+
+    os << "watcher:\n";
+    os << sep << "watcher.nbRuns="                          << nbRuns << '\n';
+    os << sep << "watcher.nbRunDirectories="                << stats.nbRunDirectories << '\n';
+    os << sep << "watcher.nbRunsStarted="                   << stats.nbRunsStarted << '\n';
+    os << sep << "watcher.lastRunNumber="                   << stats.lastRunNumber << '\n';
+    os << '\n';
+
+    return os.str();
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+void BaseDirectoryWatcher::runner()
+{
+    LOG(INFO) << TOOLS_THREAD_INFO();
+
+    const fs::path& baseDirectory = bu::getBaseDirectory();
+    LOG(INFO) << "BaseDirectoryWatcher: Watching: " << baseDirectory.string() << " for the newest " << nbRuns << " run(s)";
+
+    try {
+        // INotify has to be set before we list the directory content, otherwise we have a race condition...
+        tools::INotify inotify;
+        inotify.add_watch( baseDirectory.string(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR );
+
+        // The existing directories are started from the newest, so the old ones don't count against the limit
+        std::vector<int> runNumbers;
+        for (const auto& entry : boost::make_iterator_range(fs::directory_iterator(baseDirectory), {})) {
+            std::smatch match;
+            const std::string name = entry.path().filename().string();
+            if (fs::is_directory(entry.status()) && std::regex_match(name, match, runDirectoryFilter)) {
+                runNumbers.push_back( std::stoi(match[1]) );
+            }
+        }
+        std::sort( runNumbers.begin(), runNumbers.end(), std::greater<int>() );
+        for (const int runNumber : runNumbers) {
+            addRun( runNumber );
+        }
+
+        while (true) {
+            for (auto&& event : inotify.read()) {
+                std::smatch match;
+                if ((event.mask & IN_ISDIR) && std::regex_match(event.name, match, runDirectoryFilter)) {
+                    addRun( std::stoi(match[1]) );
+                }
+            }
+        }
+    }
+    catch(const std::exception& e) {
+        // Observers are still created when FUs ask, so this is not fatal
+        LOG(ERROR) << "BaseDirectoryWatcher: Stopped watching: " << e.what();
+    }
+}
+
+
+// Starts the run if it is one of the newest nbRuns runs
+void BaseDirectoryWatcher::addRun(int runNumber)
+{
+    stats.nbRunDirectories++;
+
+    if (newestRuns.count( runNumber ) > 0) {
+        return;
+    }
+    if ((int)newestRuns.size() >= nbRuns) {
+        if (runNumber < *newestRuns.begin()) {
+            return;
+        }
+        newestRuns.erase( newestRuns.begin() );
+    }
+    newestRuns.insert( runNumber );
+
+    LOG(INFO) << "BaseDirectoryWatcher: Starting runNumber: " << runNumber;
+    onNewRun( runNumber );
+
+    stats.nbRunsStarted++;
+    stats.lastRunNumber = runNumber;
+}
+
+} // namespace bu
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <set>
+#include <string>
+#include <thread>
+
+
+namespace bu {
+
+/*
+ * Watches the base directory for new run directories (runNNNNNN) and calls onNewRun for them,
+ * so the run observers are started (directory scanned, queue filled) before the first FU asks.
+ *
+ * Only the newest nbRuns run numbers are started: a run older than all of them is ignored,
+ * which keeps old directories left on the ramdisk from starting observers at startup.
+ */
+class BaseDirectoryWatcher {
+public:
+    typedef std::function<void(int runNumber)> OnNewRun_t;
+
+    BaseDirectoryWatcher(int nbRuns, OnNewRun_t&& onNewRun);
+    ~BaseDirectoryWatcher();
+
+    BaseDirectoryWatcher(const BaseDirectoryWatcher&) = delete;
+    BaseDirectoryWatcher& operator=(const BaseDirectoryWatcher&) = delete;
+
+    // Starts the watcher thread
+    void start();
+
+    std::string getStats() const;
+
+private:
+    void runner();
+    void addRun(int runNumber);
+
+private:
+    const int nbRuns;
+    const OnNewRun_t onNewRun;
+
+    std::set<int> newestRuns;                           // The newest run numbers seen (at most nbRuns), used only by the runner
+    std::thread runnerThread;
+
+    struct Statistics {
+        std::atomic<uint32_t> nbRunDirectories { 0 };   // How many run directories were seen
+        std::atomic<uint32_t> nbRunsStarted { 0 };      // How many observers were started in advance
+        std::atomic<int> lastRunNumber { -1 };          // The last run started in advance
+    } stats;
+};
+
+} // namespace bu
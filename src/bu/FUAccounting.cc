@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "bu/FUAccounting.h"
+
+
+namespace bu {
+
+FUAccounting::FUAccounting(std::size_t maxFUs)
+    : maxFUsPerShard( std::max<std::size_t>(1, maxFUs / nbShards) )
+{}
+
+
+void FUAccounting::onReply(const std::string& name, const std::string& address, const FileInfo& file, bool isWaitingForEoLS)
+{
+    const std::string& key = name.empty() ? address : name;
+    Shard& shard = shards[ std::hash<std::string>()(key) % nbShards ];
+    const auto now = Clock_t::now();
+
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    auto iter = shard.fus.find( key );
+    if (iter == shard.fus.end()) {
+        if (shard.fus.size() >= maxFUsPerShard) {
+            const auto oldest = std::min_element( shard.fus.begin(), shard.fus.end(),
+                [](const std::pair<const std::string, FU>& a, const std::pair<const std::string, FU>& b) { return a.second.lastRequest < b.second.lastRequest; });
+            shard.fus.erase( oldest );
+            shard.nbEvicted++;
+        }
+        iter = shard.fus.emplace( key, FU() ).first;
+    } else {
+        iter->second.requestInterval.record( std::chrono::duration_cast<std::chrono::nanoseconds>(now - iter->second.lastRequest).count() );
+    }
+
+    FU& fu = iter->second;
+    fu.address = address;
+    fu.nbRequests++;
+    fu.lastRequest = now;
+
+    if (file.type != FileInfo::FileType::EMPTY) {
+        fu.nbFiles++;
+        fu.nbEmptyInRow = 0;
+        fu.lastFile = now;
+    } else {
+        fu.nbEmptyReplies++;
+        fu.nbEmptyInRow++;
+        fu.nbEmptyInRowMax = std::max(fu.nbEmptyInRowMax, fu.nbEmptyInRow);
+        if (isWaitingForEoLS) {
+            fu.nbWaitsForEoLS++;
+        }
+    }
+}
+
+
+/*
+ * This function is not meant to run many times
+ */
+std::string FUAccounting::getStats() const
+{
+    const char *sep = "  ";
+    const auto now = Clock_t::now();
+    const auto ms = [now](Clock_t::time_point time) -> long {
+        return time == Clock_t::time_point() ? -1 : std::chrono::duration_cast<std::chrono::milliseconds>(now - time).count();
+    };
+
+    // Sorted by the name
+    std::map<std::string, std::string> fus;
+    std::size_t nbFUs = 0;
+    uint64_t nbEvicted = 0;
+
+    for (const Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        nbFUs += shard.fus.size();
+        nbEvicted += shard.nbEvicted;
+
+        for (const auto& pair : shard.fus) {
+            const FU& fu = pair.second;
+            std::ostringstream os;
+            os << sep << "address="                         << fu.address << '\n';
+            os << sep << "nbRequests="                      << fu.nbRequests << '\n';
+            os << sep << "nbFiles="                         << fu.nbFiles << '\n';
+            os << sep << "nbEmptyReplies="                  << fu.nbEmptyReplies << '\n';
+            os << sep << "nbWaitsForEoLS="                  << fu.nbWaitsForEoLS << '\n';
+            os << sep << "nbEmptyInRow="                    << fu.nbEmptyInRow << '\n';
+            os << sep << "nbEmptyInRowMax="                 << fu.nbEmptyInRowMax << '\n';
+            os << sep << "lastRequestMs="                   << ms(fu.lastRequest) << '\n';
+            os << sep << "lastFileMs="                      << ms(fu.lastFile) << '\n';
+            os << sep << "requestIntervalMs.p50="           << fu.requestInterval.percentile(0.5) / 1e6 << '\n';
+            os << sep << "requestIntervalMs.p90="           << fu.requestInterval.percentile(0.9) / 1e6 << '\n';
+            os << sep << "requestIntervalMs.p99="           << fu.requestInterval.percentile(0.99) / 1e6 << '\n';
+            fus.emplace( pair.first, os.str() );
+        }
+    }
+
+    std::ostringstream os;
+    os << "nbFUs="                                          << nbFUs << '\n';
+    os << "nbFUsEvicted="                                   << nbEvicted << '\n';
+    os << '\n';
+    for (const auto& pair : fus) {
+        os << "fu=" << pair.first << '\n';
+        os << pair.second;
+        os << '\n';
+    }
+    return os.str();
+}
+
+} // namespace bu
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "bu/FileInfo.h"
+#include "tools/metrics.h"
+
+
+namespace bu {
+
+/*
+ * Counters of every FU asking for files, so FUs polling in a loop on empty replies or FUs that starve can be found.
+ * FU is known by the fu parameter of /popfile, or by its address when it doesn't give one.
+ *
+ * The table is split into shards by the FU name, each with its own lock, so FUs rarely wait for each other.
+ * The table is bounded: when a shard is full, the FU not seen for the longest time is dropped.
+ */
+class FUAccounting {
+public:
+    typedef std::chrono::steady_clock Clock_t;
+
+    explicit FUAccounting(std::size_t maxFUs = 4096);
+
+    FUAccounting(const FUAccounting&) = delete;
+    FUAccounting& operator=(const FUAccounting&) = delete;
+
+    /*
+     * FU got a reply: a file, or an empty one (isWaitingForEoLS when the files it could get wait for their EoLS).
+     * The name is the fu parameter, the address is used when it is empty.
+     */
+    void onReply(const std::string& name, const std::string& address, const FileInfo& file, bool isWaitingForEoLS);
+
+    std::string getStats() const;
+
+private:
+    struct FU {
+        std::string address;                            // The last address FU asked from
+        uint64_t nbRequests = 0;
+        uint64_t nbFiles = 0;
+        uint64_t nbEmptyReplies = 0;
+        uint64_t nbWaitsForEoLS = 0;
+        uint64_t nbEmptyInRow = 0;                      // Empty replies since the last file
+        uint64_t nbEmptyInRowMax = 0;
+        Clock_t::time_point lastRequest;
+        Clock_t::time_point lastFile;
+        tools::metrics::histogram::snapshot requestInterval;    // Nanoseconds between requests
+    };
+
+    static const std::size_t nbShards = 16;
+
+    struct Shard {
+        std::unordered_map<std::string, FU> fus;
+        uint64_t nbEvicted = 0;
+        mutable std::mutex lock;
+    };
+
+    const std::size_t maxFUsPerShard;
+    Shard shards[nbShards];
+};
+
+} // namespace bu
@@ -0,0 +1,183 @@
+#include <boost/asio/post.hpp>
+
+#include "tools/log.h"
+#include "bu/FileFeed.h"
+
+
+namespace bu {
+
+FileFeed::FileFeed(tcp::socket&& socket, http_server::connection_slot&& slot, RunDirectoryManager& runDirectoryManager, const http_server::request_t& req)
+    : http_server::websocket_session(std::move(socket), std::move(slot))
+    , runDirectoryManager_(runDirectoryManager)
+{
+    // The request is valid only now, so the parameters are parsed here and errors are reported when the connection is open
+    std::string strValue;
+    try {
+        if (!req.query("runnumber", strValue)) {
+            requestError_ = "ERROR: Parameter 'runnumber' was not found in the query.";
+            return;
+        }
+        runNumber_ = std::stoul(strValue);
+        if (req.query("stopls", strValue)) {
+            stopLS_ = std::stoul(strValue);
+        }
+        if (req.query("credit", strValue)) {
+            credit_ = std::stoul(strValue);
+        }
+    }
+    catch(const std::exception& e) {
+        requestError_ = "ERROR: Cannot parse query parameter: '" + strValue + '\'';
+    }
+}
+
+
+void FileFeed::on_open()
+{
+    if (!requestError_.empty()) {
+        return sendError( requestError_ );
+    }
+
+    LOG(DEBUG) << "FileFeed: FU connected for runNumber: " << runNumber_ << ", initial credit: " << credit_;
+
+    // New files are pushed when the observer finds them
+    std::weak_ptr<FileFeed> weakSelf = sharedFromThis();
+    runDirectoryManager_.addListener( runNumber_, 
+        [weakSelf]() {
+            auto self = weakSelf.lock();
+            if (!self || self->isFinished_.load()) {
+                return false;
+            }
+            boost::asio::post(self->get_executor(), [self]() { self->dispatch(); });
+            return true;
+        });
+}
+
+
+void FileFeed::on_message(std::string&& message)
+{
+    long credit;
+    if (std::sscanf(message.c_str(), "credit=%ld", &credit) != 1 || credit < 0) {
+        return sendError( "ERROR: Cannot parse message: '" + message + '\'' );
+    }
+    stats_.nbCreditMessages++;
+    credit_ += credit;
+    dispatch();
+}
+
+
+void FileFeed::on_close()
+{
+    isFinished_.store(true);
+    LOG(DEBUG) << "FileFeed: FU disconnected for runNumber: " << runNumber_ 
+        << ", files: " << stats_.nbFiles << ", EoLS: " << stats_.nbEoLS << ", credit messages: " << stats_.nbCreditMessages;
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+void FileFeed::sendError(const std::string& errorMessage)
+{
+    std::ostringstream os;
+    os << "type=error\n";
+    os << "runnumber="      << runNumber_ << '\n';
+    os << "errormessage=\"" << errorMessage << "\"\n";
+    send( os.str() );
+    close();
+    isFinished_.store(true);
+}
+
+
+void FileFeed::dispatch()
+{
+    //TODO: HACK: Raw file mode is hardcoded (the same as in /popfile)
+    const RunDirectoryObserver::FileMode fileMode = RunDirectoryObserver::FileMode::RAW;
+    const std::string filePrefix = bu::getIndexFilePrefix();
+
+    // Credit limits only files, EoLS, EoR and errors are sent always
+    while (!isFinished_.load()) {
+        FileInfo file;
+        RunDirectoryObserver::State state;
+        int lastEoLS;
+
+        try {
+            if (credit_ > 0) {
+                std::tie( file, state, lastEoLS ) = runDirectoryManager_.popRunFile( runNumber_, stopLS_ );
+            } else {
+                std::tie( file, state, lastEoLS ) = runDirectoryManager_.popRunControl( runNumber_, stopLS_ );
+            }
+        }
+        catch (const std::invalid_argument& e) {
+            // The run is consumed in lumisection partitions
+            return sendError( e.what() );
+        }
+
+        // EoLS notices go before the file from the next lumisection
+        if (lastEoLS > lastEoLS_ && state != RunDirectoryObserver::State::EOR) {
+            lastEoLS_ = lastEoLS;
+            stats_.nbEoLS++;
+
+            std::ostringstream os;
+            os << "type=eols\n";
+            os << "runnumber="      << runNumber_ << '\n';
+            os << "lumisection="    << lastEoLS << '\n';
+            os << "lasteols="       << lastEoLS << '\n';
+            send( os.str() );
+        }
+
+        if (file.type != FileInfo::FileType::EMPTY) {
+            const std::string fileExtension = RunDirectoryObserver::fileExtension( fileMode );
+            bu::renameIndexFile( runNumber_, filePrefix, file.fileName() + fileExtension );
+            credit_--;
+            stats_.nbFiles++;
+
+            FileMetadata metadata;
+            const bool isMetadata = runDirectoryManager_.getFileMetadata( runNumber_, file, metadata );
+
+            std::ostringstream os;
+            os << "type=file\n";
+            os << "runnumber="      << runNumber_ << '\n';
+            os << "filemode="       << fileMode << '\n';
+            os << "state="          << state << '\n';
+            os << "file=\""         << file.fileName() << "\"\n";
+            os << "fileprefix=\""   << filePrefix << "\"\n";
+            os << "fileextension=\""<< fileExtension << "\"\n";
+            os << "lumisection="    << file.lumiSection << '\n';
+            os << "index="          << file.index << '\n';
+            if (isMetadata) {
+                os << "eventcount="     << metadata.eventCount << '\n';
+                os << "filesize="       << metadata.fileSize << '\n';
+                os << "headersize="     << metadata.headerSize << '\n';
+            }
+            os << "lasteols="       << lastEoLS << '\n';
+            send( os.str() );
+            continue;
+        }
+
+        if (state == RunDirectoryObserver::State::EOR) {
+            std::ostringstream os;
+            os << "type=eor\n";
+            os << "runnumber="      << runNumber_ << '\n';
+            os << "state="          << state << '\n';
+            os << "lasteols="       << lastEoLS << '\n';
+            send( os.str() );
+            close();
+            isFinished_.store(true);
+            break;
+        }
+
+        if (state == RunDirectoryObserver::State::ERROR || state == RunDirectoryObserver::State::NORUN) {
+            std::ostringstream os;
+            os << state << ": " << runDirectoryManager_.getError( runNumber_ );
+            sendError( os.str() );
+            break;
+        }
+
+        // Nothing to give now, the observer will call us when new files appear
+        break;
+    }
+}
+
+} // namespace bu
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+
+#include "bu/RunDirectoryManager.h"
+#include "http/1.1/server/websocket_session.hpp"
+
+
+namespace bu {
+
+/*
+ * WebSocket feed pushing files of one run to a FU: /ws/files?runnumber=R[&stopls=N][&credit=N]
+ *
+ * FU declares how many files it can accept by sending "credit=N" text messages (the initial credit can be given in the query).
+ * Every file consumes one credit. Files are taken by RunDirectoryManager::popRunFile() and renamed exactly like in /popfile,
+ * so the lumisection ordering is the same. Messages are "key=value" lines like the /popfile reply, with the first line 
+ * telling the type of the message:
+ *   type=file  - a file was assigned to the FU
+ *   type=eols  - a lumisection was closed (needs no credit, like eor and error)
+ *   type=eor   - the end of run (or stopls) was reached, the connection is closed afterwards
+ *   type=error - the run is in ERROR or NORUN state, or the request was wrong, the connection is closed afterwards
+ */
+class FileFeed : public http_server::websocket_session {
+public:
+    FileFeed(tcp::socket&& socket, http_server::connection_slot&& slot, RunDirectoryManager& runDirectoryManager, const http_server::request_t& req);
+
+protected:
+    void on_open() override;
+    void on_message(std::string&& message) override;
+    void on_close() override;
+
+private:
+    std::shared_ptr<FileFeed> sharedFromThis()
+    {
+        return std::static_pointer_cast<FileFeed>( shared_from_this() );
+    }
+
+    // Gives files to FU while there is a credit, called only from the strand of the connection
+    void dispatch();
+    void sendError(const std::string& errorMessage);
+
+private:
+    RunDirectoryManager& runDirectoryManager_;
+    int runNumber_ = -1;
+    int stopLS_ = -1;
+    long credit_ = 0;
+    int lastEoLS_ = 0;                      // The last EoLS notice sent to FU
+    std::string requestError_;              // Set if the query parameters cannot be parsed
+    std::atomic<bool> isFinished_ { false };
+
+    struct Statistics {
+        uint32_t nbFiles = 0;
+        uint32_t nbEoLS = 0;
+        uint32_t nbCreditMessages = 0;
+    } stats_;
+};
+
+} // namespace bu
@@ -99,11 +99,12 @@ namespace bu {
         }
 
         // Keeping it aligned to 16 bytes
-        uint32_t runNumber;
-        uint32_t lumiSection;
-        uint32_t index;
+        uint32_t runNumber = 0;
+        uint32_t lumiSection = 0;
+        uint32_t index = 0;
         FileType type;    
     };
+    static_assert(sizeof(FileInfo) == 16, "FileInfo is expected to stay 16 bytes");
 
     // Operator for std::sort
     //inline bool operator< (const FileInfo& l, const FileInfo& r) {}
@@ -0,0 +1,302 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include "tools/tools.h"
+#include "tools/log.h"
+#include "bu/FileMetadata.h"
+
+
+namespace bu {
+
+namespace {
+
+// Loads a little endian integer, independently of the host byte order
+template< class T >
+T load(const unsigned char* data)
+{
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        value |= (T)data[i] << (8 * i);
+    }
+    return value;
+}
+
+} // namespace
+
+
+bool decodeRawHeader(const unsigned char* data, std::size_t size, FileMetadata& metadata)
+{
+    if (size < 8 || std::memcmp(data, "RAW_000", 7) != 0) {
+        return false;
+    }
+
+    metadata = FileMetadata();
+    switch (data[7]) {
+        case '1':
+            if (size < 24) {
+                return false;
+            }
+            metadata.version        = 1;
+            metadata.headerSize     = load<uint16_t>( data + 8 );
+            metadata.eventCount     = load<uint16_t>( data + 10 );
+            metadata.lumiSection    = load<uint32_t>( data + 12 );
+            metadata.fileSize       = load<uint64_t>( data + 16 );
+            return metadata.headerSize >= 24;
+
+        case '2':
+            if (size < 32) {
+                return false;
+            }
+            metadata.version        = 2;
+            metadata.headerSize     = load<uint16_t>( data + 8 );
+            metadata.eventCount     = load<uint32_t>( data + 12 );
+            metadata.runNumber      = load<uint32_t>( data + 16 );
+            metadata.lumiSection    = load<uint32_t>( data + 20 );
+            metadata.fileSize       = load<uint64_t>( data + 24 );
+            return metadata.headerSize >= 32;
+
+        default:
+            return false;
+    }
+}
+
+
+/**************************************************************************
+ * FileMetadataCache
+ */
+
+
+void FileMetadataCache::Throughput::add(uint64_t bytes, uint64_t events, Clock_t::time_point now)
+{
+    nbBytes += bytes;
+    nbEvents += events;
+    windowBytes += bytes;
+    windowEvents += events;
+
+    const double elapsed = std::chrono::duration<double>(now - windowStart).count();
+    if (elapsed >= 1) {
+        // The first window starts with the first file
+        if (windowStart != Clock_t::time_point()) {
+            bytesRate = windowBytes / elapsed;
+            eventsRate = windowEvents / elapsed;
+        }
+        windowStart = now;
+        windowBytes = 0;
+        windowEvents = 0;
+    }
+}
+
+
+void FileMetadataCache::Throughput::print(std::ostream& os, const char* prefix, Clock_t::time_point now) const
+{
+    const char *sep = "  ";
+    // The rate is not updated when no files come, so it is reported as zero after two idle windows
+    const bool isIdle = now - windowStart > std::chrono::seconds(2);
+
+    os << sep << prefix << "nbBytes="                       << nbBytes << '\n';
+    os << sep << prefix << "nbEvents="                      << nbEvents << '\n';
+    os << sep << prefix << "bytesRate="                     << (isIdle ? 0 : bytesRate) << '\n';
+    os << sep << prefix << "eventsRate="                    << (isIdle ? 0 : eventsRate) << '\n';
+}
+
+
+void FileMetadataCache::put(const FileInfo& file, const FileMetadata& metadata)
+{
+    const auto now = Clock_t::now();
+    std::lock_guard<std::mutex> guard(lock);
+
+    files[ std::make_pair(file.lumiSection, file.index) ] = metadata;
+    if (files.size() > maxFiles) {
+        files.erase( files.begin() );
+        stats.nbDropped++;
+    }
+    stats.nbHeadersRead++;
+    stats.discovered.add( metadata.fileSize, metadata.eventCount, now );
+}
+
+
+void FileMetadataCache::putError(bool isInvalidHeader)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (isInvalidHeader) {
+        stats.nbInvalidHeaders++;
+    } else {
+        stats.nbReadErrors++;
+    }
+}
+
+
+bool FileMetadataCache::get(const FileInfo& file, FileMetadata& metadata, bool isGiven)
+{
+    const auto now = Clock_t::now();
+    std::lock_guard<std::mutex> guard(lock);
+
+    const auto iter = files.find( std::make_pair(file.lumiSection, file.index) );
+    if (iter == files.end()) {
+        if (isGiven) {
+            stats.nbMisses++;
+        }
+        return false;
+    }
+    metadata = iter->second;
+
+    if (isGiven) {
+        stats.nbHits++;
+        stats.given.add( metadata.fileSize, metadata.eventCount, now );
+    }
+    return true;
+}
+
+
+std::string FileMetadataCache::getStats() const
+{
+    const char *sep = "  ";
+    const auto now = Clock_t::now();
+    std::ostringstream os;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    os << sep << "metadata.nbHeadersRead="                  << stats.nbHeadersRead << '\n';
+    os << sep << "metadata.nbReadErrors="                   << stats.nbReadErrors << '\n';
+    os << sep << "metadata.nbInvalidHeaders="               << stats.nbInvalidHeaders << '\n';
+    os << sep << "metadata.nbFilesCached="                  << files.size() << '\n';
+    os << sep << "metadata.nbDropped="                      << stats.nbDropped << '\n';
+    os << sep << "metadata.nbHits="                         << stats.nbHits << '\n';
+    os << sep << "metadata.nbMisses="                       << stats.nbMisses << '\n';
+    stats.discovered.print( os, "metadata.discovered.", now );
+    stats.given.print( os, "metadata.given.", now );
+
+    return os.str();
+}
+
+
+/**************************************************************************
+ * FileMetadataReader
+ */
+
+
+FileMetadataReader::~FileMetadataReader()
+{
+    LOG(DEBUG) << "FileMetadataReader::~FileMetadataReader().";
+}
+
+
+void FileMetadataReader::start()
+{
+    runnerThread = std::thread(&FileMetadataReader::runner, this);
+    // FIXME: We detach because at the moment we don't have a way how to stop the thread (same as RunDirectoryObserver)
+    runnerThread.detach();
+}
+
+
+void FileMetadataReader::read(const FileMetadataCachePtr& cache, const files_t& files)
+{
+    uint32_t size;
+    {
+        std::lock_guard<std::mutex> lock(requestsLock);
+        for (const auto& file : files) {
+            if (file.type == FileInfo::FileType::INDEX) {
+                requests.push_back( Request{ cache, file } );
+                stats.nbRequests++;
+            }
+        }
+        size = requests.size();
+    }
+    requestsAvailable.notify_one();
+
+    if (size > stats.queueSizeMax) {
+        stats.queueSizeMax = size;
+    }
+}
+
+
+std::string FileMetadataReader::getStats() const
+{
+    const char *sep = "  ";
+    std::ostringstream os;
+
+    os << "metadataReader:\n";
+    os << sep << "metadataReader.nbRequests="               << stats.nbRequests << '\n';
+    os << sep << "metadataReader.nbReads="                  << stats.nbReads << '\n';
+    // NOTE: Not protected by lock, the same as the queue size of observers
+    os << sep << "metadataReader.queueSize="                << requests.size() << '\n';
+    os << sep << "metadataReader.queueSizeMax="             << stats.queueSizeMax << '\n';
+    os << '\n';
+
+    return os.str();
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+void FileMetadataReader::runner()
+{
+    LOG(INFO) << TOOLS_THREAD_INFO();
+
+    while (true) {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(requestsLock);
+            requestsAvailable.wait( lock, [this]() { return !requests.empty(); } );
+            request = std::move( requests.front() );
+            requests.pop_front();
+        }
+
+        FileMetadata metadata;
+        bool isInvalidHeader = false;
+        if (readHeader( request.file, metadata, isInvalidHeader )) {
+            request.cache->put( request.file, metadata );
+        } else {
+            request.cache->putError( isInvalidHeader );
+        }
+        stats.nbReads++;
+    }
+}
+
+
+bool FileMetadataReader::readHeader(const FileInfo& file, FileMetadata& metadata, bool& isInvalidHeader) const
+{
+    //TODO: HACK: RAW file mode is hardcoded (the same as in /popfile)
+    const std::string fileName = file.fileName() + ".raw";
+    const fs::path runDirectoryPath = bu::getRunDirectory( file.runNumber );
+
+    int fd = ::open( (runDirectoryPath / fileName).c_str(), O_RDONLY );
+    if (fd < 0 && errno == ENOENT) {
+        // FU was faster and the file was already renamed
+        fd = ::open( (runDirectoryPath / (bu::getIndexFilePrefix() + fileName)).c_str(), O_RDONLY );
+    }
+    if (fd < 0) {
+        LOG_RATE(WARNING, 10) << "FileMetadataReader: Cannot open: " << fileName << ": " << std::strerror(errno);
+        return false;
+    }
+
+    unsigned char header[ FileMetadata::maxHeaderSize ];
+    const ssize_t size = ::pread( fd, header, sizeof(header), 0 );
+    ::close( fd );
+
+    if (size < 0) {
+        LOG_RATE(WARNING, 10) << "FileMetadataReader: Cannot read: " << fileName << ": " << std::strerror(errno);
+        return false;
+    }
+
+    // The header has to describe the file it is in
+    if (
+        !decodeRawHeader( header, size, metadata ) ||
+        metadata.lumiSection != file.lumiSection ||
+        (metadata.version >= 2 && metadata.runNumber != file.runNumber)
+    ) {
+        LOG_RATE(WARNING, 10) << "FileMetadataReader: Invalid RAW header in: " << fileName;
+        isInvalidHeader = true;
+        return false;
+    }
+    return true;
+}
+
+} // namespace bu
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bu/FileInfo.h"
+#include "bu/bu.h"
+
+
+namespace bu {
+
+/*
+ * Information from the binary header of a RAW file (it replaces the content of the former .jsn index file).
+ * The header has a fixed layout (FRD file header, little endian):
+ *
+ *   offset  v1 ("RAW_0001", 24 bytes)   v2 ("RAW_0002", 32 bytes)
+ *        0  char[8] identifier          char[8] identifier
+ *        8  uint16  headerSize          uint16  headerSize
+ *       10  uint16  eventCount          uint16  dataType
+ *       12  uint32  lumiSection         uint32  eventCount
+ *       16  uint64  fileSize            uint32  runNumber
+ *       20                              uint32  lumiSection
+ *       24                              uint64  fileSize
+ */
+struct FileMetadata {
+    static constexpr std::size_t maxHeaderSize = 32;    // How many bytes are read from the beginning of the file
+
+    uint32_t version = 0;
+    uint32_t headerSize = 0;
+    uint32_t eventCount = 0;
+    uint32_t runNumber = 0;                             // Known only from v2, 0 otherwise
+    uint32_t lumiSection = 0;
+    uint64_t fileSize = 0;
+};
+
+/*
+ * Decodes the header from the first size bytes of the file.
+ * Returns false when it is not a known header or the size is too small.
+ */
+bool decodeRawHeader(const unsigned char* data, std::size_t size, FileMetadata& metadata);
+
+
+/*
+ * Metadata of the files in one run, filled by FileMetadataReader and used when the file is given to FU.
+ * A file given before its header was read is a miss, FU then has to read the header itself.
+ * Only the newest files are kept, the files of the oldest lumisections are dropped first.
+ */
+class FileMetadataCache {
+public:
+    static constexpr std::size_t maxFiles = 65536;
+
+    FileMetadataCache() = default;
+
+    FileMetadataCache(const FileMetadataCache&) = delete;
+    FileMetadataCache& operator=(const FileMetadataCache&) = delete;
+
+    void put(const FileInfo& file, const FileMetadata& metadata);
+    void putError(bool isInvalidHeader);
+
+    /*
+     * Returns false when the metadata is not known (yet).
+     * Files counted as given make the throughput statistics, consumer groups don't count them again.
+     */
+    bool get(const FileInfo& file, FileMetadata& metadata, bool isGiven = true);
+
+    std::string getStats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock_t;
+
+    // Bytes and events per second, computed over windows of at least one second
+    struct Throughput {
+        uint64_t nbBytes = 0;
+        uint64_t nbEvents = 0;
+        double bytesRate = 0;
+        double eventsRate = 0;
+
+        void add(uint64_t bytes, uint64_t events, Clock_t::time_point now);
+        void print(std::ostream& os, const char* prefix, Clock_t::time_point now) const;
+
+    private:
+        Clock_t::time_point windowStart;
+        uint64_t windowBytes = 0;
+        uint64_t windowEvents = 0;
+    };
+
+    std::map< std::pair<uint32_t, uint32_t>, FileMetadata > files;   // By lumisection and index
+    mutable std::mutex lock;
+
+    struct Statistics {
+        uint32_t nbHeadersRead = 0;
+        uint32_t nbReadErrors = 0;                      // The file couldn't be read
+        uint32_t nbInvalidHeaders = 0;                  // Unknown header or not matching the file name
+        uint32_t nbDropped = 0;                         // Dropped because the cache was full
+        uint32_t nbHits = 0;
+        uint32_t nbMisses = 0;
+        Throughput discovered;                          // Files whose header was read
+        Throughput given;                               // Files given to FUs
+    } stats;
+};
+
+typedef std::shared_ptr<FileMetadataCache> FileMetadataCachePtr;
+
+
+/*
+ * Reads headers of new index files in its own thread, so neither the inotify thread nor FUs wait for the disk.
+ * The file is read with a single pread of the first FileMetadata::maxHeaderSize bytes. When FU was faster and
+ * the file was already renamed, it is read from the renamed location.
+ */
+class FileMetadataReader {
+public:
+    FileMetadataReader() = default;
+    ~FileMetadataReader();
+
+    FileMetadataReader(const FileMetadataReader&) = delete;
+    FileMetadataReader& operator=(const FileMetadataReader&) = delete;
+
+    // Starts the reader thread
+    void start();
+
+    // Queues the index files to be read, the results are put into the cache
+    void read(const FileMetadataCachePtr& cache, const files_t& files);
+
+    std::string getStats() const;
+
+private:
+    void runner();
+    bool readHeader(const FileInfo& file, FileMetadata& metadata, bool& isInvalidHeader) const;
+
+private:
+    struct Request {
+        FileMetadataCachePtr cache;
+        FileInfo file;
+    };
+    std::deque<Request> requests;
+    std::mutex requestsLock;
+    std::condition_variable requestsAvailable;
+
+    std::thread runnerThread;
+
+    struct Statistics {
+        std::atomic<uint64_t> nbRequests { 0 };
+        std::atomic<uint64_t> nbReads { 0 };
+        std::atomic<uint32_t> queueSizeMax { 0 };
+    } stats;
+};
+
+} // namespace bu
@@ -0,0 +1,447 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "tools/tools.h"
+#include "tools/log.h"
+#include "bu/Handoff.h"
+
+
+namespace bu {
+
+namespace {
+
+    // Format of the snapshot: "BUFH", version, number of runs, runs...
+    const char magic[4] = { 'B', 'U', 'F', 'H' };
+    const uint32_t version = 2;                 // Version 2 added consumer groups, version 1 is still read
+
+    // Bytes exchanged on the handoff socket
+    const char handOverByte = 'H';
+    const char confirmByte = 'C';
+    const char ackByte = 'A';
+
+    // How long we wait for the other process
+    const int timeoutMs = 10000;
+
+
+    template<class T>
+    void put(std::string& data, T value)
+    {
+        data.append( reinterpret_cast<const char*>(&value), sizeof(value) );
+    }
+
+    void putFile(std::string& data, const FileInfo& file)
+    {
+        put<uint32_t>( data, file.runNumber );
+        put<uint32_t>( data, file.lumiSection );
+        put<uint32_t>( data, file.index );
+        put<uint32_t>( data, static_cast<uint32_t>(file.type) );
+    }
+
+    void putFiles(std::string& data, const std::vector<FileInfo>& files)
+    {
+        put<uint32_t>( data, files.size() );
+        for (const auto& file : files) {
+            putFile( data, file );
+        }
+    }
+
+    void putString(std::string& data, const std::string& s)
+    {
+        put<uint32_t>( data, s.size() );
+        data.append( s );
+    }
+
+    struct Reader {
+        const std::string& data;
+        std::size_t pos = 0;
+
+        template<class T>
+        T get()
+        {
+            T value;
+            if (pos + sizeof(value) > data.size()) {
+                THROW( std::runtime_error, "Handoff snapshot is truncated." );
+            }
+            std::memcpy( &value, data.data() + pos, sizeof(value) );
+            pos += sizeof(value);
+            return value;
+        }
+
+        FileInfo getFile()
+        {
+            FileInfo file;
+            file.runNumber      = get<uint32_t>();
+            file.lumiSection    = get<uint32_t>();
+            file.index          = get<uint32_t>();
+            file.type           = static_cast<FileInfo::FileType>( get<uint32_t>() );
+            return file;
+        }
+
+        void getFiles(std::vector<FileInfo>& files)
+        {
+            files.resize( get<uint32_t>() );
+            for (auto& file : files) {
+                file = getFile();
+            }
+        }
+
+        std::string getString()
+        {
+            const uint32_t size = get<uint32_t>();
+            if (pos + size > data.size()) {
+                THROW( std::runtime_error, "Handoff snapshot is truncated." );
+            }
+            std::string s( data, pos, size );
+            pos += size;
+            return s;
+        }
+    };
+
+
+    void writeAll(int fd, const char* data, std::size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "handoff send");
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    void readAll(int fd, char* data, std::size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = ::recv(fd, data, size, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category(), "handoff recv");
+            }
+            if (n == 0) {
+                THROW( std::runtime_error, "Handoff connection closed by the other process." );
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    sockaddr_un makeAddress(const std::string& socketPath)
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            THROW( std::invalid_argument, "Handoff socket path is too long: '" + socketPath + '\'' );
+        }
+        std::strcpy(addr.sun_path, socketPath.c_str());
+        return addr;
+    }
+
+} // namespace
+
+
+Handoff::Handoff(const std::string& socketPath) : socketPath_(socketPath) {}
+
+
+Handoff::~Handoff()
+{
+    if (runnerThread_.joinable()) {
+        runnerThread_.detach();
+    }
+    if (peerFd_ >= 0) {
+        ::close(peerFd_);
+    }
+}
+
+
+/**************************************************************************
+ * New process
+ */
+
+
+bool Handoff::takeOver(int& listenFd, Snapshots_t& snapshots)
+{
+    const sockaddr_un addr = makeAddress( socketPath_ );
+
+    peerFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (peerFd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "handoff socket");
+    }
+
+    if (::connect(peerFd_, (const sockaddr*) &addr, sizeof(addr)) < 0) {
+        const int err = errno;
+        ::close(peerFd_);
+        peerFd_ = -1;
+        if (err == ENOENT || err == ECONNREFUSED) {
+            // Nobody to take over from, this is a normal start
+            return false;
+        }
+        throw std::system_error(err, std::system_category(), "handoff connect to '" + socketPath_ + '\'');
+    }
+
+    timeval timeout { timeoutMs / 1000, 0 };
+    setsockopt(peerFd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The listening socket comes with the first byte
+    char byte = 0;
+    iovec iov { &byte, 1 };
+    alignas(cmsghdr) char control[ CMSG_SPACE(sizeof(int)) ];
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = ::recvmsg(peerFd_, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+    if (n < 0) {
+        throw std::system_error(errno, std::system_category(), "handoff recvmsg");
+    }
+
+    const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != 1 || byte != handOverByte || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        THROW( std::runtime_error, "Handoff failed, the listening socket was not received." );
+    }
+    std::memcpy(&listenFd, CMSG_DATA(cmsg), sizeof(int));
+
+    // Followed by the snapshot
+    uint64_t size;
+    readAll( peerFd_, reinterpret_cast<char*>(&size), sizeof(size) );
+    std::string data( size, '\0' );
+    readAll( peerFd_, &data[0], size );
+
+    snapshots = deserialize( data );
+
+    LOG(INFO) << "Handoff: Received the listening socket and " << snapshots.size() << " run(s) (" << size << " bytes) from the previous process.";
+    return true;
+}
+
+
+void Handoff::confirm()
+{
+    if (peerFd_ < 0) {
+        return;
+    }
+    writeAll( peerFd_, &confirmByte, 1 );
+
+    // The previous process either acknowledges or closes the connection (it gave up waiting for us), so no timeout here
+    timeval timeout { 0, 0 };
+    setsockopt(peerFd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char byte = 0;
+    readAll( peerFd_, &byte, 1 );
+    if (byte != ackByte) {
+        THROW( std::runtime_error, "Handoff was not acknowledged by the previous process." );
+    }
+    ::close(peerFd_);
+    peerFd_ = -1;
+    LOG(INFO) << "Handoff: Acknowledged, the previous process is draining.";
+}
+
+
+/**************************************************************************
+ * Running process
+ */
+
+
+void Handoff::serve(int listenFd, RunDirectoryManager& runDirectoryManager, std::function<void()>&& onHandedOff)
+{
+    const sockaddr_un addr = makeAddress( socketPath_ );
+
+    serverFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serverFd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "handoff socket");
+    }
+
+    // The socket of the previous process (if any) is replaced
+    ::unlink( socketPath_.c_str() );
+
+    if (::bind(serverFd_, (const sockaddr*) &addr, sizeof(addr)) < 0) {
+        throw std::system_error(errno, std::system_category(), "handoff bind to '" + socketPath_ + '\'');
+    }
+    if (::listen(serverFd_, 1) < 0) {
+        throw std::system_error(errno, std::system_category(), "handoff listen");
+    }
+
+    runnerThread_ = std::thread( &Handoff::runner, this, listenFd, std::ref(runDirectoryManager), std::move(onHandedOff) );
+}
+
+
+void Handoff::runner(int listenFd, RunDirectoryManager& runDirectoryManager, std::function<void()> onHandedOff)
+{
+    LOG(INFO) << TOOLS_THREAD_INFO();
+
+    for (;;) {
+        const int client = ::accept4(serverFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            LOG(ERROR) << "Handoff: accept failed: " << std::strerror(errno);
+            return;
+        }
+
+        LOG(INFO) << "Handoff: A new process is taking over.";
+        bool confirmed = false;
+        try {
+            confirmed = handOver( client, listenFd, runDirectoryManager );
+        }
+        catch (const std::exception& e) {
+            LOG(ERROR) << "Handoff: " << e.what();
+        }
+        ::close(client);
+
+        if (confirmed) {
+            // Nobody else can take over from us
+            ::close(serverFd_);
+            serverFd_ = -1;
+
+            LOG(INFO) << "Handoff: Confirmed by the new process.";
+            onHandedOff();
+            return;
+        }
+
+        // The new process failed, we continue serving
+        LOG(WARNING) << "Handoff: Not confirmed by the new process, continuing.";
+        runDirectoryManager.freeze( false );
+    }
+}
+
+
+bool Handoff::handOver(int client, int listenFd, RunDirectoryManager& runDirectoryManager)
+{
+    // From now on the snapshot is valid
+    runDirectoryManager.freeze( true );
+    const std::string data = serialize( runDirectoryManager.getSnapshots() );
+
+    iovec iov { const_cast<char*>(&handOverByte), 1 };
+    alignas(cmsghdr) char control[ CMSG_SPACE(sizeof(int)) ];
+    std::memset(control, 0, sizeof(control));
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &listenFd, sizeof(int));
+
+    if (::sendmsg(client, &msg, MSG_NOSIGNAL) != 1) {
+        throw std::system_error(errno, std::system_category(), "handoff sendmsg");
+    }
+
+    const uint64_t size = data.size();
+    writeAll( client, reinterpret_cast<const char*>(&size), sizeof(size) );
+    writeAll( client, data.data(), data.size() );
+
+    // Wait until the new process is listening
+    pollfd pfd { client, POLLIN, 0 };
+    if (::poll(&pfd, 1, timeoutMs) <= 0) {
+        return false;
+    }
+    char byte = 0;
+    if (::recv(client, &byte, 1, 0) != 1 || byte != confirmByte) {
+        return false;
+    }
+
+    // Once the acknowledgement is sent the new process serves, we must not give any more files
+    return ::send(client, &ackByte, 1, MSG_NOSIGNAL) == 1;
+}
+
+
+/**************************************************************************
+ * Snapshot format
+ */
+
+
+std::string Handoff::serialize(const Snapshots_t& snapshots)
+{
+    std::string data;
+    data.append( magic, sizeof(magic) );
+    put<uint32_t>( data, version );
+    put<uint32_t>( data, snapshots.size() );
+
+    for (const auto& snapshot : snapshots) {
+        put<int32_t>( data, snapshot.runNumber );
+        put<uint32_t>( data, static_cast<uint32_t>(snapshot.runState) );
+        put<int32_t>( data, snapshot.runLastEoLS );
+        putFile( data, snapshot.runLastProcessedFile );
+        put<uint32_t>( data, static_cast<uint32_t>(snapshot.fuState) );
+        put<int32_t>( data, snapshot.fuLastEoLS );
+        put<int32_t>( data, snapshot.fuStopLS );
+        putFile( data, snapshot.fuLastPoppedFile );
+        putFiles( data, snapshot.queue );
+
+        put<uint32_t>( data, snapshot.groups.size() );
+        for (const auto& group : snapshot.groups) {
+            putString( data, group.name );
+            put<uint32_t>( data, static_cast<uint32_t>(group.state) );
+            putFile( data, group.lastPoppedFile );
+            put<int32_t>( data, group.lastEoLS );
+            put<int32_t>( data, group.stopLS );
+            putFiles( data, group.lateFiles );
+        }
+        putFiles( data, snapshot.groupFiles );
+    }
+    return data;
+}
+
+
+Handoff::Snapshots_t Handoff::deserialize(const std::string& data)
+{
+    if (data.size() < sizeof(magic) || std::memcmp(data.data(), magic, sizeof(magic)) != 0) {
+        THROW( std::runtime_error, "Handoff snapshot has a wrong format." );
+    }
+
+    Reader reader { data, sizeof(magic) };
+    const uint32_t snapshotVersion = reader.get<uint32_t>();
+    if (snapshotVersion != 1 && snapshotVersion != version) {
+        THROW( std::runtime_error, "Handoff snapshot version " + std::to_string(snapshotVersion) + " is not supported." );
+    }
+
+    Snapshots_t snapshots( reader.get<uint32_t>() );
+    for (auto& snapshot : snapshots) {
+        snapshot.runNumber              = reader.get<int32_t>();
+        snapshot.runState               = static_cast<RunDirectoryObserver::State>( reader.get<uint32_t>() );
+        snapshot.runLastEoLS            = reader.get<int32_t>();
+        snapshot.runLastProcessedFile   = reader.getFile();
+        snapshot.fuState                = static_cast<RunDirectoryObserver::State>( reader.get<uint32_t>() );
+        snapshot.fuLastEoLS             = reader.get<int32_t>();
+        snapshot.fuStopLS               = reader.get<int32_t>();
+        snapshot.fuLastPoppedFile       = reader.getFile();
+        reader.getFiles( snapshot.queue );
+
+        if (snapshotVersion < 2) {
+            continue;
+        }
+        snapshot.groups.resize( reader.get<uint32_t>() );
+        for (auto& group : snapshot.groups) {
+            group.name                  = reader.getString();
+            group.state                 = static_cast<RunDirectoryObserver::State>( reader.get<uint32_t>() );
+            group.lastPoppedFile        = reader.getFile();
+            group.lastEoLS              = reader.get<int32_t>();
+            group.stopLS                = reader.get<int32_t>();
+            reader.getFiles( group.lateFiles );
+        }
+        reader.getFiles( snapshot.groupFiles );
+    }
+    return snapshots;
+}
+
+} // namespace bu
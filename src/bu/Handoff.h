@@ -0,0 +1,67 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bu/RunDirectoryManager.h"
+
+
+namespace bu {
+
+/*
+ * Zero-downtime restart: a new broker process takes over from the running one through a Unix socket.
+ *
+ * The running process listens on the handoff socket. When the new process connects:
+ *   1. the running process freezes all runs (no more files are given to FUs),
+ *   2. sends the listening HTTP socket (SCM_RIGHTS) and the snapshot of every run (queue, lastEoLS, stopLS, consumer groups, ...),
+ *   3. the new process restores the runs and confirms,
+ *   4. the previous process acknowledges, stops accepting, drains its connections and exits,
+ *   5. the new process starts accepting on the same socket once it has the acknowledgement.
+ * If the new process doesn't confirm in time, the previous one unfreezes and continues as if nothing happened,
+ * the new process then gets no acknowledgement and must exit. Only one of them ever gives files.
+ *
+ * Because the listening socket is never closed, clients are not refused during the handoff.
+ */
+class Handoff {
+public:
+    typedef std::vector<RunDirectoryObserver::Snapshot> Snapshots_t;
+
+    explicit Handoff(const std::string& socketPath);
+    ~Handoff();
+
+    Handoff(const Handoff&) = delete;
+    Handoff& operator=(const Handoff&) = delete;
+
+    /*
+     * Called by the new process. Returns false if there is no running process to take over from,
+     * otherwise the listening socket and the snapshots of the previous process.
+     */
+    bool takeOver(int& listenFd, Snapshots_t& snapshots);
+
+    // Confirms the takeover and waits for the acknowledgement of the previous process, throws if there is none
+    void confirm();
+
+    /*
+     * Listens for the next process in a background thread. When the handoff is confirmed,
+     * onHandedOff is called (from that thread) to stop accepting and drain.
+     */
+    void serve(int listenFd, RunDirectoryManager& runDirectoryManager, std::function<void()>&& onHandedOff);
+
+    static std::string serialize(const Snapshots_t& snapshots);
+    static Snapshots_t deserialize(const std::string& data);
+
+private:
+    void runner(int listenFd, RunDirectoryManager& runDirectoryManager, std::function<void()> onHandedOff);
+    bool handOver(int client, int listenFd, RunDirectoryManager& runDirectoryManager);
+
+private:
+    const std::string socketPath_;
+
+    int peerFd_ = -1;                   // Connection to the previous process (until confirmed)
+    int serverFd_ = -1;                 // Handoff socket we listen on
+    std::thread runnerThread_;
+};
+
+} // namespace bu
@@ -1,9 +1,35 @@
+#include <algorithm>
+
 #include "tools/log.h"
 #include "bu/RunDirectoryManager.h"
 
 
 namespace bu {
 
+/*
+ * The observer is used within the read section instead of copying the shared pointer out of the map,
+ * the map (and so the observer) cannot be deleted until the read section ends.
+ * Creating the observer is the slow path outside of the read section, it is done only once per run.
+ */
+template< typename F >
+auto RunDirectoryManager::withRunDirectoryObserver(int runNumber, F&& f) -> decltype( f(std::declval<RunDirectoryObserver&>()) )
+{
+    {
+        auto observers = runDirectoryObservers_.read();
+
+        // Check if we already have observer for that run
+        const auto iter = observers->find( runNumber );
+        if (iter != observers->end()) {
+            return f( *iter->second );
+        }
+    }
+
+    // No, we don't have. We create a new one
+    RunDirectoryObserverPtr observer = createRunDirectoryObserver( runNumber );
+    return f( *observer );
+}
+
+
 /**************************************************************************
  * PUBLIC
  */
@@ -12,57 +38,229 @@ namespace bu {
 RunDirectoryManager::RunDirectoryManager() {}
 
 
-std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popRunFile(int runNumber, int stopLS)
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popRunFile(int runNumber, int stopLS, RunDirectoryObserver::RetryHint* hint)
+{
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        return observer.popRunFile( stopLS, hint );
+    });
+}
+
+
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popRunFile(int runNumber, const std::string& fu, unsigned int done, int stopLS, RunDirectoryObserver::RetryHint* hint)
+{
+    if (!scheduler_) {
+        return popRunFile( runNumber, stopLS, hint );
+    }
+
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        scheduler_->onRequest( fu, done );
+
+        auto result = observer.popRunFile( stopLS, hint, [this, &fu](const FileInfo& file) { return scheduler_->admit( fu, file ); } );
+
+        scheduler_->onReply( fu, std::get<0>(result) );
+        return result;
+    });
+}
+
+
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popRunControl(int runNumber, int stopLS)
+{
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        return observer.popRunFile( stopLS, nullptr, [](const FileInfo&) { return false; } );
+    });
+}
+
+
+void RunDirectoryManager::setScheduler(const std::vector<std::string>& policies, const Scheduler::Config& config)
+{
+    // Checks the names
+    std::unique_ptr<Scheduler> scheduler( new Scheduler(policies, config) );
+
+    // First come first served needs no scheduler, FUs then don't serialize on it
+    const bool fcfs = std::all_of( policies.begin(), policies.end(), [](const std::string& name) { return name == "fcfs"; } );
+    if (!fcfs) {
+        scheduler_ = std::move( scheduler );
+    }
+}
+
+
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popGroupFile(int runNumber, const std::string& group, int stopLS, RunDirectoryObserver::RetryHint* hint)
+{
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        return observer.popGroupFile( group, stopLS, hint );
+    });
+}
+
+
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryManager::popPartitionFile(int runNumber, const RunDirectoryObserver::LSPartition& partition, int stopLS, RunDirectoryObserver::RetryHint* hint)
 {
-    RunDirectoryObserverPtr observer = getRunDirectoryObserver( runNumber );
-    return observer->popRunFile( stopLS );
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        return observer.popPartitionFile( partition, stopLS, hint );
+    });
 }
 
+void RunDirectoryManager::readFileMetadata()
+{
+    assert( !metadataReader_ );
+
+    metadataReader_.reset( new FileMetadataReader() );
+    metadataReader_->start();
+}
+
+
+bool RunDirectoryManager::getFileMetadata(int runNumber, const FileInfo& file, FileMetadata& metadata, bool isGiven)
+{
+    return withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        return observer.getFileMetadata( file, metadata, isGiven );
+    });
+}
+
+
 /*
  * This function is not meant to run many times
  */
-const std::string RunDirectoryManager::getStats() 
+const std::string RunDirectoryManager::getStats()
 {
+    auto observers = runDirectoryObservers_.read();
+
     std::ostringstream os;
-    os << "runNumbers=" << runDirectoryObservers_.size() << '\n';
-    {
-        std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
-
-        // Get the list of run numbers and sort them descending
-        std::vector<int> runNumbers( runDirectoryObservers_.size() );
-        std::transform(runDirectoryObservers_.begin(), runDirectoryObservers_.end(), runNumbers.begin(), [](auto pair){return pair.first;});
-        std::sort( runNumbers.begin(), runNumbers.end(), std::greater<int>() );
-
-        for (const int runNumber : runNumbers) {
-            const auto iter = runDirectoryObservers_.find( runNumber );
-            // Since we are running locked, we don't have to take the ownership of the shared pointer
-            const RunDirectoryObserverPtr& observer = iter->second;
-            os << observer->getStats();
-        }
+    os << "runNumbers=" << observers->size() << '\n';
+    if (watcher_) {
+        os << watcher_->getStats();
+    }
+    if (scheduler_) {
+        os << scheduler_->getStats();
+    }
+    if (metadataReader_) {
+        os << metadataReader_->getStats();
+    }
+
+    // Get the list of run numbers and sort them descending
+    std::vector<int> runNumbers( observers->size() );
+    std::transform(observers->begin(), observers->end(), runNumbers.begin(), [](auto pair){return pair.first;});
+    std::sort( runNumbers.begin(), runNumbers.end(), std::greater<int>() );
+
+    for (const int runNumber : runNumbers) {
+        // Since we are in the read section, we don't have to take the ownership of the shared pointer
+        const RunDirectoryObserverPtr& observer = observers->find( runNumber )->second;
+        os << observer->getStats();
     }
     return os.str();
 }
 
 
-const std::string RunDirectoryManager::getStats(int runNumber) 
+const std::string RunDirectoryManager::getStats(int runNumber)
 {
-    RunDirectoryObserverPtr observer = getRunDirectoryObserver( runNumber );
-    return observer->getStats();
+    return withRunDirectoryObserver( runNumber, [](RunDirectoryObserver& observer) {
+        return observer.getStats();
+    });
+}
+
+
+void RunDirectoryManager::getMetrics(tools::metrics::exposition& exposition)
+{
+    auto observers = runDirectoryObservers_.read();
+
+    exposition.gauge( "bufu_runs", "Runs with an observer", "", observers->size() );
+    for (const auto& pair : *observers) {
+        pair.second->getMetrics( exposition );
+    }
+}
+
+
+std::string RunDirectoryManager::getError(int runNumber) {
+    // Copied within the read section, the observer can be reclaimed after it (see restartRunDirectoryObserver)
+    return withRunDirectoryObserver( runNumber, [](RunDirectoryObserver& observer) -> std::string {
+        return observer.getError();
+    });
 }
 
 
-const std::string& RunDirectoryManager::getError(int runNumber) {
-    RunDirectoryObserverPtr observer = getRunDirectoryObserver( runNumber );
-    return observer->getError();
+void RunDirectoryManager::addListener(int runNumber, RunDirectoryObserver::Listener_t&& listener)
+{
+    withRunDirectoryObserver( runNumber, [&](RunDirectoryObserver& observer) {
+        observer.addListener( std::move(listener) );
+    });
 }
 
 
-void RunDirectoryManager::restartRunDirectoryObserver(int runNumber) 
+void RunDirectoryManager::freeze(bool frozen)
+{
+    // Locked, so observers created meanwhile are frozen as well
+    std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
+
+    frozen_ = frozen;
+    for (const auto& pair : *runDirectoryObservers_.read()) {
+        pair.second->freeze( frozen );
+    }
+}
+
+
+std::vector<RunDirectoryObserver::Snapshot> RunDirectoryManager::getSnapshots()
+{
+    std::vector<RunDirectoryObserver::Snapshot> snapshots;
+    auto observers = runDirectoryObservers_.read();
+
+    for (const auto& pair : *observers) {
+        RunDirectoryObserver::Snapshot snapshot = pair.second->getSnapshot();
+        if (
+            snapshot.runState == RunDirectoryObserver::State::ERROR ||
+            snapshot.runState == RunDirectoryObserver::State::NORUN ||
+            snapshot.runState == RunDirectoryObserver::State::INIT
+        ) {
+            continue;
+        }
+        snapshots.push_back( std::move(snapshot) );
+    }
+    return snapshots;
+}
+
+
+void RunDirectoryManager::restore(const std::vector<RunDirectoryObserver::Snapshot>& snapshots)
+{
+    std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
+
+    RunDirectoryObservers_t restored;
+    for (const auto& snapshot : snapshots) {
+        RunDirectoryObserverPtr observer = std::make_shared<RunDirectoryObserver>(snapshot.runNumber, metadataReader_.get());
+        observer->restore( snapshot );
+
+        LOG(DEBUG) << "runDirectoryObserver restored for runNumber: " << snapshot.runNumber << " with " << snapshot.queue.size() << " files in the queue";
+
+        observer->start();
+        restored.emplace( snapshot.runNumber, std::move(observer) );
+    }
+
+    runDirectoryObservers_.update( [&restored](RunDirectoryObservers_t& observers) {
+        for (auto& pair : restored) {
+            auto emplaceResult = observers.emplace( pair.first, std::move(pair.second) );
+            assert( emplaceResult.second == true );
+            (void)emplaceResult;
+        }
+    });
+}
+
+
+void RunDirectoryManager::watchBaseDirectory(int nbRuns)
+{
+    assert( !watcher_ );
+
+    // Creating the observer is enough, it starts scanning the run directory right away
+    watcher_.reset( new BaseDirectoryWatcher(nbRuns, [this](int runNumber) { createRunDirectoryObserver( runNumber ); }) );
+    watcher_->start();
+}
+
+
+void RunDirectoryManager::restartRunDirectoryObserver(int runNumber)
 {
     std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
 
     // FIXME: Just to allow restart, we remove any existing runObserver from the map. Obviously, this is creating a memory leak!!!
-    if (runDirectoryObservers_.erase( runNumber ) > 0) {
+    bool isErased = false;
+    runDirectoryObservers_.update( [runNumber, &isErased](RunDirectoryObservers_t& observers) {
+        isErased = observers.erase( runNumber ) > 0;
+    });
+    if (isErased) {
         LOG(WARNING) << "runDirectoryObserver erased for runNumber: " << runNumber << ", this caused a resource leak! Use only for debugging!!!";
     }
 
@@ -77,42 +275,46 @@ void RunDirectoryManager::restartRunDirectoryObserver(int runNumber)
  */
 
 
-RunDirectoryObserverPtr RunDirectoryManager::getRunDirectoryObserver(int runNumber) 
+RunDirectoryObserverPtr RunDirectoryManager::createRunDirectoryObserver(int runNumber)
 {
-    {
-        std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
+    std::lock_guard<std::mutex> lock(runDirectoryManagerLock_);
 
-        // Check if we already have observer for that run
-        const auto iter = runDirectoryObservers_.find( runNumber );
-        if (iter != runDirectoryObservers_.end()) {
+    // Another thread could create it meanwhile
+    {
+        auto observers = runDirectoryObservers_.read();
+        const auto iter = observers->find( runNumber );
+        if (iter != observers->end()) {
             return iter->second;
         }
-
-        // No, we don't have. We create a new one
-        return createRunDirectoryObserver_unlocked( runNumber );
     }
+
+    return createRunDirectoryObserver_unlocked( runNumber );
 }
 
 
 RunDirectoryObserverPtr RunDirectoryManager::createRunDirectoryObserver_unlocked(int runNumber)
 {
-    // Constructs a new runDirectoryObserver directly in the map directly
-    auto emplaceResult = runDirectoryObservers_.emplace( runNumber, std::make_shared<RunDirectoryObserver>(runNumber) );
+    RunDirectoryObserverPtr observer = std::make_shared<RunDirectoryObserver>(runNumber, metadataReader_.get());
 
-    // Normally, the runNumber was not in the map before, but better to be safe
-    // It would be a fault to create a new observer if one already exists
-    assert( emplaceResult.second == true );
+    LOG(DEBUG) << "runDirectoryObserver created for runNumber: " << runNumber;
 
-    auto iter = emplaceResult.first;
-    RunDirectoryObserverPtr observer = iter->second;
-    
-    LOG(DEBUG) << "runDirectoryObserver created for runNumber: " << iter->first;
+    if (frozen_) {
+        observer->freeze( true );
+    }
 
-    // Start the runner thread
+    // Start the runner thread, readers see the observer only when it is started
     observer->start();
 
+    runDirectoryObservers_.update( [runNumber, &observer](RunDirectoryObservers_t& observers) {
+        // Normally, the runNumber was not in the map before, but better to be safe
+        // It would be a fault to create a new observer if one already exists
+        auto emplaceResult = observers.emplace( runNumber, observer );
+        assert( emplaceResult.second == true );
+        (void)emplaceResult;
+    });
+
     return observer;
 }
 
 
-} // namespace bu
\ No newline at end of file
+} // namespace bu
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <memory>
 #include <unordered_map>
 
+#include "tools/synchronized/rcu.h"
 #include "bu/RunDirectoryObserver.h"
+#include "bu/BaseDirectoryWatcher.h"
+#include "bu/Scheduler.h"
+#include "bu/FileMetadata.h"
 
 
 namespace bu {
@@ -14,10 +19,38 @@ public:
     /*
      * Returns a tuple of:
      *   file, state, lastEoLS
+     * When no file is given and hint is not null, it is filled with the recommendation for FU when to ask again.
      * 
      * TODO: Candidate for structured binding with std::optional in C++17
      */
-    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunFile(int runNumber, int stopLS = -1);
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunFile(int runNumber, int stopLS = -1, RunDirectoryObserver::RetryHint* hint = nullptr);
+
+    /*
+     * The same for an identified FU, the file is given according to the scheduling policies (see setScheduler).
+     * done is how many files FU finished since the last request.
+     */
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunFile(int runNumber, const std::string& fu, unsigned int done, int stopLS = -1, RunDirectoryObserver::RetryHint* hint = nullptr);
+
+    /*
+     * The same, but only EoLS and EoR files are taken, index files stay in the queue. FU without credit
+     * learns this way about closed lumisections and the end of run, the returned file is always empty.
+     */
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunControl(int runNumber, int stopLS = -1);
+
+    // Has to be called before FUs are served
+    void setScheduler(const std::vector<std::string>& policies, const Scheduler::Config& config);
+
+    // The same for a consumer group, the group has to exist (see bu::isConsumerGroup)
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popGroupFile(int runNumber, const std::string& group, int stopLS = -1, RunDirectoryObserver::RetryHint* hint = nullptr);
+
+    // The same for a lumisection partition (see RunDirectoryObserver::popPartitionFile)
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popPartitionFile(int runNumber, const RunDirectoryObserver::LSPartition& partition, int stopLS = -1, RunDirectoryObserver::RetryHint* hint = nullptr);
+
+    // Reads headers of new files, so they can be given to FUs with the file (has to be called before FUs are served)
+    void readFileMetadata();
+
+    // Metadata of a file, false when it is not known (see RunDirectoryObserver::getFileMetadata)
+    bool getFileMetadata(int runNumber, const FileInfo& file, FileMetadata& metadata, bool isGiven = true);
 
     // Get statistics for all runs sorted
     const std::string getStats();
@@ -25,22 +58,56 @@ public:
     // Get statistics for a particular run
     const std::string getStats(int runNumber);
 
+    // Adds the metrics of all runs (see /metrics)
+    void getMetrics(tools::metrics::exposition& exposition);
+
     // Return the error message for a particular run
-    const std::string& getError(int runNumber);
+    std::string getError(int runNumber);
+
+    // Calls the listener when new files appear for the run (see RunDirectoryObserver::addListener)
+    void addListener(int runNumber, RunDirectoryObserver::Listener_t&& listener);
+
+    // Stops giving files to FUs in all runs, used during the handoff to a new process
+    void freeze(bool frozen);
+
+    // State of all runs, runs with an error are left out (the new process finds the error again)
+    std::vector<RunDirectoryObserver::Snapshot> getSnapshots();
+
+    // Creates and starts observers continuing from the state handed over by the previous process
+    void restore(const std::vector<RunDirectoryObserver::Snapshot>& snapshots);
+
+    // Starts observers for the newest nbRuns run directories as soon as they appear in the base directory
+    void watchBaseDirectory(int nbRuns);
 
     // FIXME: This will create a resource leak, use only for debugging
     void restartRunDirectoryObserver(int runNumber);
 
 private:
-    RunDirectoryObserverPtr getRunDirectoryObserver(int runNumber);
+    typedef std::unordered_map< int, RunDirectoryObserverPtr > RunDirectoryObservers_t;
+
+    // Calls f with the observer of the run within the RCU read section, the observer is created if necessary
+    template< typename F >
+    auto withRunDirectoryObserver(int runNumber, F&& f) -> decltype( f(std::declval<RunDirectoryObserver&>()) );
+
+    RunDirectoryObserverPtr createRunDirectoryObserver(int runNumber);
     RunDirectoryObserverPtr createRunDirectoryObserver_unlocked(int runNumber);
 
 private:
-    // Maps runNumbers to RunDirectoryObservers
-    std::unordered_map< int, RunDirectoryObserverPtr > runDirectoryObservers_;
+    /*
+     * Maps runNumbers to RunDirectoryObservers. The map changes only when a new run appears, so FU requests
+     * read it without locking (RCU), a new run is published as a new copy of the map.
+     */
+    tools::synchronized::rcu< RunDirectoryObservers_t > runDirectoryObservers_;
 
-    // Would be better to use shared_mutex (i.e. read lock), but for the moment there is only one reader, so the mutex or spinlock is the best
+    // Serializes creating observers (readers don't take it)
     std::mutex runDirectoryManagerLock_;    
+
+    // Observers created during the handoff are frozen as well
+    bool frozen_ = false;
+
+    std::unique_ptr<BaseDirectoryWatcher> watcher_;
+    std::unique_ptr<Scheduler> scheduler_;
+    std::unique_ptr<FileMetadataReader> metadataReader_;
 };
 
 } // namespace bu
@@ -1,17 +1,27 @@
 #include <thread>
+#include <algorithm>
+#include <limits>
 
 #include "tools/synchronized/queue.h"
 #include "tools/synchronized/barrier.h"
 #include "tools/inotify/INotify.h"
 #include "tools/tools.h"
 #include "tools/log.h"
+#include "tools/probes.h"
+#include "tools/recorder/recorder.h"
 #include "bu/FileInfo.h"
 #include "bu/RunDirectoryObserver.h"
 
 
 namespace bu {
 
-RunDirectoryObserver::RunDirectoryObserver(int runNumber) : runNumber(runNumber) {}
+RunDirectoryObserver::RunDirectoryObserver(int runNumber, FileMetadataReader* metadataReader)
+    : runNumber(runNumber), metadataReader(metadataReader), metadata(std::make_shared<FileMetadataCache>())
+{
+    for (const auto& group : bu::getConsumerGroups()) {
+        groups.emplace( group, ConsumerGroup() );
+    }
+}
 
 
 RunDirectoryObserver::~RunDirectoryObserver()
@@ -56,30 +66,280 @@ std::string RunDirectoryObserver::getStats() const
     os << sep << "fu.nbRequests="                           << stats.fu.nbRequests << '\n';
     os << sep << "fu.nbEmptyReplies="                       << stats.fu.nbEmptyReplies  << '\n';
     os << sep << "fu.nbWaitsForEoLS="                       << stats.fu.nbWaitsForEoLS << '\n';
+    os << sep << "fu.nbSpeculativeFiles="                   << stats.fu.nbSpeculativeFiles << '\n';
+    os << sep << "fu.nbOutOfOrderFiles="                    << stats.fu.nbOutOfOrderFiles << '\n';
+    os << sep << "fu.nbDeferred="                           << stats.fu.nbDeferred << '\n';
     os << sep << "fu.lastPoppedFile=\""                     << stats.fu.lastPoppedFile.fileName() << "\"\n";
     os << sep << "fu.lastEoLS="                             << stats.fu.lastEoLS << '\n';
     os << sep << "fu.stopLS="                               << stats.fu.stopLS << '\n';
     os << '\n';
+    if (!groups.empty()) {
+        // NOTE: Not protected by lock, the same as the queue size
+        os << sep << "groups.nbFilesStored="                << groupFiles.size() << '\n';
+        for (const auto& pair : groups) {
+            const std::string prefix = "group." + pair.first + '.';
+            const ConsumerGroup& group = pair.second;
+            os << sep << prefix << "state="                 << group.state << '\n';
+            os << sep << prefix << "nbRequests="            << group.nbRequests << '\n';
+            os << sep << prefix << "nbEmptyReplies="        << group.nbEmptyReplies << '\n';
+            os << sep << prefix << "nbWaitsForEoLS="        << group.nbWaitsForEoLS << '\n';
+            os << sep << prefix << "nbLateFiles="           << group.nbLateFiles << '\n';
+            os << sep << prefix << "lastPoppedFile=\""      << group.lastPoppedFile.fileName() << "\"\n";
+            os << sep << prefix << "lastEoLS="              << group.lastEoLS << '\n';
+            os << sep << prefix << "stopLS="                << group.stopLS << '\n';
+        }
+        os << '\n';
+    }
+    if (isPartitioned) {
+        os << sep << "partitions.lsmod="                    << partitioning.mod << '\n';
+        os << sep << "partitions.lsblock="                  << partitioning.block << '\n';
+        for (std::size_t part = 0; part < partitions.size(); part++) {
+            const std::string prefix = "partition." + std::to_string(part) + '.';
+            const Partition& partition = *partitions[part];
+            // NOTE: Not protected by lock, the same as the queue size
+            os << sep << prefix << "state="                 << partition.state << '\n';
+            os << sep << prefix << "queueSize="             << partition.queue.size() << '\n';
+            os << sep << prefix << "nbRequests="            << partition.nbRequests << '\n';
+            os << sep << prefix << "nbEmptyReplies="        << partition.nbEmptyReplies << '\n';
+            os << sep << prefix << "nbWaitsForEoLS="        << partition.nbWaitsForEoLS << '\n';
+            os << sep << prefix << "lastPoppedFile=\""      << partition.lastPoppedFile.fileName() << "\"\n";
+            os << sep << prefix << "lastEoLS="              << partition.lastEoLS << '\n';
+            os << sep << prefix << "stopLS="                << partition.stopLS << '\n';
+        }
+        os << '\n';
+    }
+    os << sep << "hints.arrivalRate="                       << (stats.hints.arrivalInterval.value > 0 ? 1 / stats.hints.arrivalInterval.value : 0) << '\n';
+    os << sep << "hints.lsPeriodMs="                        << (int)(stats.hints.lsPeriod.value * 1000) << '\n';
+    os << sep << "hints.emptyReplyRate="                    << (stats.hints.emptyReplyInterval.value > 0 ? 1 / stats.hints.emptyReplyInterval.value : 0) << '\n';
+    os << sep << "hints.queueSizeAvg="                      << stats.hints.queueSize.value << '\n';
+    os << sep << "hints.lastRetryAfterMs="                  << stats.hints.lastRetryAfterMs << '\n';
+    os << '\n';
+    {
+        // Milliseconds from the discovery of a file until it is given to FU, and the same for whole lumisections
+        const tools::metrics::histogram::snapshot residence = metrics.residence.collect();
+        const tools::metrics::histogram::snapshot lumiSection = metrics.lumiSection.collect();
+        os << sep << "dispatch.nbFiles="                    << residence.count << '\n';
+        os << sep << "dispatch.residenceMs.p50="            << residence.percentile(0.5) / 1e6 << '\n';
+        os << sep << "dispatch.residenceMs.p90="            << residence.percentile(0.9) / 1e6 << '\n';
+        os << sep << "dispatch.residenceMs.p99="            << residence.percentile(0.99) / 1e6 << '\n';
+        os << sep << "dispatch.nbLumiSections="             << lumiSection.count << '\n';
+        os << sep << "dispatch.lumiSectionMs.p50="          << lumiSection.percentile(0.5) / 1e6 << '\n';
+        os << sep << "dispatch.lumiSectionMs.p90="          << lumiSection.percentile(0.9) / 1e6 << '\n';
+        os << sep << "dispatch.lumiSectionMs.p99="          << lumiSection.percentile(0.99) / 1e6 << '\n';
+        os << sep << "dispatch.lumiSectionMs.last="         << metrics.lastLumiSectionNs.load() / 1e6 << '\n';
+    }
+    os << '\n';
+    if (metadataReader) {
+        os << metadata->getStats();
+        os << '\n';
+    }
 
     return os.str();
 }
 
 
+void RunDirectoryObserver::getMetrics(tools::metrics::exposition& exposition) const
+{
+    const std::string run = tools::metrics::exposition::label("runnumber", runNumber);
+
+    // NOTE: Not protected by lock, the same as in getStats()
+    std::size_t queueSize = queue.size();
+    if (isPartitioned) {
+        for (const auto& partition : partitions) {
+            queueSize += partition->queue.size();
+        }
+    }
+
+    exposition.gauge( "bufu_queue_size", "Files waiting in the queue of the run", run, queueSize );
+    exposition.gauge( "bufu_queue_size_max", "The largest queue size of the run", run, stats.queueSizeMax );
+    exposition.gauge( "bufu_run_last_eols", "The last EoLS seen in the run directory", run, stats.run.lastEoLS );
+    exposition.gauge( "bufu_fu_last_eols", "The last EoLS given to FUs", run, stats.fu.lastEoLS );
+    exposition.counter( "bufu_inotify_reads_total", "Inotify read calls", run, stats.startup.inotify.nbInotifyReadCalls + stats.inotify.nbInotifyReadCalls );
+    exposition.counter( "bufu_inotify_files_total", "Files seen by inotify", run, stats.startup.inotify.nbAllFiles + stats.inotify.nbAllFiles );
+    exposition.counter( "bufu_files_processed_total", "Files put into the queue", run, stats.nbJsnFilesProcessed );
+    exposition.counter( "bufu_fu_requests_total", "Requests from FUs", run, stats.fu.nbRequests );
+    exposition.counter( "bufu_fu_empty_replies_total", "Replies to FUs without a file", run, stats.fu.nbEmptyReplies );
+    exposition.counter( "bufu_fu_waits_for_eols_total", "Requests from FUs waiting for a missing EoLS", run, stats.fu.nbWaitsForEoLS );
+
+    exposition.histogram( "bufu_pop_lock_hold_seconds", "Time popRunFile holds the observer lock", run, metrics.popLockHold.collect(), 1e-9, 6, 30 );
+    exposition.histogram( "bufu_file_residence_seconds", "Time from the discovery of an index file until it is given to FU", run, metrics.residence.collect(), 1e-9, 10, 38 );
+    exposition.histogram( "bufu_lumisection_dispatch_seconds", "Time from the discovery of the first index file of a lumisection until the last one is given to FU", run, metrics.lumiSection.collect(), 1e-9, 20, 38 );
+    exposition.histogram( "bufu_inotify_read_batch_size", "Events returned by one inotify read", run, metrics.inotifyBatch.collect(), 1, 0, 14 );
+}
+
+
 const std::string& RunDirectoryObserver::getError() const
 {
     return errorMessage;
 }
 
 
+void RunDirectoryObserver::addListener(Listener_t&& listener)
+{
+    {
+        std::lock_guard<std::mutex> lock(listenersLock);
+        listeners.push_back( std::move(listener) );
+    }
+    // Files could have been already put into the queue
+    notifyListeners();
+}
+
+
+RunDirectoryObserver::Snapshot RunDirectoryObserver::getSnapshot() const
+{
+    std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+
+    Snapshot snapshot;
+    snapshot.runNumber = runNumber;
+    snapshot.runState = stats.run.state;
+    snapshot.runLastEoLS = stats.run.lastEoLS;
+    snapshot.runLastProcessedFile = stats.run.lastProcessedFile;
+    snapshot.fuState = stats.fu.state;
+    snapshot.fuLastEoLS = stats.fu.lastEoLS;
+    snapshot.fuStopLS = stats.fu.stopLS;
+    snapshot.fuLastPoppedFile = stats.fu.lastPoppedFile;
+
+    // Files are stored in the order they will be given to FUs
+    FileQueue_t copy = queue;
+
+    /*
+     * Partitions are split again by the first partitioned request in the new process, starting from the lowest
+     * lastEoLS of all partitions. The EoLS files of partitions that are further are put back into the queue,
+     * so the new partitions get to the same lastEoLS.
+     */
+    if (isPartitioned) {
+        snapshot.fuLastEoLS = std::numeric_limits<int>::max();
+        snapshot.fuLastPoppedFile = FileInfo();
+        for (const auto& partition : partitions) {
+            std::lock_guard<std::mutex> partitionLock(partition->lock);
+            snapshot.fuLastEoLS = std::min( snapshot.fuLastEoLS, partition->lastEoLS );
+            FileQueue_t partitionCopy = partition->queue;
+            while (!partitionCopy.empty()) {
+                // EoR is in every partition
+                if (!partitionCopy.top().isEoR() || partition == partitions.front()) {
+                    copy.push( partitionCopy.top() );
+                }
+                partitionCopy.pop();
+            }
+        }
+        for (std::size_t part = 0; part < partitions.size(); part++) {
+            LSPartition partition = partitioning;
+            partition.part = part;
+            for (int ls = partition.next(snapshot.fuLastEoLS); ls <= partitions[part]->lastEoLS; ls = partition.next(ls)) {
+                copy.push( FileInfo(runNumber, ls, FileInfo::FileType::EOLS) );
+            }
+        }
+    }
+
+    snapshot.queue.reserve( copy.size() );
+    while (!copy.empty()) {
+        snapshot.queue.push_back( copy.top() );
+        copy.pop();
+    }
+
+    for (const auto& pair : groups) {
+        const ConsumerGroup& group = pair.second;
+        snapshot.groups.push_back({ pair.first, group.state, group.lastPoppedFile, group.lastEoLS, group.stopLS, group.lateFiles });
+    }
+    snapshot.groupFiles.assign( groupFiles.begin(), groupFiles.end() );
+    return snapshot;
+}
+
+
+void RunDirectoryObserver::restore(const Snapshot& snapshot)
+{
+    assert( stats.run.state == RunDirectoryObserver::State::INIT );
+    assert( snapshot.runNumber == runNumber );
+
+    std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+
+    stats.run.state = snapshot.runState;
+    stats.run.lastEoLS = snapshot.runLastEoLS;
+    stats.run.lastProcessedFile = snapshot.runLastProcessedFile;
+    stats.fu.state = snapshot.fuState;
+    stats.fu.lastEoLS = snapshot.fuLastEoLS;
+    stats.fu.stopLS = snapshot.fuStopLS;
+    stats.fu.lastPoppedFile = snapshot.fuLastPoppedFile;
+
+    for (const auto& file : snapshot.queue) {
+        queue.push( file );
+    }
+
+    if (!groups.empty()) {
+        groupFiles.insert( snapshot.groupFiles.begin(), snapshot.groupFiles.end() );
+        groupFiles.insert( snapshot.queue.begin(), snapshot.queue.end() );
+    }
+
+    for (auto& pair : groups) {
+        ConsumerGroup& group = pair.second;
+        const auto restored = std::find_if( snapshot.groups.begin(), snapshot.groups.end(),
+            [&pair](const Snapshot::Group& g) { return g.name == pair.first; } );
+
+        if (restored != snapshot.groups.end()) {
+            group.state = restored->state;
+            group.lastPoppedFile = restored->lastPoppedFile;
+            group.lastEoLS = restored->lastEoLS;
+            group.stopLS = restored->stopLS;
+            group.lateFiles = restored->lateFiles;
+            continue;
+        }
+
+        // A new group continues from where the primary FUs are, the files given before the handoff are gone for it
+        group.state = snapshot.fuState;
+        group.lastPoppedFile = snapshot.fuLastPoppedFile;
+        group.lastEoLS = snapshot.fuLastEoLS;
+        if (group.lastPoppedFile.type != FileInfo::FileType::EMPTY) {
+            for (const auto& file : snapshot.queue) {
+                if (file < group.lastPoppedFile && file.type == FileInfo::FileType::INDEX && (int)file.lumiSection > group.lastEoLS) {
+                    group.lateFiles.push_back( file );
+                }
+            }
+        }
+    }
+    if (!groups.empty()) {
+        removeGroupFiles();
+    }
+    stats.queueSizeMax = queue.size();
+    isRestored = true;
+
+    readFileMetadata( snapshot.queue );
+}
+
+
+bool RunDirectoryObserver::getFileMetadata(const FileInfo& file, FileMetadata& fileMetadata, bool isGiven)
+{
+    return metadataReader && metadata->get( file, fileMetadata, isGiven );
+}
+
+
+void RunDirectoryObserver::freeze(bool frozen)
+{
+    WRITE_ONCE(isFrozen, frozen);
+}
+
+
 /**************************************************************************
  * PRIVATE
  */
 
 
-void RunDirectoryObserver::pushFile(bu::FileInfo file)
+void RunDirectoryObserver::notifyListeners()
+{
+    std::lock_guard<std::mutex> lock(listenersLock);
+    listeners.erase( 
+        std::remove_if(listeners.begin(), listeners.end(), [](Listener_t& listener) { return !listener(); }),
+        listeners.end() );
+}
+
+
+void RunDirectoryObserver::pushFile(bu::FileInfo file, uint64_t discoveredNs)
 {
     std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
-    queue.push( std::move(file) );
+    if (!groups.empty()) {
+        pushGroupFile( file );
+    }
+    TOOLS_PROBE(file_push, runNumber, file.lumiSection, file.index, (int)file.type);
+    pushQueueFile( std::move(file), discoveredNs );
     stats.nbJsnFilesProcessed++;
     uint32_t size = queue.size();
     if (size > stats.queueSizeMax) {
@@ -88,6 +348,43 @@ void RunDirectoryObserver::pushFile(bu::FileInfo file)
 }
 
 
+/*
+ * Publishes files of one inotify read with a single lock acquisition, so during bursts
+ * the producer doesn't fight for the lock with FUs for every file. The files are moved out.
+ */
+void RunDirectoryObserver::pushFiles(files_t& files, uint64_t discoveredNs)
+{
+    std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+
+    updateArrivalHints(files);
+
+    for (auto& file : files) {
+        // Count out of order index files
+        if ( 
+            stats.run.lastProcessedFile.lumiSection > file.lumiSection &&
+            stats.run.lastProcessedFile.type == FileInfo::FileType::INDEX &&
+            file.type == FileInfo::FileType::INDEX 
+        ) {
+            stats.run.nbOutOfOrderIndexFiles++;
+        }
+
+        updateRunDirectoryStats( file );
+        if (!groups.empty()) {
+            pushGroupFile( file );
+        }
+        TOOLS_PROBE(file_push, runNumber, file.lumiSection, file.index, (int)file.type);
+        pushQueueFile( std::move(file), discoveredNs );
+    }
+    stats.nbJsnFilesProcessed += files.size();
+    files.clear();
+
+    uint32_t size = queue.size();
+    if (size > stats.queueSizeMax) {
+        stats.queueSizeMax = size;
+    }
+}
+
+
 template< class T >
 void updateStats(int runNumber, const bu::FileInfo& file, T& s)
 {
@@ -121,10 +418,67 @@ void RunDirectoryObserver::updateFUStats(const bu::FileInfo& file)
 }
 
 
+void RunDirectoryObserver::LumiSectionTimes::discovered(const FileInfo& file, uint64_t discoveredNs)
+{
+    if (file.type != FileInfo::FileType::INDEX || discoveredNs == 0) {
+        return;
+    }
+    Times& times = lumiSections[ file.lumiSection ];
+    if (times.firstDiscoveredNs == 0 || discoveredNs < times.firstDiscoveredNs) {
+        times.firstDiscoveredNs = discoveredNs;
+    }
+    times.discoveredNs[ file.index ] = discoveredNs;
+}
+
+
+uint64_t RunDirectoryObserver::LumiSectionTimes::discoveredNs(const FileInfo& file) const
+{
+    const auto times = lumiSections.find( file.lumiSection );
+    if (times == lumiSections.end()) {
+        return 0;
+    }
+    const auto iter = times->second.discoveredNs.find( file.index );
+    return iter != times->second.discoveredNs.end() ? iter->second : 0;
+}
+
+
+void RunDirectoryObserver::LumiSectionTimes::dispatched(const FileInfo& file, Metrics& metrics)
+{
+    if (file.type == FileInfo::FileType::INDEX) {
+        const auto times = lumiSections.find( file.lumiSection );
+        if (times == lumiSections.end()) {
+            return;
+        }
+        const auto iter = times->second.discoveredNs.find( file.index );
+        if (iter != times->second.discoveredNs.end()) {
+            const uint64_t now = tools::metrics::nowNs();
+            metrics.residence.record( now - iter->second );
+            times->second.lastDispatchedNs = now;
+            times->second.discoveredNs.erase( iter );
+        }
+        return;
+    }
+
+    if (file.isEoLS()) {
+        const auto iter = lumiSections.find( file.lumiSection );
+        if (iter != lumiSections.end() && iter->second.firstDiscoveredNs != 0 && iter->second.lastDispatchedNs != 0) {
+            const uint64_t time = iter->second.lastDispatchedNs - iter->second.firstDiscoveredNs;
+            metrics.lumiSection.record( time );
+            metrics.lastLumiSectionNs.store( time, std::memory_order_relaxed );
+        }
+        // Also the older ones, files coming after their EoLS would never be recorded
+        lumiSections.erase( lumiSections.begin(), lumiSections.upper_bound( file.lumiSection ) );
+    } else if (file.isEoR()) {
+        lumiSections.clear();
+    }
+}
+
+
 // Skip empty lumisections
-void RunDirectoryObserver::optimizeAndPushFiles(const bu::files_t& files) 
+void RunDirectoryObserver::optimizeAndPushFiles(const bu::files_t& files, uint64_t discoveredNs) 
 {
-    bool sawIndexFile = false;
+    // Skipping is not possible when FUs are already processing the restored lumisection
+    bool sawIndexFile = isRestored && !queue.empty();
 
     for (auto&& file : files) {
 
@@ -136,14 +490,66 @@ void RunDirectoryObserver::optimizeAndPushFiles(const bu::files_t& files)
             updateRunDirectoryStats( file );
     
             // If we are skipping files, we have to update FU lastEoLS statistics here so it can be correctly reported when FU asks for a file for the first time
+            // Partitions could have been created by a request during the scan, the skipped EoLS never reach their queues
+            std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
             stats.fu.lastEoLS = stats.run.lastEoLS;
+            for (auto& pair : groups) {
+                pair.second.lastEoLS = stats.run.lastEoLS;
+            }
+            for (auto& partition : partitions) {
+                std::lock_guard<std::mutex> partitionLock(partition->lock);
+                partition->lastEoLS = std::max( partition->lastEoLS, stats.run.lastEoLS );
+            }
             continue;
         }
         sawIndexFile = true;
 
         updateRunDirectoryStats( file );
-        pushFile( std::move(file) );
+        pushFile( std::move(file), discoveredNs );
     }
+    readFileMetadata( files );
+}
+
+
+void RunDirectoryObserver::readFileMetadata(const files_t& files)
+{
+    if (metadataReader) {
+        metadataReader->read( metadata, files );
+    }
+}
+
+
+/*
+ * After a handoff the run directory contains files the previous process already put into the queue
+ * and EoLS/EoR files FUs have already seen. Index files given to FUs were renamed, but the listing
+ * could be done before an FU popped them from the restored queue, so they are removed as well.
+ */
+void RunDirectoryObserver::removeRestoredFiles(bu::files_t& files) const
+{
+    std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+
+    FileQueue_t copy = queue;
+    std::vector<FileInfo> queued;
+    queued.reserve( copy.size() );
+    while (!copy.empty()) {
+        queued.push_back( copy.top() );
+        copy.pop();
+    }
+
+    const FileInfo& lastPoppedFile = stats.fu.lastPoppedFile;
+    const int lastEoLS = stats.fu.lastEoLS;
+
+    files.erase(
+        std::remove_if(files.begin(), files.end(), [&](const FileInfo& file) {
+            if (file.type != FileInfo::FileType::EOR && (int)file.lumiSection <= lastEoLS) {
+                return true;
+            }
+            if (lastPoppedFile.type != FileInfo::FileType::EMPTY && !(lastPoppedFile < file)) {
+                return true;
+            }
+            return std::binary_search(queued.cbegin(), queued.cend(), file);
+        }),
+        files.end() );
 }
 
 
@@ -209,6 +615,7 @@ void RunDirectoryObserver::inotifyRunner()
         errorMessage = e.what();
         LOG(ERROR) << "DirectoryObserver: ERROR: \"" << errorMessage << "\", error code: " << e.code();
         LOG(INFO)  << "DirectoryObserver: Finished";
+        notifyListeners();
         return;
     }
     LOG(DEBUG) << "DirectoryObserver: INotify started.";
@@ -227,14 +634,20 @@ void RunDirectoryObserver::inotifyRunner()
     while ( inotify.hasEvent() ) {
         stats.startup.inotify.nbInotifyReadCalls++;
         LOG(DEBUG) << "DirectoryObserver: INotify has something.";
-        
-        for (auto&& event : inotify.read()) {
+
+        const tools::INotify::Events_t events = inotify.read();
+        TOOLS_PROBE(inotify_read, runNumber, events.size());
+        tools::recorder::record( tools::recorder::type::INOTIFY_READ, runNumber, events.size() );
+        metrics.inotifyBatch.record( events.size() );
+
+        for (auto&& event : events) {
             stats.startup.inotify.nbAllFiles++;
 
             if ( std::regex_match( event.name, fileFilter) ) {
                 stats.startup.inotify.nbJsnFiles++;
 
                 bu::FileInfo file = bu::temporary::parseFileName( event.name.c_str() );
+                TOOLS_PROBE(file_parse, file.runNumber, file.lumiSection, file.index, (int)file.type);
 
                 // Add files that are not duplicates
                 if ( std::find(files.cbegin(), files.cend(), file) == files.cend() ) {
@@ -247,6 +660,13 @@ void RunDirectoryObserver::inotifyRunner()
         }
     }
 
+    // Files known from the previous process must not be given twice
+    if (isRestored) {
+        removeRestoredFiles(files);
+    }
+
+    const uint64_t discoveredNs = tools::metrics::nowNs();
+
     // Sort the files according LS and INDEX numbers
     std::sort(files.begin(), files.end());
 
@@ -259,7 +679,7 @@ void RunDirectoryObserver::inotifyRunner()
      * PHASE II - Optimize: Determine the first usable .jsn file (and skip empty lumisections)
      */
 
-    optimizeAndPushFiles(files);
+    optimizeAndPushFiles(files, discoveredNs);
 
     // FUs can start reading from our queue NOW
 
@@ -270,6 +690,21 @@ void RunDirectoryObserver::inotifyRunner()
         // If we have some files in the queue then we are ready for requests
         stats.fu.state = bu::RunDirectoryObserver::State::READY;
     }
+    {
+        std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+        for (auto& pair : groups) {
+            if (pair.second.state == bu::RunDirectoryObserver::State::STARTING || pair.second.state == bu::RunDirectoryObserver::State::INIT) {
+                pair.second.state = groupFiles.empty() ? stats.run.state : bu::RunDirectoryObserver::State::READY;
+            }
+        }
+        for (auto& partition : partitions) {
+            std::lock_guard<std::mutex> partitionLock(partition->lock);
+            if (partition->state == bu::RunDirectoryObserver::State::STARTING || partition->state == bu::RunDirectoryObserver::State::INIT) {
+                partition->state = partition->queue.empty() ? stats.run.state : bu::RunDirectoryObserver::State::READY;
+            }
+        }
+    }
+    notifyListeners();
 
     LOG(DEBUG) 
         << "DirectoryObserver statistics:\n" 
@@ -281,9 +716,16 @@ void RunDirectoryObserver::inotifyRunner()
 
 
     // Process any new file receives through INotify
+    bu::files_t batch;
     while ( ! READ_ONCE(stopRequest) ) {
 
-        for (auto&& event : inotify.read()) {
+        const tools::INotify::Events_t events = inotify.read();
+        TOOLS_PROBE(inotify_read, runNumber, events.size());
+        tools::recorder::record( tools::recorder::type::INOTIFY_READ, runNumber, events.size() );
+        const uint64_t discoveredNs = tools::metrics::nowNs();
+        metrics.inotifyBatch.record( events.size() );
+
+        for (auto&& event : events) {
             stats.inotify.nbAllFiles++;
 
             //TODO: Make it optional
@@ -291,25 +733,22 @@ void RunDirectoryObserver::inotifyRunner()
 
             if ( std::regex_match( event.name, fileFilter) ) {
                 bu::FileInfo file = bu::temporary::parseFileName( event.name.c_str() );
+                TOOLS_PROBE(file_parse, file.runNumber, file.lumiSection, file.index, (int)file.type);
                 //LOG(DEBUG) << file.fileName();
 
                 stats.inotify.nbJsnFiles++;
-
-                // Count out of order index files
-                if ( 
-                    stats.run.lastProcessedFile.lumiSection > file.lumiSection &&
-                    stats.run.lastProcessedFile.type == FileInfo::FileType::INDEX &&
-                    file.type == FileInfo::FileType::INDEX 
-                ) {
-                    stats.run.nbOutOfOrderIndexFiles++;
-                }
-
-                updateRunDirectoryStats( file );
-                pushFile( std::move(file) );
+                batch.push_back( std::move(file) );
             }
         }
         stats.inotify.nbInotifyReadCalls++;
 
+        if (!batch.empty()) {
+            // The reader gets the files first, so it has a head start before FUs
+            readFileMetadata( batch );
+            pushFiles( batch, discoveredNs );
+        }
+        notifyListeners();
+
         // If we get EOR then we don't expect any new files to appear and we can stop this thread
         if ( stats.run.state == bu::RunDirectoryObserver::State::EOR ) {
             break;
@@ -359,13 +798,17 @@ bool RunDirectoryObserver::isStopLS(int stopLS) const
 // Starts the inotify thread
 void RunDirectoryObserver::start()
 {
-    assert( stats.run.state == RunDirectoryObserver::State::INIT );
+    assert( isRestored || stats.run.state == RunDirectoryObserver::State::INIT );
+
+    // A restored observer keeps serving FUs from the restored queue while the run directory is scanned
+    if (!isRestored) {
+        stats.run.state = RunDirectoryObserver::State::STARTING;
+        stats.fu.state = RunDirectoryObserver::State::STARTING;
+    }
 
     runnerThread = std::thread(&RunDirectoryObserver::runner, this);
     // FIXME: We detach because at the moment we don't have a way how to stop the thread
     runnerThread.detach();
-    stats.run.state = RunDirectoryObserver::State::STARTING;
-    stats.fu.state = RunDirectoryObserver::State::STARTING;
 }
 
 
@@ -384,7 +827,7 @@ void RunDirectoryObserver::stopAndWait()
 }
 
 
-std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::popRunFile(int stopLS)
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::popRunFile(int stopLS, RetryHint* hint, const Admit_t& admit)
 {
     static const FileInfo emptyFile; 
     FileInfo file;  // Is empty on construction
@@ -392,14 +835,40 @@ std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::p
     int lastEoLS;
 
     std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+    // Destroyed before the lock is released
+    tools::metrics::timer lockHoldTimer(metrics.popLockHold);
+
+    if (isPartitioned) {
+        throw std::invalid_argument( "ERROR: The run is consumed in lumisection partitions (lsmod=" + std::to_string(partitioning.mod) + "), lsmod and lspart are required" );
+    }
 
     stats.fu.nbRequests++;
 
+    // Files are not given during the handoff to a new process
+    if (READ_ONCE(isFrozen)) {
+        stats.fu.nbEmptyReplies++;
+        if (hint) {
+            // The handoff takes a moment only
+            hint->retryAfterMs = bu::getRetryMinMs();
+        }
+        return std::make_tuple( emptyFile, stats.fu.state, stats.fu.lastEoLS );
+    }
+
     if (isStopLS(stopLS)) {
         stats.fu.stopLS = stopLS;
         return std::make_tuple( emptyFile, RunDirectoryObserver::State::EOR, stopLS );
     }
 
+    stats.hints.queueSize.update( queue.size() );
+
+    /*
+     * With speculative dispatch, index files up to speculativeLS lumisections ahead of the next expected EoLS
+     * are given before the EoLS arrives. EoLS files are still taken strictly in order, so lastEoLS stays right,
+     * and files beyond stopLS are never reached because isStopLS() answers EOR first.
+     */
+    const int speculativeLS = bu::getSpeculativeLS();
+    bool isDeferred = false;
+
     while (!queue.empty()) {
         const FileInfo& peekFile = queue.top();
 
@@ -412,11 +881,22 @@ std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::p
 
             // If we receive a file for a having larger LS than the expected, we keep it in the queue and wait for EoLS
             if ((int)peekFile.lumiSection > (stats.fu.lastEoLS + 1)) {
-                stats.fu.nbWaitsForEoLS++;
-                file.type = FileInfo::FileType::EMPTY;
-                break;
+                if (peekFile.type == FileInfo::FileType::EOLS || (int)peekFile.lumiSection > (stats.fu.lastEoLS + 1 + speculativeLS)) {
+                    stats.fu.nbWaitsForEoLS++;
+                    file.type = FileInfo::FileType::EMPTY;
+                    break;
+                }
+                stats.fu.nbSpeculativeFiles++;
             }
         }
+
+        // The scheduler can keep the file for another FU
+        if (peekFile.type == FileInfo::FileType::INDEX && admit && !admit(peekFile)) {
+            stats.fu.nbDeferred++;
+            isDeferred = true;
+            file.type = FileInfo::FileType::EMPTY;
+            break;
+        }
         
         file = std::move( peekFile );
         queue.pop();
@@ -427,15 +907,23 @@ std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::p
             stats.fu.lastPoppedFile.type != FileInfo::FileType::EMPTY &&
             file.type != FileInfo::FileType::EOR
         ) {
-            std::ostringstream os;
-            os  << "Consistency check failed, file order is broken:\n"
-                << "  Going to give file:            " << file.fileName() << '\n' 
-                << "  But the last file given to FU: " << stats.fu.lastPoppedFile.fileName();
-            LOG(FATAL) << os.str();
-            THROW( std::runtime_error, os.str() );
+            // Late files (and the awaited EoLS) of a not yet closed LS can come after speculatively given files
+            if (speculativeLS > 0 && (int)file.lumiSection > stats.fu.lastEoLS) {
+                if (file.type == FileInfo::FileType::INDEX) {
+                    stats.fu.nbOutOfOrderFiles++;
+                }
+            } else {
+                std::ostringstream os;
+                os  << "Consistency check failed, file order is broken:\n"
+                    << "  Going to give file:            " << file.fileName() << '\n' 
+                    << "  But the last file given to FU: " << stats.fu.lastPoppedFile.fileName();
+                LOG(FATAL) << os.str();
+                THROW( std::runtime_error, os.str() );
+            }
         }
 
         updateFUStats( file );
+        lumiSectionTimes.dispatched( file, metrics );
 
         // Is EoR then we can free the queue
         if (file.type == FileInfo::FileType::EOR) {
@@ -461,12 +949,348 @@ std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::p
 
     if ( file.type == FileInfo::FileType::EMPTY ) {
         stats.fu.nbEmptyReplies++; 
+        if (hint && isDeferred) {
+            // The file is there, it is only not for this FU now
+            hint->retryAfterMs = bu::getRetryMinMs();
+        } else if (hint && state != RunDirectoryObserver::State::EOR) {
+            // Files left in the queue are waiting for EoLS
+            *hint = computeRetryHint( !queue.empty() );
+        }
     }
 
+    TOOLS_PROBE(file_pop, runNumber, (int)state, file.type == FileInfo::FileType::EMPTY ? lastEoLS : (int)file.lumiSection, file.index, (int)file.type);
+    tools::recorder::record( tools::recorder::type::POP, runNumber, (uint32_t)state, file.type == FileInfo::FileType::EMPTY ? lastEoLS : (int)file.lumiSection, file.index, (uint32_t)file.type );
     return std::make_tuple( file, state, lastEoLS );
 }
 
 
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::popGroupFile(const std::string& groupName, int stopLS, RetryHint* hint)
+{
+    static const FileInfo emptyFile; 
+    FileInfo file;  // Is empty on construction
+
+    std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+
+    const auto iter = groups.find( groupName );
+    if (iter == groups.end()) {
+        throw std::invalid_argument( "Unknown consumer group '" + groupName + '\'' );
+    }
+    ConsumerGroup& group = iter->second;
+    group.nbRequests++;
+
+    if (READ_ONCE(isFrozen)) {
+        group.nbEmptyReplies++;
+        return std::make_tuple( emptyFile, group.state, group.lastEoLS );
+    }
+
+    while (true) {
+        // Late files are before the cursor, so they go first
+        const auto late = std::min_element( group.lateFiles.begin(), group.lateFiles.end() );
+        const bool isLate = (late != group.lateFiles.end());
+        const auto next = (group.lastPoppedFile.type == FileInfo::FileType::EMPTY) ? groupFiles.cbegin() : groupFiles.upper_bound( group.lastPoppedFile );
+
+        if (!isLate && next == groupFiles.cend()) {
+            if (stopLS >= 0 && group.lastEoLS >= stopLS) {
+                group.stopLS = stopLS;
+                return std::make_tuple( emptyFile, RunDirectoryObserver::State::EOR, stopLS );
+            }
+            break;
+        }
+        const FileInfo& peekFile = isLate ? *late : *next;
+
+        // The same as isStopLS() for the primary FUs
+        if (stopLS >= 0 && ( ((int)peekFile.lumiSection == stopLS && peekFile.type == FileInfo::FileType::EOLS) || (int)peekFile.lumiSection > stopLS )) {
+            group.stopLS = stopLS;
+            return std::make_tuple( emptyFile, RunDirectoryObserver::State::EOR, stopLS );
+        }
+
+        if (peekFile.type != FileInfo::FileType::EOR && (int)peekFile.lumiSection > (group.lastEoLS + 1)) {
+            group.nbWaitsForEoLS++;
+            if (hint) {
+                hint->isWaitingForEoLS = true;
+            }
+            break;
+        }
+
+        file = peekFile;
+        if (isLate) {
+            group.lateFiles.erase( late );
+        } else {
+            group.lastPoppedFile = file;
+        }
+        updateStats( runNumber, file, group );
+
+        // Skip EoLS and EoR
+        if (file.type == FileInfo::FileType::EOLS || file.type == FileInfo::FileType::EOR) {
+            if (file.type == FileInfo::FileType::EOLS) {
+                removeGroupFiles();
+            }
+            file.type = FileInfo::FileType::EMPTY;
+            continue;
+        }
+        break;
+    }
+
+    if ( file.type == FileInfo::FileType::EMPTY ) {
+        group.nbEmptyReplies++; 
+    }
+
+    return std::make_tuple( file, group.state, group.lastEoLS );
+}
+
+
+std::tuple< FileInfo, RunDirectoryObserver::State, int > RunDirectoryObserver::popPartitionFile(const LSPartition& lsPartition, int stopLS, RetryHint* hint)
+{
+    static const FileInfo emptyFile; 
+    FileInfo file;  // Is empty on construction
+
+    if (lsPartition.mod < 1 || lsPartition.block < 1 || lsPartition.part < 0 || lsPartition.part >= lsPartition.mod) {
+        throw std::invalid_argument( "ERROR: Wrong lumisection partition, lspart has to be less than lsmod" );
+    }
+
+    if (!isPartitioned.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(runDirectoryObserverLock);
+        if (!isPartitioned) {
+            createPartitions( lsPartition );
+        }
+    }
+    if (lsPartition.mod != partitioning.mod || lsPartition.block != partitioning.block) {
+        throw std::invalid_argument( "ERROR: The run is consumed in lumisection partitions with lsmod=" + std::to_string(partitioning.mod) + " and lsblock=" + std::to_string(partitioning.block) );
+    }
+
+    Partition& partition = *partitions[ lsPartition.part ];
+    std::lock_guard<std::mutex> lock(partition.lock);
+
+    partition.nbRequests++;
+
+    if (READ_ONCE(isFrozen)) {
+        partition.nbEmptyReplies++;
+        return std::make_tuple( emptyFile, partition.state, partition.lastEoLS );
+    }
+
+    // The same as isStopLS(), but the next lumisection of the partition is expected instead of lastEoLS + 1
+    if (stopLS >= 0) {
+        const bool isStop = partition.queue.empty()
+            ? lsPartition.next(partition.lastEoLS) > stopLS
+            : ( (int)partition.queue.top().lumiSection == stopLS && partition.queue.top().isEoLS() ) || (int)partition.queue.top().lumiSection > stopLS;
+        if (isStop) {
+            partition.stopLS = stopLS;
+            return std::make_tuple( emptyFile, RunDirectoryObserver::State::EOR, stopLS );
+        }
+    }
+
+    while (!partition.queue.empty()) {
+        const FileInfo& peekFile = partition.queue.top();
+
+        if (peekFile.type != FileInfo::FileType::EOR && (int)peekFile.lumiSection > lsPartition.next(partition.lastEoLS)) {
+            partition.nbWaitsForEoLS++;
+            if (hint) {
+                hint->isWaitingForEoLS = true;
+            }
+            break;
+        }
+
+        file = peekFile;
+        partition.queue.pop();
+        updateStats( runNumber, file, partition );
+        partition.lastPoppedFile = file;
+        partition.lumiSectionTimes.dispatched( file, metrics );
+
+        // Skip EoLS and EoR
+        if (file.type == FileInfo::FileType::EOLS || file.type == FileInfo::FileType::EOR) {
+            file.type = FileInfo::FileType::EMPTY;
+            continue;
+        }
+        break;
+    }
+
+    if ( file.type == FileInfo::FileType::EMPTY ) {
+        partition.nbEmptyReplies++; 
+    }
+
+    TOOLS_PROBE(file_pop, runNumber, (int)partition.state, file.type == FileInfo::FileType::EMPTY ? partition.lastEoLS : (int)file.lumiSection, file.index, (int)file.type);
+    tools::recorder::record( tools::recorder::type::POP, runNumber, (uint32_t)partition.state, file.type == FileInfo::FileType::EMPTY ? partition.lastEoLS : (int)file.lumiSection, file.index, (uint32_t)file.type );
+    return std::make_tuple( file, partition.state, partition.lastEoLS );
+}
+
+
+// Called under the lock. The files already in the queue are moved to the partitions.
+void RunDirectoryObserver::createPartitions(const LSPartition& lsPartition)
+{
+    if (stats.fu.lastPoppedFile.type != FileInfo::FileType::EMPTY) {
+        throw std::invalid_argument( "ERROR: The run is already consumed without lumisection partitions" );
+    }
+
+    partitioning = lsPartition;
+    for (int part = 0; part < lsPartition.mod; part++) {
+        std::unique_ptr<Partition> partition( new Partition() );
+        partition->state = stats.fu.state;
+        partition->lastEoLS = stats.fu.lastEoLS;
+        partitions.push_back( std::move(partition) );
+    }
+
+    while (!queue.empty()) {
+        pushPartitionFile( queue.top(), lumiSectionTimes.discoveredNs(queue.top()) );
+        queue.pop();
+    }
+    FileQueue_t tempQueue;
+    queue = std::move( tempQueue );
+    lumiSectionTimes.lumiSections.clear();
+
+    isPartitioned.store(true, std::memory_order_release);
+
+    LOG(INFO) << "Run " << runNumber << " is split into " << lsPartition.mod << " lumisection partitions of " << lsPartition.block << " lumisection(s)";
+}
+
+
+// Called under the lock
+void RunDirectoryObserver::pushPartitionFile(const bu::FileInfo& file, uint64_t discoveredNs)
+{
+    if (file.isEoR()) {
+        for (auto& partition : partitions) {
+            std::lock_guard<std::mutex> lock(partition->lock);
+            partition->queue.push( file );
+        }
+        return;
+    }
+
+    Partition& partition = *partitions[ partitioning.partitionOf(file.lumiSection) ];
+    std::lock_guard<std::mutex> lock(partition.lock);
+    partition.lumiSectionTimes.discovered( file, discoveredNs );
+    partition.queue.push( file );
+}
+
+
+// Called under the lock
+void RunDirectoryObserver::pushQueueFile(bu::FileInfo file, uint64_t discoveredNs)
+{
+    if (isPartitioned) {
+        pushPartitionFile( file, discoveredNs );
+    } else {
+        lumiSectionTimes.discovered( file, discoveredNs );
+        queue.push( std::move(file) );
+    }
+}
+
+
+// Called under the lock for every new file when consumer groups are defined
+void RunDirectoryObserver::pushGroupFile(const bu::FileInfo& file)
+{
+    if (!groupFiles.insert( file ).second) {
+        return;
+    }
+
+    for (auto& pair : groups) {
+        ConsumerGroup& group = pair.second;
+        if (
+            group.lastPoppedFile.type != FileInfo::FileType::EMPTY &&
+            file < group.lastPoppedFile &&
+            file.type == FileInfo::FileType::INDEX &&
+            (int)file.lumiSection > group.lastEoLS
+        ) {
+            group.lateFiles.push_back( file );
+            group.nbLateFiles++;
+        }
+    }
+}
+
+
+// Removes the files of lumisections closed by all groups
+void RunDirectoryObserver::removeGroupFiles()
+{
+    int lastEoLS = std::numeric_limits<int>::max();
+    for (const auto& pair : groups) {
+        lastEoLS = std::min( lastEoLS, pair.second.lastEoLS );
+    }
+
+    while (!groupFiles.empty()) {
+        const FileInfo& file = *groupFiles.begin();
+        if (file.type == FileInfo::FileType::EOR || (int)file.lumiSection > lastEoLS) {
+            break;
+        }
+        groupFiles.erase( groupFiles.begin() );
+    }
+}
+
+
+/*
+ * Called under the lock for every inotify read with new files.
+ * The index files of one read share the time since the previous read.
+ * Files found at startup are not counted, they would appear as a burst of arrivals.
+ */
+void RunDirectoryObserver::updateArrivalHints(const files_t& files)
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    const auto nbIndexFiles = std::count_if(files.begin(), files.end(), [](const FileInfo& file) { return file.type == FileInfo::FileType::INDEX; });
+    if (nbIndexFiles > 0) {
+        if (stats.hints.lastArrival != Statistics::Hints::time_point_t()) {
+            stats.hints.arrivalInterval.update( std::chrono::duration<double>(now - stats.hints.lastArrival).count() / nbIndexFiles );
+        }
+        stats.hints.lastArrival = now;
+    }
+
+    for (const auto& file : files) {
+        if (file.isEoLS()) {
+            if (stats.hints.lastEoLS != Statistics::Hints::time_point_t()) {
+                stats.hints.lsPeriod.update( std::chrono::duration<double>(now - stats.hints.lastEoLS).count() );
+            }
+            stats.hints.lastEoLS = now;
+        }
+    }
+}
+
+
+/*
+ * Called under the lock for an empty reply. The recommendation is:
+ *   - when files are waiting for EoLS, the expected time of the next EoLS,
+ *   - otherwise the expected time of the next file, but with many FUs waiting they don't all have to poll for it:
+ *     every file satisfies one FU, so it is enough that all waiting FUs together poll about twice per file.
+ *     When there are more empty replies per file, the retry is stretched by the same factor. The recommendation
+ *     itself is not used for the estimate, so FUs ignoring it can't make it grow without limit.
+ * The arrival interval only grows while nothing arrives, so a stalled run is polled less and less (up to the maximum).
+ */
+RunDirectoryObserver::RetryHint RunDirectoryObserver::computeRetryHint(bool isWaitingForEoLS)
+{
+    typedef std::chrono::duration<double> seconds_t;
+    const auto now = std::chrono::steady_clock::now();
+    auto& h = stats.hints;
+    RetryHint hint;
+    hint.isWaitingForEoLS = isWaitingForEoLS;
+
+    if (h.lastEmptyReply != Statistics::Hints::time_point_t()) {
+        h.emptyReplyInterval.update( seconds_t(now - h.lastEmptyReply).count() );
+    }
+    h.lastEmptyReply = now;
+
+    if (h.lsPeriod.valid) {
+        const double sinceEoLS = seconds_t(now - h.lastEoLS).count();
+        hint.nextEoLSMs = (int)( std::max(0.0, h.lsPeriod.value - sinceEoLS) * 1000 );
+    }
+
+    // Without any statistics yet, FUs poll as fast as allowed so the first files are not delayed
+    double retry = 0;
+
+    if (isWaitingForEoLS && hint.nextEoLSMs >= 0) {
+        retry = hint.nextEoLSMs / 1000.0;
+    } else if (h.arrivalInterval.valid) {
+        const double sinceArrival = seconds_t(now - h.lastArrival).count();
+        const double interval = std::max(h.arrivalInterval.value, sinceArrival);
+        const double toNextFile = interval - sinceArrival;
+
+        const double emptyReplyRate = h.emptyReplyInterval.value > 0 ? 1 / h.emptyReplyInterval.value : 0;
+        const double emptyRepliesPerFile = emptyReplyRate * interval;
+
+        retry = std::max(toNextFile, interval * emptyRepliesPerFile / 2);
+    }
+
+    hint.retryAfterMs = std::min( std::max((int)(retry * 1000), bu::getRetryMinMs()), bu::getRetryMaxMs() );
+    h.lastRetryAfterMs = hint.retryAfterMs;
+
+    return hint;
+}
+
+
 /**************************************************************************
  * FRIENDS
  */
@@ -488,6 +1312,18 @@ std::ostream& operator<< (std::ostream& os, RunDirectoryObserver::State state)
     return os;
 }
 
+const char* RunDirectoryObserver::fileExtension(FileMode fileMode)
+{
+    switch (fileMode)
+    {
+        case RunDirectoryObserver::FileMode::JSN:   return ".jsn";
+        case RunDirectoryObserver::FileMode::RAW:   return ".raw";
+        // Omit default case to trigger compiler warning for missing cases
+    };
+    return "";
+}
+
+
 std::ostream& operator<< (std::ostream& os, const RunDirectoryObserver::FileMode fileMode)
 {
     switch (fileMode)
@@ -4,9 +4,16 @@
 #include <queue>
 #include <atomic>
 #include <mutex>
+#include <functional>
+#include <chrono>
+#include <map>
+#include <set>
+#include <unordered_map>
 
 //#include "tools/synchronized/queue.h"
 #include "bu/FileInfo.h"
+#include "bu/FileMetadata.h"
+#include "tools/metrics.h"
 #include "bu.h"
 
 
@@ -51,6 +58,9 @@ public:
     enum class FileMode { JSN, RAW };
     friend std::ostream& operator<< (std::ostream& os, const RunDirectoryObserver::FileMode fileMode);
 
+    // Returns the extension of index files in the given mode (e.g. ".raw")
+    static const char* fileExtension(FileMode fileMode);
+
     /*
      * State defines current state of directory observer
      *   INIT     - Initial state before inotify thread is started, this state is not visible outside.
@@ -64,13 +74,43 @@ public:
     enum class State { INIT, STARTING, READY, EOLS, EOR, ERROR, NORUN };
     friend std::ostream& operator<< (std::ostream& os, const RunDirectoryObserver::State state);
 
-    RunDirectoryObserver(int runNumber/*, FileMode fileMode*/);
+    // Recommendation for FUs that got no file, so they don't have to guess how long to sleep
+    struct RetryHint {
+        int retryAfterMs = -1;                          // When to ask again, -1 when there is nothing to wait for (EoR, error)
+        int nextEoLSMs = -1;                            // Expected time to the next EoLS, -1 when unknown
+        bool isWaitingForEoLS = false;                  // There are files, but their lumisection is not closed yet
+    };
+
+    /*
+     * Lumisection partition: blocks of `block` consecutive lumisections are dealt to `mod` partitions in turn,
+     * lumisection ls belongs to partition `part` when ((ls - 1) / block) % mod == part.
+     */
+    struct LSPartition {
+        int mod = 1;
+        int part = 0;
+        int block = 1;
+
+        int partitionOf(int ls) const { return ((ls - 1) / block) % mod; }
+
+        // The first lumisection of the partition after ls
+        int next(int ls) const {
+            do {
+                ls++;
+            } while (partitionOf(ls) != part);
+            return ls;
+        }
+    };
+
+    // Headers of new files are read by metadataReader when given (see bu/FileMetadata.h)
+    RunDirectoryObserver(int runNumber/*, FileMode fileMode*/, FileMetadataReader* metadataReader = nullptr);
     ~RunDirectoryObserver();
 
     RunDirectoryObserver(const RunDirectoryObserver&) = delete;
     RunDirectoryObserver& operator=(const RunDirectoryObserver&) = delete;
     
     std::string getStats() const;
+    // Adds the metrics of the run, labeled with the run number (see /metrics)
+    void getMetrics(tools::metrics::exposition& exposition) const;
     const std::string& getError() const;
 
     // Start inotify thread
@@ -82,17 +122,96 @@ public:
      * 
      * TODO: Candidate for structured binding with std::optional in C++17
      */
-    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunFile(int stopLS = -1);
+    // Returns false when the file has to be left for another FU (see bu/Scheduler.h)
+    typedef std::function<bool(const FileInfo& file)> Admit_t;
+
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popRunFile(int stopLS = -1, RetryHint* hint = nullptr, const Admit_t& admit = Admit_t());
+
+    /*
+     * The same for a consumer group (see bu::setConsumerGroups). Every group gets every file, in the lumisection order,
+     * through its own cursor. The group has to exist. Only isWaitingForEoLS of the hint is filled.
+     */
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popGroupFile(const std::string& group, int stopLS = -1, RetryHint* hint = nullptr);
+
+    /*
+     * The same for FUs consuming only one lumisection partition. The first partitioned request splits the queue
+     * into partitions, each with its own lock, EoLS accounting and stopLS, so the partitions don't contend.
+     * From then on the run can be consumed only by partitions with the same mod and block.
+     * Throws std::invalid_argument when the partition doesn't fit the run. Only isWaitingForEoLS of the hint is filled,
+     * the retry hint statistics are protected by the observer lock.
+     */
+    std::tuple< FileInfo, RunDirectoryObserver::State, int > popPartitionFile(const LSPartition& partition, int stopLS = -1, RetryHint* hint = nullptr);
+
+    /*
+     * Listener is called from the inotify thread every time new files were put into the queue or the state changed. 
+     * It has to be fast (i.e. only schedule the work) and return false when it doesn't want to be called anymore.
+     */
+    typedef std::function<bool()> Listener_t;
+    void addListener(Listener_t&& listener);
+
+    /*
+     * State handed over to a new broker process (see bu/Handoff.h). It is enough to continue serving FUs
+     * without the startup phase, files that appeared meanwhile are found by the rescan of the new process.
+     */
+    struct Snapshot {
+        int runNumber;
+        State runState;
+        int runLastEoLS;
+        FileInfo runLastProcessedFile;
+        State fuState;
+        int fuLastEoLS;
+        int fuStopLS;
+        FileInfo fuLastPoppedFile;
+        std::vector<FileInfo> queue;
+
+        // Consumer groups with their own cursors, groupFiles are the files not yet closed by all groups
+        struct Group {
+            std::string name;
+            State state;
+            FileInfo lastPoppedFile;
+            int lastEoLS;
+            int stopLS;
+            std::vector<FileInfo> lateFiles;
+        };
+        std::vector<Group> groups;
+        std::vector<FileInfo> groupFiles;
+    };
+
+    Snapshot getSnapshot() const;
+
+    // Has to be called before start()
+    void restore(const Snapshot& snapshot);
+
+    // A frozen observer doesn't give files to FUs, so the snapshot stays valid until the handoff completes
+    void freeze(bool frozen);
+
+    // Metadata from the file header, false when it is not known (yet), see FileMetadataCache::get
+    bool getFileMetadata(const FileInfo& file, FileMetadata& metadata, bool isGiven = true);
 
 private:
     bool isStopLS(int stopLS) const;
     // The main runner that will call inotifyRunner()
     void runner();
     void inotifyRunner();
-    void pushFile(bu::FileInfo file);
+    void pushFile(bu::FileInfo file, uint64_t discoveredNs);
+    void pushFiles(files_t& files, uint64_t discoveredNs);
+    void updateArrivalHints(const files_t& files);
+    RetryHint computeRetryHint(bool isWaitingForEoLS);
     void updateRunDirectoryStats(const bu::FileInfo& file);
     void updateFUStats(const bu::FileInfo& file);
-    void optimizeAndPushFiles(const files_t& files);
+    void optimizeAndPushFiles(const files_t& files, uint64_t discoveredNs);
+    void removeRestoredFiles(files_t& files) const;
+    void readFileMetadata(const files_t& files);
+    void notifyListeners();
+
+    // Consumer groups
+    void pushGroupFile(const bu::FileInfo& file);
+    void removeGroupFiles();
+
+    // LS partitions
+    void createPartitions(const LSPartition& partition);
+    void pushPartitionFile(const bu::FileInfo& file, uint64_t discoveredNs);
+    void pushQueueFile(bu::FileInfo file, uint64_t discoveredNs);
 
 private:
     int runNumber;
@@ -104,6 +223,8 @@ private:
     std::thread runnerThread;
     std::atomic<bool> isRunning { false };
     std::atomic<bool> stopRequest { false };
+    std::atomic<bool> isFrozen { false };
+    bool isRestored = false;
 
     struct Statistics {
         struct Inotify {
@@ -135,19 +256,119 @@ private:
 
         uint32_t queueSizeMax = 0;                      // The largest queue size ever seen
 
+        // Moving averages used for the retry hints, they are updated under the observer lock
+        struct Hints {
+            struct Ewma {
+                double value = 0;
+                bool valid = false;
+                void update(double sample, double alpha = 0.1) {
+                    value = valid ? value + alpha * (sample - value) : sample;
+                    valid = true;
+                }
+            };
+            typedef std::chrono::steady_clock::time_point time_point_t;
+
+            Ewma arrivalInterval;                       // Seconds between new index files
+            Ewma lsPeriod;                              // Seconds between new EoLS files
+            Ewma emptyReplyInterval;                    // Seconds between empty replies
+            Ewma queueSize;                             // Queue size seen by FU requests
+            time_point_t lastArrival;
+            time_point_t lastEoLS;
+            time_point_t lastEmptyReply;
+            int lastRetryAfterMs = 0;                   // The last recommendation
+        } hints;
+
+        // All FUs together, the counters of every FU are in bu::FUAccounting (see /stats/fu)
         struct FU {
             State state { State::INIT };
             int nbRequests = 0;                         // How many requests we got from FUs
             int nbEmptyReplies = 0;                     // How many times we had no index file to return
             int nbWaitsForEoLS = 0;                     // How many FU requests were postponed because we received 
+            int nbSpeculativeFiles = 0;                 // Files given ahead of a missing EoLS, each one is an empty reply avoided
+            int nbOutOfOrderFiles = 0;                  // Files given after a file of a later LS (only with speculative dispatch)
+            int nbDeferred = 0;                         // How many times the scheduler left the file for another FU
             FileInfo lastPoppedFile;                    // Last file given to FU
             int lastEoLS = 0;                           // Last EoLS FU saw (the next expected is 1)
-            // TODO: The following counter should be counted per FU (maybe)
             int stopLS = -1;                            // Remembers is stopLS was specified in the request from FU
         } fu;
     } stats;
 
-    std::mutex runDirectoryObserverLock;                // Synchronize updates
+    // Recorded without the lock
+    struct Metrics {
+        tools::metrics::histogram popLockHold;          // Nanoseconds popRunFile holds the observer lock
+        tools::metrics::histogram inotifyBatch;         // Events returned by one inotify read
+        tools::metrics::histogram residence;            // Nanoseconds from the discovery of an index file until it is given to FU
+        tools::metrics::histogram lumiSection;          // Nanoseconds from the discovery of the first index file of a lumisection until the last one is given
+        std::atomic<uint64_t> lastLumiSectionNs { 0 };  // The last value of lumiSection
+    } metrics;
+
+    /*
+     * Lumisections not given completely yet, the time of a lumisection is recorded when its EoLS is given
+     * (EoLS comes after all index files of the lumisection). Used under the lock of the queue the files are in.
+     * The discovery times of files are kept here rather than in FileInfo, which stays 16 bytes.
+     */
+    struct LumiSectionTimes {
+        struct Times {
+            uint64_t firstDiscoveredNs = 0;
+            uint64_t lastDispatchedNs = 0;
+            std::unordered_map<uint32_t, uint64_t> discoveredNs;   // Index files not given yet, by their index
+        };
+        std::map<uint32_t, Times> lumiSections;
+
+        // discoveredNs is from tools::metrics::nowNs, 0 when unknown (e.g. a file from the handoff)
+        void discovered(const FileInfo& file, uint64_t discoveredNs);
+        uint64_t discoveredNs(const FileInfo& file) const;
+        void dispatched(const FileInfo& file, Metrics& metrics);
+    };
+    LumiSectionTimes lumiSectionTimes;                  // Of the main queue, protected by runDirectoryObserverLock
+
+    mutable std::mutex runDirectoryObserverLock;        // Synchronize updates
+
+    /*
+     * Consumer groups share one list of files in the order they are given (stored only when groups are defined).
+     * The cursor of a group is the last file it handled, files of a not yet closed lumisection that appear behind
+     * the cursor are remembered by the group as late files. Files are removed when all groups closed their lumisection.
+     */
+    struct ConsumerGroup {
+        State state { State::INIT };
+        int nbRequests = 0;
+        int nbEmptyReplies = 0;
+        int nbWaitsForEoLS = 0;
+        int nbLateFiles = 0;
+        FileInfo lastPoppedFile;                        // The cursor in groupFiles (EMPTY before the first file)
+        int lastEoLS = 0;
+        int stopLS = -1;
+        std::vector<FileInfo> lateFiles;
+    };
+    std::set<FileInfo> groupFiles;                      // Protected by runDirectoryObserverLock
+    std::map<std::string, ConsumerGroup> groups;
+
+    /*
+     * After the split, files are put directly into the partition queues (the queue above stays empty).
+     * The producer takes the observer lock and then the partition lock, FUs take only the partition lock.
+     * The partitions are created once and never change, so they can be used without the observer lock.
+     */
+    struct Partition {
+        std::mutex lock;
+        FileQueue_t queue;
+        State state { State::INIT };
+        int nbRequests = 0;
+        int nbEmptyReplies = 0;
+        int nbWaitsForEoLS = 0;
+        FileInfo lastPoppedFile;
+        int lastEoLS = 0;                               // The last closed lumisection of this partition
+        int stopLS = -1;
+        LumiSectionTimes lumiSectionTimes;
+    };
+    std::vector< std::unique_ptr<Partition> > partitions;
+    LSPartition partitioning;                           // mod and block of the partitions
+    std::atomic<bool> isPartitioned { false };
+
+    FileMetadataReader* metadataReader;
+    FileMetadataCachePtr metadata;                      // Has its own lock, it is filled from the reader thread
+
+    std::vector<Listener_t> listeners;
+    std::mutex listenersLock;
 };
 
 typedef std::shared_ptr<RunDirectoryObserver> RunDirectoryObserverPtr;
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+#include "bu/Scheduler.h"
+
+
+namespace bu {
+
+typedef std::chrono::duration<double> seconds_t;
+
+
+double Scheduler::FU::decayedShare(Clock_t::time_point now, std::chrono::seconds shareTime) const
+{
+    return share * std::exp( -seconds_t(now - shareUpdated).count() / seconds_t(shareTime).count() );
+}
+
+
+bool Scheduler::FU::waits(Clock_t::time_point now, std::chrono::milliseconds time) const
+{
+    return isWaiting && now - lastRequest < time;
+}
+
+
+namespace {
+
+class FcfsPolicy : public Scheduler::Policy {
+public:
+    const char* name() const override { return "fcfs"; }
+
+    bool admit(const std::string&, Scheduler::FU&, const Scheduler::FUs_t&, const FileInfo&, Scheduler::Clock_t::time_point) override
+    {
+        return true;
+    }
+};
+
+
+/*
+ * FU is deferred when another waiting FU got fewer files recently (by more than one file, so two FUs don't defer
+ * each other). With weights, the number of files is divided by the rate the FU consumes files, so faster FUs get
+ * proportionally more. A FU without a known rate yet counts as having no files.
+ */
+class FairSharePolicy : public Scheduler::Policy {
+public:
+    FairSharePolicy(bool isWeighted, const Scheduler::Config& config) : isWeighted(isWeighted), config(config) {}
+
+    const char* name() const override { return isWeighted ? "weighted" : "roundrobin"; }
+
+    bool admit(const std::string& name, Scheduler::FU& fu, const Scheduler::FUs_t& fus, const FileInfo&, Scheduler::Clock_t::time_point now) override
+    {
+        const double myShare = normalized( fu, fu.decayedShare(now, config.shareTime) - 1 );
+
+        for (const auto& pair : fus) {
+            if (pair.first == name || !pair.second.waits(now, config.hungryTime)) {
+                continue;
+            }
+            if (normalized( pair.second, pair.second.decayedShare(now, config.shareTime) ) < myShare) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    double normalized(const Scheduler::FU& fu, double share) const
+    {
+        if (!isWeighted) {
+            return share;
+        }
+        const double rate = fu.rate();
+        return rate > 0 ? share / rate : 0;
+    }
+
+    const bool isWeighted;
+    const Scheduler::Config& config;
+};
+
+
+// Keeps the file for a waiting FU that got the previous files of the same lumisection
+class AffinityPolicy : public Scheduler::Policy {
+public:
+    explicit AffinityPolicy(const Scheduler::Config& config) : config(config) {}
+
+    const char* name() const override { return "affinity"; }
+
+    bool admit(const std::string& name, Scheduler::FU& fu, const Scheduler::FUs_t& fus, const FileInfo& file, Scheduler::Clock_t::time_point now) override
+    {
+        if (fu.lastLS == (int)file.lumiSection) {
+            return true;
+        }
+        for (const auto& pair : fus) {
+            if (pair.first != name && pair.second.lastLS == (int)file.lumiSection && pair.second.waits(now, config.affinityTime)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    const Scheduler::Config& config;
+};
+
+
+class CapPolicy : public Scheduler::Policy {
+public:
+    explicit CapPolicy(const Scheduler::Config& config) : config(config) {}
+
+    const char* name() const override { return "cap"; }
+
+    bool admit(const std::string&, Scheduler::FU& fu, const Scheduler::FUs_t&, const FileInfo&, Scheduler::Clock_t::time_point) override
+    {
+        return fu.outstanding.size() < config.maxOutstanding;
+    }
+
+private:
+    const Scheduler::Config& config;
+};
+
+} // namespace
+
+
+Scheduler::Scheduler(const std::vector<std::string>& names, const Config& config) : config(config)
+{
+    for (const auto& name : names) {
+        if (name == "fcfs") {
+            policies.emplace_back( new FcfsPolicy() );
+        } else if (name == "roundrobin") {
+            policies.emplace_back( new FairSharePolicy(false, this->config) );
+        } else if (name == "weighted") {
+            policies.emplace_back( new FairSharePolicy(true, this->config) );
+        } else if (name == "affinity") {
+            policies.emplace_back( new AffinityPolicy(this->config) );
+        } else if (name == "cap") {
+            policies.emplace_back( new CapPolicy(this->config) );
+        } else {
+            throw std::invalid_argument("unknown scheduling policy '" + name + "', use fcfs, roundrobin, weighted, affinity or cap");
+        }
+    }
+}
+
+
+Scheduler::FU& Scheduler::getFU(const std::string& name)
+{
+    auto iter = fus.find( name );
+    if (iter != fus.end()) {
+        return iter->second;
+    }
+
+    if (fus.size() >= config.maxFUs) {
+        const auto oldest = std::min_element( fus.begin(), fus.end(),
+            [](const FUs_t::value_type& a, const FUs_t::value_type& b) { return a.second.lastRequest < b.second.lastRequest; });
+        fus.erase( oldest );
+        nbEvicted++;
+    }
+    return fus[ name ];
+}
+
+
+void Scheduler::onRequest(const std::string& name, unsigned int done)
+{
+    const auto now = Clock_t::now();
+    std::lock_guard<std::mutex> lock(schedulerLock);
+
+    FU& fu = getFU( name );
+    fu.nbRequests++;
+    fu.lastRequest = now;
+
+    // Files reported done are the oldest ones, files FU never reports expire
+    while (!fu.outstanding.empty() && (done > 0 || now - fu.outstanding.front() > config.fileTimeout)) {
+        fu.outstanding.pop_front();
+        if (done > 0) {
+            done--;
+        }
+    }
+}
+
+
+bool Scheduler::admit(const std::string& name, const FileInfo& file)
+{
+    const auto now = Clock_t::now();
+    std::lock_guard<std::mutex> lock(schedulerLock);
+
+    FU& fu = getFU( name );
+    for (auto& policy : policies) {
+        if (!policy->admit(name, fu, fus, file, now)) {
+            policy->nbDeferred++;
+            fu.nbDeferred++;
+            return false;
+        }
+        policy->nbAdmitted++;
+    }
+    return true;
+}
+
+
+void Scheduler::onReply(const std::string& name, const FileInfo& file)
+{
+    const auto now = Clock_t::now();
+    std::lock_guard<std::mutex> lock(schedulerLock);
+
+    FU& fu = getFU( name );
+    if (file.type == FileInfo::FileType::EMPTY) {
+        fu.nbEmptyReplies++;
+        fu.isWaiting = true;
+        return;
+    }
+
+    if (fu.nbFiles > 0) {
+        const double interval = seconds_t(now - fu.lastFile).count();
+        fu.fileInterval = (fu.fileInterval > 0) ? fu.fileInterval + 0.1 * (interval - fu.fileInterval) : interval;
+    }
+    fu.share = fu.decayedShare(now, config.shareTime) + 1;
+    fu.shareUpdated = now;
+    fu.nbFiles++;
+    fu.lastFile = now;
+    fu.isWaiting = false;
+    fu.lastLS = file.lumiSection;
+    fu.outstanding.push_back( now );
+}
+
+
+std::string Scheduler::getStats() const
+{
+    const char *sep = "  ";
+    const auto now = Clock_t::now();
+    std::ostringstream os;
+
+    std::lock_guard<std::mutex> lock(schedulerLock);
+
+    os << "scheduler:\n";
+    os << sep << "scheduler.policy=\"";
+    for (std::size_t i = 0; i < policies.size(); i++) {
+        os << (i > 0 ? "," : "") << policies[i]->name();
+    }
+    os << "\"\n";
+    for (const auto& policy : policies) {
+        os << sep << "scheduler." << policy->name() << ".nbAdmitted="    << policy->nbAdmitted << '\n';
+        os << sep << "scheduler." << policy->name() << ".nbDeferred="    << policy->nbDeferred << '\n';
+    }
+    os << sep << "scheduler.nbFUs="                         << fus.size() << '\n';
+    os << sep << "scheduler.nbFUsEvicted="                  << nbEvicted << '\n';
+
+    for (const auto& pair : fus) {
+        const std::string prefix = "scheduler.fu." + pair.first + '.';
+        const FU& fu = pair.second;
+        os << sep << prefix << "nbRequests="                << fu.nbRequests << '\n';
+        os << sep << prefix << "nbFiles="                   << fu.nbFiles << '\n';
+        os << sep << prefix << "nbEmptyReplies="            << fu.nbEmptyReplies << '\n';
+        os << sep << prefix << "nbDeferred="                << fu.nbDeferred << '\n';
+        os << sep << prefix << "share="                     << fu.decayedShare(now, config.shareTime) << '\n';
+        os << sep << prefix << "rate="                      << fu.rate() << '\n';
+        os << sep << prefix << "outstanding="               << fu.outstanding.size() << '\n';
+        os << sep << prefix << "lastLS="                    << fu.lastLS << '\n';
+        os << sep << prefix << "lastRequestMs="             << std::chrono::duration_cast<std::chrono::milliseconds>(now - fu.lastRequest).count() << '\n';
+    }
+    os << '\n';
+
+    return os.str();
+}
+
+} // namespace bu
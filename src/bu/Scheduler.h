@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bu/FileInfo.h"
+
+
+namespace bu {
+
+/*
+ * Decides which FU gets the next file. FUs pull files, so the scheduler can only admit the file to the asking FU
+ * or defer it: a deferred FU gets an empty reply and the file stays in the queue for another FU.
+ *
+ * FUs identify themselves with the fu parameter of /popfile, anonymous requests are always admitted.
+ * The table of FUs is bounded: when it is full, the FU not seen for the longest time is dropped.
+ * The policies are chained, a file is admitted when all of them admit it:
+ *   fcfs       - first come first served (the default, no policy at all)
+ *   roundrobin - a FU is deferred when a waiting FU got fewer files recently
+ *   weighted   - the same, but the number of files is relative to the rate the FU consumes files
+ *   affinity   - files of a lumisection are kept for the waiting FU that processes that lumisection
+ *   cap        - a FU has at most maxOutstanding files (given and not reported done or timed out)
+ */
+class Scheduler {
+public:
+    typedef std::chrono::steady_clock Clock_t;
+
+    struct Config {
+        std::chrono::seconds shareTime { 10 };          // Time constant of the decaying number of files given to FU
+        std::chrono::milliseconds hungryTime { 1000 };  // How long FU that got an empty reply is considered waiting
+        std::chrono::milliseconds affinityTime { 500 }; // How long a file is kept for the FU processing its lumisection
+        unsigned int maxOutstanding = 4;                // Files FU can have at once (cap policy)
+        std::chrono::seconds fileTimeout { 60 };        // Files not reported done are counted as done after this time
+        std::size_t maxFUs = 4096;                      // FUs remembered at once
+    };
+
+    struct FU {
+        uint64_t nbRequests = 0;
+        uint64_t nbFiles = 0;
+        uint64_t nbEmptyReplies = 0;
+        uint64_t nbDeferred = 0;
+        double share = 0;                               // Number of files given, decaying with shareTime
+        double fileInterval = 0;                        // Seconds between files given to the FU (moving average)
+        Clock_t::time_point shareUpdated;
+        Clock_t::time_point lastRequest;
+        Clock_t::time_point lastFile;
+        bool isWaiting = false;                         // The last reply was empty
+        int lastLS = -1;                                // Lumisection of the last file
+        std::deque<Clock_t::time_point> outstanding;   // When the outstanding files were given
+
+        double decayedShare(Clock_t::time_point now, std::chrono::seconds shareTime) const;
+        double rate() const { return fileInterval > 0 ? 1 / fileInterval : 0; }
+        bool waits(Clock_t::time_point now, std::chrono::milliseconds time) const;
+    };
+    typedef std::unordered_map<std::string, FU> FUs_t;
+
+    class Policy {
+    public:
+        virtual ~Policy() {}
+        virtual const char* name() const = 0;
+        virtual bool admit(const std::string& name, FU& fu, const FUs_t& fus, const FileInfo& file, Clock_t::time_point now) = 0;
+
+        uint64_t nbAdmitted = 0;
+        uint64_t nbDeferred = 0;
+    };
+
+    // Policies are given by their names, throws std::invalid_argument for an unknown one
+    Scheduler(const std::vector<std::string>& policies, const Config& config);
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // FU asks for a file, done is how many of its files are finished since the last request
+    void onRequest(const std::string& fu, unsigned int done);
+
+    // Called with the next file FU would get, false defers the file to another FU
+    bool admit(const std::string& fu, const FileInfo& file);
+
+    // FU got the file (or an empty reply when the file is empty)
+    void onReply(const std::string& fu, const FileInfo& file);
+
+    std::string getStats() const;
+
+private:
+    // Returns the FU, a new one replaces the least recently seen FU when the table is full
+    FU& getFU(const std::string& name);
+
+private:
+    const Config config;
+    std::vector< std::unique_ptr<Policy> > policies;
+
+    FUs_t fus;
+    uint64_t nbEvicted = 0;
+    mutable std::mutex schedulerLock;
+};
+
+} // namespace bu
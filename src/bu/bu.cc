@@ -1,20 +1,37 @@
 #include <boost/range.hpp>      // For boost::make_iterator_range
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <cstdio>
 #include <regex>
+#include <sys/stat.h>           // For chmod
 
+#include "tools/log.h"
+#include "tools/metrics.h"
+#include "tools/probes.h"
+#include "tools/recorder/recorder.h"
 #include "bu.h"
 
 namespace fs = boost::filesystem;
 
 static fs::path baseDirectory = "/fff/ramdisk";
 static std::string indexFilePrefix = "fu/";
+static int retryMinMs = 10;
+static int retryMaxMs = 1000;
+static int speculativeLS = 0;
+static std::vector<std::string> consumerGroups;
+static tools::metrics::histogram renameLatency;
 
 void bu::setBaseDirectory(const fs::path& path)
 {
     baseDirectory = path;
 }
 
+const fs::path& bu::getBaseDirectory()
+{
+    return baseDirectory;
+}
+
 void bu::setIndexFilePrefix(const std::string& prefix) {
     fs::path prefixPath = prefix;
     fs::path path = prefixPath / "f";
@@ -29,6 +46,127 @@ const fs::path bu::getRunDirectory(int runNumber) {
     return baseDirectory / ("run" + std::to_string(runNumber)); 
 }
 
+void bu::setRetryBounds(int minMs, int maxMs) {
+    retryMinMs = minMs;
+    retryMaxMs = std::max(minMs, maxMs);
+}
+
+int bu::getRetryMinMs() {
+    return retryMinMs;
+}
+
+int bu::getRetryMaxMs() {
+    return retryMaxMs;
+}
+
+void bu::setSpeculativeLS(int nbLS) {
+    speculativeLS = std::max(nbLS, 0);
+}
+
+int bu::getSpeculativeLS() {
+    return speculativeLS;
+}
+
+void bu::setConsumerGroups(const std::vector<std::string>& groups) {
+    consumerGroups = groups;
+}
+
+const std::vector<std::string>& bu::getConsumerGroups() {
+    return consumerGroups;
+}
+
+bool bu::isConsumerGroup(const std::string& group) {
+    return std::find(consumerGroups.begin(), consumerGroups.end(), group) != consumerGroups.end();
+}
+
+bool bu::isValidFUName(const std::string& name) {
+    return name.size() <= 64 && std::all_of(name.begin(), name.end(), [](char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    });
+}
+
+const tools::metrics::histogram& bu::getRenameLatency() {
+    return renameLatency;
+}
+
+
+#define EXISTS(b)   (b ? "yes" : "NO !!!")
+
+static void diagnoseRenameFailure(const std::string& fileName, const std::string& filePrefix, const fs::path& runDirectoryPath, const fs::path& fileFrom, const fs::path fileTo)
+{
+    LOG(DEBUG) << "---- DIAGNOSE ----";
+    try {
+        LOG(DEBUG) << "fileName         = \"" << fileName << '\"';
+        LOG(DEBUG) << "filePrefix       = \"" << filePrefix << '\"';
+        LOG(DEBUG) << "runDirectoryPath = " << runDirectoryPath << ", exists = " << EXISTS(fs::is_directory(runDirectoryPath));
+        LOG(DEBUG) << "fileFrom         = " << fileFrom << ", exists = " << EXISTS(fs::is_regular_file(fileFrom));
+        LOG(DEBUG) << "fileTo           = " << fileTo;
+        fs::path fuDirectory = fileTo.parent_path();
+        LOG(DEBUG) << "fuDirectory      = " << fuDirectory << ", exists = " << EXISTS(fs::is_directory(fuDirectory));
+    }
+    catch (fs::filesystem_error& e) {
+        LOG(ERROR) << "DIAGNOSE failed with: " << e.what();
+    }
+}
+
+/*
+ * This will rename the index file based on filePrefix variable and if necessary create output directory specified in filePrefix.
+ */
+void bu::renameIndexFile(int runNumber, const std::string& filePrefix, const std::string& fileName)
+{
+    const fs::path runDirectoryPath = bu::getRunDirectory( runNumber ); 
+    const fs::path fileFrom = runDirectoryPath / fileName;
+    const fs::path fileTo = runDirectoryPath / ( filePrefix + fileName );
+    tools::metrics::timer renameTimer(renameLatency);
+    TOOLS_PROBE(rename_start, runNumber, fileName.c_str());
+
+    // For the flight recorder, the name was already matched by the index file filter
+    unsigned int lumiSection = 0, index = 0;
+    std::sscanf( fileName.c_str(), "run%*u_ls%u_index%u", &lumiSection, &index );
+
+    bool retry = false;
+    do {
+        try {
+            fs::rename( fileFrom, fileTo );
+            if (retry) {
+                LOG(DEBUG) << "Index file rename was succesfull.";
+            }
+            break;
+        }
+        catch (fs::filesystem_error& e) {
+            if (e.code() == boost::system::errc::no_such_file_or_directory) {
+                if (!retry) {
+                    const fs::path fuPath = runDirectoryPath / filePrefix;
+                    LOG(DEBUG) << "Index file rename failed, probably the directory for renamed files is missing, trying to create it: " << fuPath << '.';
+                    try {
+                        fs::create_directory( fuPath );
+                        // TODO: fix this with boost properly
+                        chmod( fuPath.string().c_str(), 0777 );
+                        LOG(DEBUG) << "Directory was created.";
+                        retry = true;
+                        continue;
+                    }
+                    catch (fs::filesystem_error& e) {
+                        LOG(ERROR) << "Creating directory " << fuPath << " failed.";
+                    }
+                } 
+            }
+
+            // Changing global state for the ERROR in thread unsafe. So for the moment we just abort.
+            //runDirectoryManager.setError( runNumber, e.what() );
+
+            std::string errorStr { "Index file rename failed: " };
+            errorStr += e.what(); 
+            LOG(FATAL) << errorStr << '.';
+            diagnoseRenameFailure( fileName, filePrefix, runDirectoryPath, fileFrom, fileTo);
+            tools::recorder::record( tools::recorder::type::RENAME, runNumber, lumiSection, index, renameTimer.elapsedNs() / 1000, false );
+            RETHROW( std::runtime_error, errorStr );
+        }
+    } while (retry);
+    tools::recorder::record( tools::recorder::type::RENAME, runNumber, lumiSection, index, renameTimer.elapsedNs() / 1000, true );
+    TOOLS_PROBE(rename_end, runNumber, fileName.c_str());
+}
+
 
 /* 
  * This will iterate over run directory and return files matching regular expressing in fileFilter.
@@ -46,6 +184,7 @@ bu::files_t bu::listFilesInRunDirectory(const std::string& runDirectory, const s
 
             if ( std::regex_match( fileName, fileFilter) ) {
                 bu::FileInfo file = bu::temporary::parseFileName( fileName.c_str() );
+                TOOLS_PROBE(file_parse, file.runNumber, file.lumiSection, file.index, (int)file.type);
                 //std::cout << fileName << " : " << file << '\n';
 
                 // Consistency check for the moment
@@ -4,6 +4,7 @@
 #include <regex>
 
 #include "bu/FileInfo.h"
+#include "tools/metrics.h"
 
 namespace fs = boost::filesystem;
 
@@ -22,10 +23,33 @@ namespace bu {
     };
 
     void setBaseDirectory(const fs::path& path);
+    const fs::path& getBaseDirectory();
     void setIndexFilePrefix(const std::string& prefix);
     const std::string& getIndexFilePrefix();
     const fs::path getRunDirectory(int runNumber);
 
+    // Bounds of the retry hint given to FUs in empty replies
+    void setRetryBounds(int minMs, int maxMs);
+    int getRetryMinMs();
+    int getRetryMaxMs();
+
+    // How many lumisections ahead of the last EoLS files are given to FUs (0 waits for every EoLS)
+    void setSpeculativeLS(int nbLS);
+    int getSpeculativeLS();
+
+    // Named consumer groups getting every file in addition to the primary FUs (see RunDirectoryObserver::popGroupFile)
+    void setConsumerGroups(const std::vector<std::string>& groups);
+    const std::vector<std::string>& getConsumerGroups();
+    bool isConsumerGroup(const std::string& group);
+
+    // FU names (the fu parameter of /popfile) are made of [A-Za-z0-9_-], they appear in the keys of /stats
+    bool isValidFUName(const std::string& name);
+
+    // Renames the index file before it is given to FU (creates the directory from filePrefix if necessary)
+    void renameIndexFile(int runNumber, const std::string& filePrefix, const std::string& fileName);
+    // Time spent in renameIndexFile, in nanoseconds
+    const tools::metrics::histogram& getRenameLatency();
+
 
     typedef std::vector<bu::FileInfo> files_t;
     
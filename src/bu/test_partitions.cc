@@ -0,0 +1,108 @@
+#include <unistd.h>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "bu/bu.h"
+#include "bu/RunDirectoryObserver.h"
+
+/*
+ * Tests of the lumisection partitions of a run (see RunDirectoryObserver::popPartitionFile).
+ */
+
+const int runNumber = 100;
+
+
+void touch(const fs::path& path)
+{
+    std::ofstream file( path.string() );
+}
+
+
+std::string fileName(int ls, int index)
+{
+    char name[64];
+    if (index > 0) {
+        snprintf(name, sizeof(name), "run%06d_ls%04d_index%06d.raw", runNumber, ls, index);
+    } else {
+        snprintf(name, sizeof(name), "run%06d_ls%04d_EoLS.jsn", runNumber, ls);
+    }
+    return name;
+}
+
+
+// Pops until a file is given, the startup scan runs meanwhile
+bu::FileInfo popFile(bu::RunDirectoryObserver& observer, const bu::RunDirectoryObserver::LSPartition& partition)
+{
+    for (int i = 0; i < 200; ++i) {
+        const bu::FileInfo file = std::get<0>( observer.popPartitionFile(partition) );
+        if (file.type != bu::FileInfo::FileType::EMPTY) {
+            return file;
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+    }
+    return bu::FileInfo();
+}
+
+
+/*
+ * Partitions created before the startup scan, which skips empty lumisections at the beginning of the run.
+ * The skipped EoLS never reach the partitions, they have to continue after them anyway.
+ */
+void test_partitions_before_scan(const fs::path& baseDirectory)
+{
+    const fs::path runDirectory = baseDirectory / ("run" + std::to_string(runNumber));
+    fs::create_directories( runDirectory );
+
+    // LS 1-3 are empty
+    for (int ls = 1; ls <= 3; ++ls) {
+        touch( runDirectory / fileName(ls, 0) );
+    }
+    for (int ls = 4; ls <= 5; ++ls) {
+        touch( runDirectory / fileName(ls, 1) );
+        touch( runDirectory / fileName(ls, 0) );
+    }
+
+    bu::RunDirectoryObserver::LSPartition lsEven;
+    lsEven.mod = 2;
+    lsEven.part = 1;
+    bu::RunDirectoryObserver::LSPartition lsOdd;
+    lsOdd.mod = 2;
+    lsOdd.part = 0;
+
+    bu::RunDirectoryObserver observer( runNumber );
+    // Splits the queue, the scan did not start yet
+    observer.popPartitionFile( lsEven );
+    observer.start();
+
+    const bu::FileInfo lsEvenFile = popFile( observer, lsEven );
+    assert( lsEvenFile.type == bu::FileInfo::FileType::INDEX && lsEvenFile.lumiSection == 4 && lsEvenFile.index == 1 );
+
+    const bu::FileInfo lsOddFile = popFile( observer, lsOdd );
+    assert( lsOddFile.type == bu::FileInfo::FileType::INDEX && lsOddFile.lumiSection == 5 && lsOddFile.index == 1 );
+    (void)lsEvenFile;
+    (void)lsOddFile;
+
+    observer.stopAndWait();
+}
+
+
+int main()
+{
+    char directory[] = "/tmp/bufu_test_partitions.XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        std::cerr << "Cannot create a temporary directory\n";
+        return 1;
+    }
+    const fs::path baseDirectory( directory );
+    bu::setBaseDirectory( baseDirectory );
+
+    test_partitions_before_scan( baseDirectory );
+    std::cout << "test_partitions_before_scan: OK" << std::endl;
+
+    fs::remove_all( baseDirectory );
+    return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "server.hpp"
 #include <iostream>
+#include <thread>
 
 int main(int argc, char* argv[])
 {
@@ -60,6 +61,18 @@ int main(int argc, char* argv[])
                 res.body().append("test3");
             });
 
+        // The response is completed later from another thread
+        s.request_handler().add_async("/async",
+            [](const http_server::request_t& req, http_server::async_response res) {
+                (void)req;
+                std::thread([res]() mutable {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    res.response().set(http::field::content_type, "text/plain");
+                    res.response().body().append("async: Hello, I'm alive!");
+                    res.complete();
+                }).detach();
+            });
+
         // Run the server until stopped.
         s.run();
     } catch (std::exception& e) {
@@ -0,0 +1,155 @@
+#include <boost/beast/version.hpp>
+#include <algorithm>
+#include <sstream>
+
+#include "admission.hpp"
+
+namespace http_server {
+
+/*
+ * The response is always the same, so it is built only once and then written directly to the socket
+ */
+static std::string make_service_unavailable(unsigned int retry_after, bool close)
+{
+    std::ostringstream os;
+    os  << "HTTP/1.1 503 Service Unavailable\r\n"
+        << "Server: " << BOOST_BEAST_VERSION_STRING << "\r\n"
+        << "Content-Type: text/plain\r\n"
+        << "Retry-After: " << retry_after << "\r\n"
+        << "Content-Length: 0\r\n";
+    if (close) {
+        os << "Connection: close\r\n";
+    }
+    os << "\r\n";
+    return os.str();
+}
+
+
+admission::admission(const admission_config& config)
+    : config_(config)
+    , service_unavailable_(make_service_unavailable(config.retry_after, false))
+    , service_unavailable_close_(make_service_unavailable(config.retry_after, true))
+{
+}
+
+
+bool admission::open_connection()
+{
+    unsigned int nb = ++nb_connections_;
+    if (config_.max_connections > 0 && nb > config_.max_connections) {
+        nb_connections_--;
+        nb_shed_connections_++;
+        return false;
+    }
+    nb_connections_accepted_++;
+
+    // Remember the maximum
+    unsigned int max = nb_connections_max_.load(std::memory_order_relaxed);
+    while (nb > max && !nb_connections_max_.compare_exchange_weak(max, nb, std::memory_order_relaxed)) {}
+
+    return true;
+}
+
+
+void admission::close_connection()
+{
+    nb_connections_--;
+}
+
+
+std::size_t admission::key_hash::operator()(const key_t& key) const
+{
+    // FNV-1a
+    std::size_t hash = 14695981039346656037ull;
+    for (unsigned char byte : key) {
+        hash = (hash ^ byte) * 1099511628211ull;
+    }
+    return hash;
+}
+
+
+bool admission::allow_request(const address_t& address)
+{
+    if (config_.client_rate <= 0) {
+        return true;
+    }
+
+    const key_t key = address.is_v6() ? address.to_v6().to_bytes() : boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+    const double burst = std::max(config_.client_burst, 1.0);
+    const auto now = std::chrono::steady_clock::now();
+
+    shard& s = shards_[ key_hash()(key) % nb_shards ];
+    std::lock_guard<std::mutex> lock(s.lock);
+
+    auto iter = s.buckets.find(key);
+    if (iter == s.buckets.end()) {
+        const std::size_t max_buckets = config_.max_clients / nb_shards + 1;
+        if (s.buckets.size() >= max_buckets) {
+            prune_unlocked(s, now);
+        }
+        // All clients are active, the one silent for the longest time gives its place
+        if (s.buckets.size() >= max_buckets) {
+            auto oldest = std::min_element(s.buckets.begin(), s.buckets.end(),
+                [](const std::pair<const key_t, bucket>& a, const std::pair<const key_t, bucket>& b) { return a.second.last < b.second.last; });
+            s.buckets.erase(oldest);
+            nb_evicted_clients_++;
+        }
+        iter = s.buckets.emplace(key, bucket{ burst, now }).first;
+    }
+
+    // Refill
+    bucket& b = iter->second;
+    const double elapsed = std::chrono::duration<double>(now - b.last).count();
+    b.tokens = std::min(burst, b.tokens + elapsed * config_.client_rate);
+    b.last = now;
+
+    if (b.tokens < 1.0) {
+        nb_shed_requests_++;
+        return false;
+    }
+    b.tokens -= 1.0;
+    return true;
+}
+
+
+/*
+ * Removes buckets that would be already full again, i.e. clients that are not limited anyway
+ */
+void admission::prune_unlocked(shard& s, std::chrono::steady_clock::time_point now)
+{
+    const double burst = std::max(config_.client_burst, 1.0);
+    for (auto iter = s.buckets.begin(); iter != s.buckets.end(); ) {
+        const double elapsed = std::chrono::duration<double>(now - iter->second.last).count();
+        if (iter->second.tokens + elapsed * config_.client_rate >= burst) {
+            iter = s.buckets.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+
+std::string admission::stats() const
+{
+    const char *sep = "  ";
+    std::ostringstream os;
+
+    os << "http:\n";
+    os << sep << "http.maxConnections="             << config_.max_connections << '\n';
+    os << sep << "http.clientRate="                 << config_.client_rate << '\n';
+    os << sep << "http.clientBurst="                << config_.client_burst << '\n';
+    os << sep << "http.nbConnections="              << nb_connections_.load() << '\n';
+    os << sep << "http.nbConnectionsMax="           << nb_connections_max_.load() << '\n';
+    os << sep << "http.nbConnectionsAccepted="      << nb_connections_accepted_.load() << '\n';
+    os << sep << "http.nbShedConnections="          << nb_shed_connections_.load() << '\n';
+    os << sep << "http.nbShedRequests="             << nb_shed_requests_.load() << '\n';
+    os << sep << "http.nbEvictedClients="           << nb_evicted_clients_.load() << '\n';
+    os << sep << "http.nbHeaderTimeouts="           << nb_header_timeouts_.load() << '\n';
+    os << sep << "http.nbBodyTimeouts="             << nb_body_timeouts_.load() << '\n';
+    os << sep << "http.nbWriteTimeouts="            << nb_write_timeouts_.load() << '\n';
+    os << '\n';
+
+    return os.str();
+}
+
+} // namespace http_server
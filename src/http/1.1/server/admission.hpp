@@ -0,0 +1,170 @@
+#ifndef HTTPD_ADMISSION_HPP
+#define HTTPD_ADMISSION_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace http_server {
+
+/// Limits applied to incoming connections and requests (0 means unlimited)
+struct admission_config {
+    unsigned int max_connections = 0;                           // Maximum number of concurrently open connections
+    double client_rate = 0;                                     // Sustained requests per second allowed for one client address
+    double client_burst = 0;                                    // Token bucket size, i.e. how many requests a client can send at once
+    unsigned int retry_after = 1;                               // Seconds reported in Retry-After when a request is shed
+    std::size_t max_clients = 4096;                             // Upper bound of the token bucket table (the least recently seen client is dropped)
+    std::chrono::milliseconds header_timeout { 30000 };         // Deadline for reading the request header (also keep-alive idle time)
+    std::chrono::milliseconds body_timeout { 30000 };           // Deadline for reading the request body
+    std::chrono::milliseconds write_timeout { 30000 };          // Deadline for writing the response
+};
+
+
+/*
+ * Admission control for the HTTP server
+ *
+ * Counts open connections against a cap and keeps a token bucket for each client address.
+ * When a limit is exceeded the connection or the request is shed with a 503 response
+ * that is serialized only once, at construction.
+ */
+class admission {
+public:
+    typedef boost::asio::ip::address address_t;
+
+    admission(const admission&) = delete;
+    admission& operator=(const admission&) = delete;
+
+    explicit admission(const admission_config& config);
+
+    const admission_config& config() const
+    {
+        return config_;
+    }
+
+    // Returns false if the connection has to be shed
+    bool open_connection();
+    void close_connection();
+
+    // Returns false if the client exceeded its request rate
+    bool allow_request(const address_t& address);
+
+    // Pre-serialized "503 Service Unavailable" responses
+    const std::string& service_unavailable(bool close) const
+    {
+        return close ? service_unavailable_close_ : service_unavailable_;
+    }
+
+    unsigned int nb_connections() const
+    {
+        return nb_connections_.load();
+    }
+
+    // When draining, connections are closed after the response (Connection: close)
+    void drain()            { draining_ = true; }
+    bool draining() const   { return draining_.load(std::memory_order_relaxed); }
+
+    void count_header_timeout() { nb_header_timeouts_++; }
+    void count_body_timeout()   { nb_body_timeouts_++; }
+    void count_write_timeout()  { nb_write_timeouts_++; }
+
+    std::string stats() const;
+
+private:
+    typedef std::array<unsigned char, 16> key_t;
+
+    struct key_hash {
+        std::size_t operator()(const key_t& key) const;
+    };
+
+    struct bucket {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    // The token bucket table is split into shards, so clients don't serialize on one mutex
+    struct shard {
+        std::mutex lock;
+        std::unordered_map<key_t, bucket, key_hash> buckets;
+    };
+
+    static constexpr std::size_t nb_shards = 16;
+
+    void prune_unlocked(shard& s, std::chrono::steady_clock::time_point now);
+
+private:
+    const admission_config config_;
+    const std::string service_unavailable_;
+    const std::string service_unavailable_close_;
+
+    std::array<shard, nb_shards> shards_;
+
+    std::atomic<bool> draining_ { false };
+    std::atomic<unsigned int> nb_connections_ { 0 };
+    std::atomic<unsigned int> nb_connections_max_ { 0 };
+    std::atomic<uint64_t> nb_connections_accepted_ { 0 };
+    std::atomic<uint64_t> nb_shed_connections_ { 0 };
+    std::atomic<uint64_t> nb_shed_requests_ { 0 };
+    std::atomic<uint64_t> nb_evicted_clients_ { 0 };            // Buckets dropped while still limiting, the table was full
+    std::atomic<uint64_t> nb_header_timeouts_ { 0 };
+    std::atomic<uint64_t> nb_body_timeouts_ { 0 };
+    std::atomic<uint64_t> nb_write_timeouts_ { 0 };
+};
+
+
+/*
+ * A connection counted by admission::open_connection(), it is closed when the slot is destroyed.
+ * The slot moves with the socket when a stream handler takes over the connection (SSE, WebSocket),
+ * so long-lived connections keep counting against max_connections.
+ */
+class connection_slot {
+public:
+    connection_slot() = default;
+
+    explicit connection_slot(admission& admission)
+        : admission_(&admission)
+    {
+    }
+
+    connection_slot(const connection_slot&) = delete;
+    connection_slot& operator=(const connection_slot&) = delete;
+
+    connection_slot(connection_slot&& other) noexcept
+        : admission_(other.admission_)
+    {
+        other.admission_ = nullptr;
+    }
+
+    connection_slot& operator=(connection_slot&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            admission_ = other.admission_;
+            other.admission_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~connection_slot()
+    {
+        release();
+    }
+
+    void release()
+    {
+        if (admission_ != nullptr) {
+            admission_->close_connection();
+            admission_ = nullptr;
+        }
+    }
+
+private:
+    admission* admission_ = nullptr;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_ADMISSION_HPP
@@ -0,0 +1,213 @@
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/version.hpp>
+#include <sstream>
+
+#include "event_stream.hpp"
+#include "fail.hpp"
+
+namespace http_server {
+
+event_stream::event_stream(boost::asio::io_context& ioc, std::chrono::milliseconds interval, producer_t&& producer)
+    : strand_(boost::asio::make_strand(ioc))
+    , timer_(strand_)
+    , interval_(interval)
+    , producer_(std::move(producer))
+{
+}
+
+
+void event_stream::run()
+{
+    do_tick();
+}
+
+
+void event_stream::subscribe(tcp::socket&& socket, connection_slot&& slot)
+{
+    auto sp = std::make_shared<tcp::socket>(std::move(socket));
+    auto slot_sp = std::make_shared<connection_slot>(std::move(slot));
+
+    boost::asio::post(strand_,
+        [self = shared_from_this(), sp, slot_sp]() {
+            static const auto header = std::make_shared<const std::string>(
+                "HTTP/1.1 200 OK\r\n"
+                "Server: " BOOST_BEAST_VERSION_STRING "\r\n"
+                "Content-Type: text/event-stream\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Connection: keep-alive\r\n"
+                "\r\n");
+
+            self->subscribers_.emplace_front( std::move(*sp), std::move(*slot_sp) );
+            auto iter = self->subscribers_.begin();
+            self->enqueue(iter, header);
+            if (self->snapshot_) {
+                self->enqueue(iter, self->snapshot_);
+            }
+            // A closed connection is noticed even when nothing is published for a long time
+            self->do_read(iter);
+        });
+}
+
+
+void event_stream::publish(const std::string& event, const std::string& data)
+{
+    message_t message = make_message(event, data);
+
+    for (auto iter = subscribers_.begin(); iter != subscribers_.end(); ) {
+        // enqueue() can remove the subscriber
+        auto current = iter++;
+        enqueue(current, message);
+    }
+}
+
+
+void event_stream::set_snapshot(const std::string& event, const std::string& data)
+{
+    snapshot_ = make_message(event, data);
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+/*
+ * Formats the event according to the text/event-stream format, every line of the data has to be prefixed
+ */
+event_stream::message_t event_stream::make_message(const std::string& event, const std::string& data)
+{
+    std::ostringstream os;
+    os << "event: " << event << '\n';
+
+    std::istringstream is(data);
+    std::string line;
+    while (std::getline(is, line)) {
+        os << "data: " << line << '\n';
+    }
+    os << '\n';
+
+    return std::make_shared<const std::string>( os.str() );
+}
+
+
+void event_stream::do_tick()
+{
+    timer_.expires_after(interval_);
+    timer_.async_wait(
+        [self = shared_from_this()](boost::system::error_code ec) {
+            if (ec) {
+                return FAIL(ec, "event_stream");
+            }
+            // Nobody is listening, so the producer doesn't need to do anything
+            if (self->has_subscribers()) {
+                self->producer_( *self );
+            }
+            self->do_tick();
+        });
+}
+
+
+void event_stream::enqueue(subscriber_iter_t iter, const message_t& message)
+{
+    if (iter->closed) {
+        return;
+    }
+    if (iter->queue.size() >= max_queue_size) {
+        LOG_RATE(WARNING, 10) << "Event stream subscriber is too slow, dropping it.";
+        return remove(iter);
+    }
+
+    iter->queue.push_back(message);
+    if (!iter->writing) {
+        do_write(iter);
+    }
+}
+
+
+void event_stream::do_write(subscriber_iter_t iter)
+{
+    iter->writing = true;
+    boost::asio::async_write(
+        iter->socket,
+        boost::asio::buffer(*iter->queue.front()),
+        boost::asio::bind_executor(strand_,
+            [self = shared_from_this(), iter](boost::system::error_code ec, std::size_t) {
+                self->on_write(iter, ec);
+            }));
+}
+
+
+void event_stream::on_write(subscriber_iter_t iter, boost::system::error_code ec)
+{
+    iter->writing = false;
+
+    if (iter->closed) {
+        if (!iter->reading) {
+            subscribers_.erase(iter);
+        }
+        return;
+    }
+
+    // Normally the client just closed the page
+    if (ec) {
+        return remove(iter);
+    }
+
+    iter->queue.pop_front();
+    if (!iter->queue.empty()) {
+        do_write(iter);
+    }
+}
+
+
+void event_stream::do_read(subscriber_iter_t iter)
+{
+    iter->reading = true;
+    iter->socket.async_read_some(
+        boost::asio::buffer(iter->read_buffer),
+        boost::asio::bind_executor(strand_,
+            [self = shared_from_this(), iter](boost::system::error_code ec, std::size_t) {
+                self->on_read(iter, ec);
+            }));
+}
+
+
+void event_stream::on_read(subscriber_iter_t iter, boost::system::error_code ec)
+{
+    iter->reading = false;
+
+    if (iter->closed) {
+        if (!iter->writing) {
+            subscribers_.erase(iter);
+        }
+        return;
+    }
+
+    // The client closed the connection
+    if (ec) {
+        return remove(iter);
+    }
+
+    do_read(iter);
+}
+
+
+void event_stream::remove(subscriber_iter_t iter)
+{
+    boost::system::error_code ec;
+    iter->socket.shutdown(tcp::socket::shutdown_both, ec);
+    iter->socket.close(ec);
+
+    if (iter->writing || iter->reading) {
+        // Will be erased when the pending operations complete
+        iter->closed = true;
+        iter->queue.clear();
+    } else {
+        subscribers_.erase(iter);
+    }
+}
+
+} // namespace http_server
@@ -0,0 +1,100 @@
+#ifndef HTTPD_EVENT_STREAM_HPP
+#define HTTPD_EVENT_STREAM_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "admission.hpp"
+
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+namespace http_server {
+
+/*
+ * Server-sent events (text/event-stream) broadcaster
+ *
+ * One producer is called periodically and publishes events, every event is serialized once
+ * and the same buffer is written to all subscribers. The producer is not called when nobody
+ * is subscribed. A new subscriber first receives the snapshot event (if any), so it can apply
+ * the following events that carry only changes.
+ *
+ * All state is accessed only from the strand of the stream.
+ */
+class event_stream : public std::enable_shared_from_this<event_stream> {
+public:
+    typedef std::function<void(event_stream&)> producer_t;
+
+    event_stream(const event_stream&) = delete;
+    event_stream& operator=(const event_stream&) = delete;
+
+    event_stream(boost::asio::io_context& ioc, std::chrono::milliseconds interval, producer_t&& producer);
+
+    // Start calling the producer
+    void run();
+
+    // Takes over the connection of a client, can be called from any thread
+    void subscribe(tcp::socket&& socket, connection_slot&& slot);
+
+    // The following functions are meant to be called only from the producer
+
+    bool has_subscribers() const
+    {
+        return !subscribers_.empty();
+    }
+
+    // Sends the event to all subscribers
+    void publish(const std::string& event, const std::string& data);
+
+    // Sets the event new subscribers receive first
+    void set_snapshot(const std::string& event, const std::string& data);
+
+private:
+    typedef std::shared_ptr<const std::string> message_t;
+
+    struct subscriber {
+        subscriber(tcp::socket&& socket, connection_slot&& slot) : socket(std::move(socket)), slot(std::move(slot)) {}
+
+        tcp::socket socket;
+        connection_slot slot;           // Released when the subscriber is removed
+        std::deque<message_t> queue;
+        bool writing = false;
+        bool reading = false;           // Waiting for the client to close the connection
+        bool closed = false;
+        char read_buffer[64];           // Whatever the client sends is ignored
+    };
+    typedef std::list<subscriber>::iterator subscriber_iter_t;
+
+    // Maximum number of messages waiting for one subscriber, slower subscribers are dropped
+    static constexpr std::size_t max_queue_size = 16;
+
+    static message_t make_message(const std::string& event, const std::string& data);
+
+    void do_tick();
+    void enqueue(subscriber_iter_t iter, const message_t& message);
+    void do_write(subscriber_iter_t iter);
+    void on_write(subscriber_iter_t iter, boost::system::error_code ec);
+    void do_read(subscriber_iter_t iter);
+    void on_read(subscriber_iter_t iter, boost::system::error_code ec);
+    void remove(subscriber_iter_t iter);
+
+private:
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::steady_timer timer_;
+    const std::chrono::milliseconds interval_;
+    producer_t producer_;
+
+    std::list<subscriber> subscribers_;
+    message_t snapshot_;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_EVENT_STREAM_HPP
@@ -17,12 +17,12 @@ namespace http_server {
 /* 
  * Report a failure
  */
-void http_fail(boost::system::error_code ec, const char *what, const char *where, bool throw_exception)
+inline void http_fail(boost::system::error_code ec, const char *what, const char *where, bool throw_exception)
 {
     std::ostringstream os;
     //std::cerr << "ERROR: " << what << ": " << ec.message() << "\n";
     os << where << ": HTTP SERVER ERROR: " << what << ": " << ec.message();
-    LOG(WARNING) << os.str();
+    LOG_RATE(WARNING, 10) << os.str();
     if (throw_exception) {
         throw std::runtime_error(os.str());
     }
@@ -1,21 +1,92 @@
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+
 #include "listener.hpp"
 #include "session.hpp"
 #include "fail.hpp"
 
 namespace http_server {
 
+namespace {
+
+    // How long the request of a shed connection is read at most
+    const std::chrono::seconds linger_timeout(1);
+
+    /*
+     * Closing a connection with the request unread resets it and the client could lose the response,
+     * so the request is read and discarded until they close the connection or the deadline passes.
+     */
+    struct lingering_close : std::enable_shared_from_this<lingering_close> {
+        tcp::socket socket;
+        boost::asio::steady_timer timer;
+        char buffer[4096];
+
+        explicit lingering_close(tcp::socket&& socket)
+            : socket(std::move(socket))
+            , timer(this->socket.get_executor())
+        {
+        }
+
+        void run()
+        {
+            auto self = shared_from_this();
+            timer.expires_after(linger_timeout);
+            timer.async_wait(
+                [self](boost::system::error_code ec) {
+                    if (!ec) {
+                        // The pending read completes with operation_aborted
+                        self->socket.close(ec);
+                    }
+                });
+            do_read();
+        }
+
+        void do_read()
+        {
+            auto self = shared_from_this();
+            socket.async_read_some(
+                boost::asio::buffer(buffer),
+                [self](boost::system::error_code ec, std::size_t) {
+                    if (ec) {
+                        // Closed by them (eof) or by the timer, the socket is closed with the last reference
+                        self->timer.cancel();
+                        return;
+                    }
+                    self->do_read();
+                });
+        }
+    };
+
+} // namespace
+
+
 listener::listener(
         boost::asio::io_context& ioc,
         tcp::endpoint endpoint,
         std::string const& doc_root,
-        const request_handler& req_handler)
+        const request_handler& req_handler,
+        admission& admission,
+        timer_wheel& timer_wheel,
+        int listen_fd)
         : ioc_(ioc)
         , acceptor_(boost::asio::make_strand(ioc))
         , doc_root_(doc_root)
         , request_handler_(req_handler)
+        , admission_(admission)
+        , timer_wheel_(timer_wheel)
 {
     boost::system::error_code ec;
 
+    if (listen_fd >= 0) {
+        // The socket is already bound and listening
+        acceptor_.assign(endpoint.protocol(), listen_fd, ec);
+        if(ec)
+        {
+            THROW_FAIL(ec, "assign");
+        }
+        return;
+    }
+
     // Open the acceptor
     acceptor_.open(endpoint.protocol(), ec);
     if(ec)
@@ -56,6 +127,17 @@ void listener::run()
     do_accept();
 }
 
+void listener::stop()
+{
+    auto self = shared_from_this();
+    boost::asio::post(acceptor_.get_executor(),
+        [self]() {
+            // The pending accept completes with operation_aborted
+            boost::system::error_code ec;
+            self->acceptor_.close(ec);
+        });
+}
+
 void listener::do_accept()
 {
     acceptor_.async_accept(
@@ -67,21 +149,48 @@ void listener::do_accept()
 
 void listener::on_accept(boost::system::error_code ec, tcp::socket socket)
 {
+    // Stopped
+    if(!acceptor_.is_open())
+        return;
+
     if(ec)
     {
         FAIL(ec, "accept");
     }
+    else if (!admission_.open_connection())
+    {
+        // Too many connections
+        shed(std::move(socket));
+    }
     else
     {
         // Create the session and run it
         std::make_shared<session>(
             std::move(socket),
             doc_root_,
-            request_handler_)->run();
+            request_handler_,
+            admission_,
+            timer_wheel_)->run();
     }
 
     // Accept another connection
     do_accept();
 }
 
+void listener::shed(tcp::socket&& socket)
+{
+    // The socket has to live until the response is written and the request read
+    auto sp = std::make_shared<lingering_close>(std::move(socket));
+
+    boost::asio::async_write(
+        sp->socket,
+        boost::asio::buffer(admission_.service_unavailable(true)),
+        [sp](boost::system::error_code ec, std::size_t) {
+            if (!ec) {
+                sp->socket.shutdown(tcp::socket::shutdown_send, ec);
+                sp->run();
+            }
+        });
+}
+
 } // namespace http_server
@@ -12,6 +12,8 @@ namespace http_server {
 
 // Forward declarations
 class request_handler;
+class admission;
+class timer_wheel;
 
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener> {
@@ -19,19 +21,34 @@ class listener : public std::enable_shared_from_this<listener> {
     tcp::acceptor acceptor_;
     std::string const& doc_root_;
     const request_handler& request_handler_;
+    admission& admission_;
+    timer_wheel& timer_wheel_;
 
 public:
     listener(const listener&) = delete;
     listener& operator=(const listener&) = delete;
 
-    explicit listener(boost::asio::io_context& ioc, tcp::endpoint endpoint, std::string const& doc_root, const request_handler& req_handler);
+    // The listen_fd socket is adopted when it is not -1 (e.g. handed over by the previous process)
+    explicit listener(boost::asio::io_context& ioc, tcp::endpoint endpoint, std::string const& doc_root, const request_handler& req_handler,
+        admission& admission, timer_wheel& timer_wheel, int listen_fd = -1);
 
     // Start accepting incoming connections
     void run();
 
+    // Stop accepting incoming connections, can be called from any thread
+    void stop();
+
+    int native_handle()
+    {
+        return acceptor_.native_handle();
+    }
+
     void do_accept();
 
     void on_accept(boost::system::error_code ec, tcp::socket socket);
+
+    // Replies with 503 and closes the connection
+    void shed(tcp::socket&& socket);
 };
 
 } // namespace http_server
@@ -1,6 +1,7 @@
 #ifndef HTTP_REQUEST_HPP
 #define HTTP_REQUEST_HPP
 
+#include <boost/asio/ip/address.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/utility/string_view.hpp>
 
@@ -25,6 +26,12 @@ struct request : http::request<http::string_body> {
     // Inherit constructor(s)
     using http::request<http::string_body>::request;
 
+    request() = default;
+
+    /// Takes over a message produced by the request parser
+    explicit request(http::request<http::string_body>&& other)
+        : http::request<http::string_body>(std::move(other)) {}
+
     /// Parses URI into path and quary parameters
     bool parse_uri();
 
@@ -32,6 +39,10 @@ struct request : http::request<http::string_body> {
     /// Returns a value for query parameter specificied as a key
     bool query(const std::string& key, std::string& value) const;
 
+    /// Address of the client, unspecified when not known
+    const boost::asio::ip::address& remote_address() const { return remote_address_; }
+    void set_remote_address(const boost::asio::ip::address& address) { remote_address_ = address; }
+
 private:
     friend class request_handler;
 
@@ -40,6 +51,8 @@ private:
 
     /// URI path (without query postfix, i.e. before '?' character)
     std::string path_;
+
+    boost::asio::ip::address remote_address_;
 };
 
 bool url_decode(const string_view& in, std::string& out);
@@ -1,11 +1,16 @@
 #ifndef HTTP_REQUEST_HANDLER_HPP
 #define HTTP_REQUEST_HANDLER_HPP
 
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/optional.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "admission.hpp"
 #include "request.hpp"
 
 namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
@@ -17,6 +22,69 @@ typedef http::response<http::string_body> response_t;
 /// Request handler callback
 typedef std::function<void(const request_t& req, response_t& rep)> request_handler_t;
 
+/*
+ * Completion object given to asynchronous request handlers.
+ *
+ * The handler fills response() and calls complete() later, from any thread. Copies share the same
+ * response. The session (and therefore the request given to the handler) is kept alive until
+ * the response is sent, the connection stays open for the next request when keep-alive was asked.
+ * If the last copy is destroyed without calling complete(), "500 Internal Server Error" is sent,
+ * so the client is never left hanging.
+ */
+class async_response {
+public:
+    typedef std::function<void(response_t&&)> send_t;
+
+    async_response(response_t&& res, send_t&& send)
+        : state_(std::make_shared<state>(std::move(res), std::move(send))) {}
+
+    response_t& response()
+    {
+        return state_->res;
+    }
+
+    /// Sends the response, only the first call has an effect
+    void complete()
+    {
+        state_->complete();
+    }
+
+private:
+    struct state {
+        state(response_t&& res, send_t&& send) : res(std::move(res)), send(std::move(send)) {}
+
+        ~state()
+        {
+            if (!completed.load()) {
+                res.result(http::status::internal_server_error);
+                res.body() = "Request handler didn't complete the response.";
+                complete();
+            }
+        }
+
+        void complete()
+        {
+            if (completed.exchange(true)) {
+                return;
+            }
+            res.prepare_payload();
+            send(std::move(res));
+        }
+
+        response_t res;
+        send_t send;
+        std::atomic<bool> completed { false };
+    };
+
+    std::shared_ptr<state> state_;
+};
+
+/// Asynchronous request handler callback
+typedef std::function<void(const request_t& req, async_response rep)> async_request_handler_t;
+
+/// Stream request handler callback, takes over the connection (e.g. for server-sent events) and its admission slot
+typedef std::function<void(const request_t& req, boost::asio::ip::tcp::socket&& socket, connection_slot&& slot)> stream_request_handler_t;
+
 /// The common handler for all incoming requests.
 class request_handler {
 public:
@@ -44,19 +112,49 @@ public:
         handlers_.emplace_back(std::move(path), std::move(handler));
     }
 
+    // Register an asynchronous request handler for the specific path
+    void add_async(std::string&& path, async_request_handler_t&& handler)
+    {
+        async_handlers_.emplace_back(std::move(path), std::move(handler));
+    }
+
+    // Register a stream request handler for the specific path
+    void add_stream(std::string&& path, stream_request_handler_t&& handler)
+    {
+        stream_handlers_.emplace_back(std::move(path), std::move(handler));
+    }
+
     // Returns a request handler for the specific path
     boost::optional<request_handler_t> handler(const std::string& path) const
     {
-        auto iter = std::find_if(handlers_.cbegin(), handlers_.cend(),
-            [&path](const std::pair<std::string, request_handler_t>& handler) { return handler.first == path; });
+        return find(handlers_, path);
+    }
+
+    // Returns an asynchronous request handler for the specific path
+    boost::optional<async_request_handler_t> async_handler(const std::string& path) const
+    {
+        return find(async_handlers_, path);
+    }
 
-        if (iter == handlers_.cend()) {
+    // Returns a stream request handler for the specific path
+    boost::optional<stream_request_handler_t> stream_handler(const std::string& path) const
+    {
+        return find(stream_handlers_, path);
+    }
+
+private:
+    template <class Handler>
+    static boost::optional<Handler> find(const std::vector<std::pair<std::string, Handler>>& handlers, const std::string& path)
+    {
+        auto iter = std::find_if(handlers.cbegin(), handlers.cend(),
+            [&path](const std::pair<std::string, Handler>& handler) { return handler.first == path; });
+
+        if (iter == handlers.cend()) {
             return boost::none;
         }
         return iter->second;
     }
 
-private:
     /// The directory containing the files to be served.
     std::string doc_root_;
 
@@ -65,6 +163,12 @@ private:
 
     /// Store all handlers (Note: vector as a map is the fastest solution for small amount of elements)
     std::vector<std::pair<std::string, request_handler_t>> handlers_;
+
+    /// Handlers completing the response later
+    std::vector<std::pair<std::string, async_request_handler_t>> async_handlers_;
+
+    /// Handlers taking over the connection
+    std::vector<std::pair<std::string, stream_request_handler_t>> stream_handlers_;
 };
 
 } // namespace http_server
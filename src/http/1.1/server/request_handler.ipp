@@ -5,6 +5,8 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/version.hpp>
 
+#include "tools/probes.h"
+
 namespace http_server {
 
 // This function produces an HTTP response for the given
@@ -111,11 +113,7 @@ void request_handler::handle_request(
         path.append("index.html");
     }
 
-    // Find a request handler for the path
-    auto request_handler_func = handler(path);
-    if (!request_handler_func) {
-        return send(not_found(path));
-    } 
+    TOOLS_PROBE(http_request_start, req.path_.c_str());
 
     // Prepare the response
     response_t res{http::status::ok, req.version()};
@@ -123,11 +121,31 @@ void request_handler::handle_request(
     res.set(http::field::content_type, "text/html");
     res.keep_alive(req.keep_alive());
 
-    // Call the particular request handler
-    (*request_handler_func)( req, res );
+    // Find a request handler for the path
+    auto request_handler_func = handler(path);
+    if (request_handler_func) {
+        // Call the particular request handler
+        (*request_handler_func)( req, res );
+        TOOLS_PROBE(http_request_end, req.path_.c_str(), (int)res.result_int());
+
+        res.prepare_payload();
+        return send(std::move(res));
+    }
+
+    // Asynchronous handlers are searched only when there is no synchronous one
+    auto async_request_handler_func = async_handler(path);
+    if (async_request_handler_func) {
+        // The session is kept alive by the deferred send until the handler completes
+        return (*async_request_handler_func)( req, async_response(std::move(res), send.defer()) );
+    }
+
+    // The session ends after the stream handler takes over the connection
+    auto stream_request_handler_func = stream_handler(path);
+    if (stream_request_handler_func) {
+        return (*stream_request_handler_func)( req, send.release_socket(), send.release_slot() );
+    }
 
-    res.prepare_payload();
-    return send(std::move(res));
+    return send(not_found(path));
 }
 
 } // namespace http_server
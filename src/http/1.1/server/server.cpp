@@ -4,39 +4,112 @@
 //
 //------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <vector>
 
+#include "fail.hpp"
 #include "listener.hpp"
+#include "uring_listener.hpp"
 #include "server.hpp"
 
 using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
 namespace http_server {
 
-server::server(const std::string address_str, const std::string port_str, const std::string doc_root, int threads, bool debug_http_requests)
+server::server(const std::string address_str, const std::string port_str, const std::string doc_root, int threads, bool debug_http_requests,
+        const admission_config& admission, backend net_backend, int listen_fd,
+        const thread_pool_config& pool)
     : doc_root_(doc_root)
-    , io_context_(threads)
+    , io_context_(std::max(threads, pool.max_threads))
     , threads_(threads)
     , request_handler_(doc_root_, debug_http_requests)
+    , admission_(admission)
+    , timer_wheel_(io_context_)
+    , backend_(net_backend)
 {
 
     auto const address = boost::asio::ip::make_address(address_str);
     auto const port = static_cast<unsigned short>(std::stoi(port_str));
 
-    // Create and launch a listening port
-    std::make_shared<listener>(
-        io_context_,
-        tcp::endpoint{ address, port },
-        doc_root_,
-        request_handler_)
-        ->run();
+    if (backend_ == backend::IO_URING) {
+        try {
+            uring_listener_.reset( new uring_listener(
+                io_context_,
+                tcp::endpoint{ address, port },
+                doc_root_,
+                request_handler_,
+                admission_,
+                threads,
+                listen_fd) );
+        }
+        catch (const std::system_error& e) {
+            LOG(WARNING) << "io_uring backend is not available (" << e.what() << "), falling back to asio";
+            backend_ = backend::ASIO;
+        }
+    }
+
+    if (backend_ == backend::ASIO) {
+        // Create and launch a listening port
+        listener_ = std::make_shared<listener>(
+            io_context_,
+            tcp::endpoint{ address, port },
+            doc_root_,
+            request_handler_,
+            admission_,
+            timer_wheel_,
+            listen_fd);
+        listener_->run();
+    }
+
+    timer_wheel_.run();
+
+    // With io_uring the connections are served by the uring workers, the io_context needs only one thread
+    if (backend_ == backend::ASIO && pool.max_threads > threads) {
+        thread_pool_.reset( new thread_pool(io_context_, threads, pool) );
+    }
 
     runners_.reserve(threads - 1);
 }
 
+server::~server() = default;
+
+int server::listen_fd()
+{
+    return uring_listener_ ? uring_listener_->native_handle() : listener_->native_handle();
+}
+
+void server::drain()
+{
+    admission_.drain();
+    if (uring_listener_) {
+        uring_listener_->stop();
+    } else {
+        listener_->stop();
+    }
+}
+
+std::string server::stats() const
+{
+    std::string stats = admission_.stats();
+
+    // Backend specific lines go to the end of the "http:" section
+    std::ostringstream os;
+    os << "  http.backend=" << (backend_ == backend::IO_URING ? "io_uring" : "asio") << '\n';
+    if (uring_listener_) {
+        os << uring_listener_->stats();
+    }
+    if (thread_pool_) {
+        os << thread_pool_->stats();
+    }
+    stats.insert(stats.size() - 1, os.str());
+    return stats;
+}
+
 void server::run()
 {
     // The io_context::run() call will block until all asynchronous operations
@@ -44,6 +117,19 @@ void server::run()
     // asynchronous operation outstanding: the asynchronous accept call waiting
     // for new incoming connections.
 
+    if (uring_listener_) {
+        // Connections are served by the io_uring workers, the io_context needs only one thread
+        uring_listener_->run();
+        io_context_.run();
+        return;
+    }
+
+    if (thread_pool_) {
+        // The calling thread monitors the pool
+        thread_pool_->run();
+        return;
+    }
+
     // Run the I/O service on the requested number of threads
     for (auto i = threads_ - 1; i > 0; --i)
         runners_.emplace_back(
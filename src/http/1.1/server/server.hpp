@@ -2,10 +2,20 @@
 #define HTTPD_SERVER_HPP
 
 #include <boost/asio.hpp>
+#include <memory>
 #include "request_handler.hpp"
+#include "admission.hpp"
+#include "timer_wheel.hpp"
+#include "thread_pool.hpp"
 
 namespace http_server {
 
+class listener;
+class uring_listener;
+
+/// Network backend serving the connections
+enum class backend { ASIO, IO_URING };
+
 /// The top-level class of the HTTP server.
 class server {
 public:
@@ -13,15 +23,38 @@ public:
     server& operator=(const server&) = delete;
 
     /// Construct the server to listen on the specified TCP address and port, and
-    /// serve up files from the given directory.
+    /// serve up files from the given directory. An already listening socket
+    /// (e.g. handed over by the previous process) is used when listen_fd is not -1.
     explicit server(const std::string address, const std::string port,
-        const std::string doc_root, int threads, bool debug_http_requests = false);
+        const std::string doc_root, int threads, bool debug_http_requests = false,
+        const admission_config& admission = admission_config(), backend net_backend = backend::ASIO, int listen_fd = -1,
+        const thread_pool_config& pool = thread_pool_config());
+    ~server();
 
     class request_handler& request_handler()
     {
         return request_handler_;
     }
 
+    boost::asio::io_context& io_context()
+    {
+        return io_context_;
+    }
+
+    /// The listening socket, e.g. to hand it over to a new process
+    int listen_fd();
+
+    /// Stops accepting new connections, open connections are closed after their next response
+    void drain();
+
+    unsigned int nb_connections() const
+    {
+        return admission_.nb_connections();
+    }
+
+    /// Returns server statistics (connections, shed requests, ...)
+    std::string stats() const;
+
     /// Run the server's io_service loop.
     void run();
 
@@ -40,6 +73,24 @@ private:
 
     /// The handler for all incoming requests.
     class request_handler request_handler_;
+
+    /// Connection and request limits
+    class admission admission_;
+
+    /// Read deadlines of all sessions
+    class timer_wheel timer_wheel_;
+
+    /// Backend actually used (io_uring falls back to Asio when it is not available)
+    backend backend_;
+
+    /// Accepts connections when the Asio backend is used
+    std::shared_ptr<listener> listener_;
+
+    /// Adapts the number of threads to the load (only when it can grow above threads_)
+    std::unique_ptr<thread_pool> thread_pool_;
+
+    /// Connections served by io_uring, the io_context then runs only timers and taken over connections
+    std::unique_ptr<uring_listener> uring_listener_;
 };
 
 } // namespace http_server
@@ -4,10 +4,13 @@
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
 #include <memory>
 #include <string>
 
 #include "fail.hpp"
+#include "admission.hpp"
+#include "timer_wheel.hpp"
 #include "request_handler.hpp"
 
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
@@ -30,6 +33,10 @@ class session : public std::enable_shared_from_this<session> {
         void
         operator()(http::message<isRequest, Body, Fields>&& msg) const
         {
+            // The connection is closed after the response when the server is draining
+            if (self_.admission_.draining())
+                msg.keep_alive(false);
+
             // The lifetime of the message has to extend
             // for the duration of the async operation so
             // we use a shared_ptr to manage it.
@@ -40,37 +47,93 @@ class session : public std::enable_shared_from_this<session> {
             // pointer in the class to keep it alive.
             self_.res_ = sp;
 
+            // A client that doesn't read the response doesn't keep the connection forever
+            self_.arm_deadline(deadline::WRITE, self_.admission_.config().write_timeout);
+
             // Write the response
             http::async_write(
-                self_.stream_,
+                self_.socket_,
                 *sp,
                 boost::beast::bind_front_handler(
                     &session::on_write,
                     self_.shared_from_this(),
                     sp->need_eof()));
         }
+
+        // Returns a function that sends the response later, from any thread.
+        // It holds the session, so it stays alive until the response is written.
+        std::function<void(response_t&&)> defer() const
+        {
+            auto self = self_.shared_from_this();
+            return [self](response_t&& res) {
+                auto sp = std::make_shared<response_t>(std::move(res));
+                boost::asio::post(self->socket_.get_executor(),
+                    [self, sp]() {
+                        self->lambda_(std::move(*sp));
+                    });
+            };
+        }
+
+        // Gives up the connection, nothing is read or written by the session anymore
+        tcp::socket release_socket() const
+        {
+            return std::move(self_.socket_);
+        }
+
+        // The connection stays counted by admission until the new owner releases the slot
+        connection_slot release_slot() const
+        {
+            return std::move(self_.slot_);
+        }
     };
 
-    boost::beast::tcp_stream stream_;
+    // Which deadline is armed at the moment
+    enum class deadline { NONE, HEADER, BODY, WRITE };
+
+    // NOTE: Timeouts are handled by the timer_wheel, so the plain socket is enough (no need for beast::tcp_stream)
+    tcp::socket socket_;
     boost::beast::flat_buffer buffer_;
     std::string const& doc_root_;
     //http::request<http::string_body> req_;
+    boost::optional<http::request_parser<http::string_body>> parser_;
     http_server::request_t req_;
     std::shared_ptr<void> res_;
     send_lambda lambda_;
     const request_handler& request_handler_;
+    admission& admission_;
+    connection_slot slot_;              // The connection was counted by the listener
+    timer_wheel& timer_wheel_;
+    admission::address_t address_;
+
+    deadline deadline_ = deadline::NONE;
+    timer_wheel::handle_t deadline_handle_;
+    uint64_t deadline_generation_ = 0;  // Invalidates deadlines that fired while being cancelled
+    bool timed_out_ = false;
 
 public:
     // Take ownership of the socket
     session(
         tcp::socket&& socket,
         std::string const& doc_root,
-        const request_handler& req_handler)
-        : stream_(std::move(socket))
+        const request_handler& req_handler,
+        admission& admission,
+        timer_wheel& timer_wheel)
+        : socket_(std::move(socket))
         , doc_root_(doc_root)
         , lambda_(*this)
         , request_handler_(req_handler)
+        , admission_(admission)
+        , slot_(admission)
+        , timer_wheel_(timer_wheel)
     {
+        boost::system::error_code ec;
+        address_ = socket_.remote_endpoint(ec).address();
+    }
+
+    ~session()
+    {
+        // Frees the entry holding this session's memory (through a weak_ptr) right away
+        timer_wheel_.cancel(deadline_handle_);
     }
 
     // Start the asynchronous operation
@@ -83,13 +146,36 @@ public:
     {
         // Make the request empty before reading,
         // otherwise the operation behavior is undefined.
-        req_ = {};
+        parser_.emplace();
 
         // Set the timeout.
-        stream_.expires_after(std::chrono::seconds(30));
+        arm_deadline(deadline::HEADER, admission_.config().header_timeout);
 
-        // Read a request
-        http::async_read(stream_, buffer_, req_,
+        // Read a request header
+        http::async_read_header(socket_, buffer_, *parser_,
+            boost::beast::bind_front_handler(
+                &session::on_read_header,
+                shared_from_this()));
+    }
+
+    void on_read_header(
+        boost::system::error_code ec,
+        std::size_t bytes_transferred)
+    {
+        // This means they closed the connection
+        if (ec == http::error::end_of_stream)
+            return do_close();
+
+        if (ec)
+            return fail_read(ec);
+
+        if (parser_->is_done())
+            return on_read(ec, bytes_transferred);
+
+        // Read the rest of the request (i.e. body)
+        arm_deadline(deadline::BODY, admission_.config().body_timeout);
+
+        http::async_read(socket_, buffer_, *parser_,
             boost::beast::bind_front_handler(
                 &session::on_read,
                 shared_from_this()));
@@ -101,12 +187,22 @@ public:
     {
         boost::ignore_unused(bytes_transferred);
 
+        disarm_deadline();
+
         // This means they closed the connection
         if (ec == http::error::end_of_stream)
             return do_close();
 
         if (ec)
-            return FAIL(ec, "read");
+            return fail_read(ec);
+
+        req_ = http_server::request_t( parser_->release() );
+        req_.set_remote_address( address_ );
+
+        // Shed the request if the client is sending too fast
+        if (!admission_.allow_request(address_)) {
+            return do_shed( !req_.keep_alive() );
+        }
 
         // Send the response
         //handle_request(doc_root_, std::move(req_), lambda_);
@@ -120,8 +216,13 @@ public:
     {
         boost::ignore_unused(bytes_transferred);
 
-        if (ec)
+        disarm_deadline();
+
+        if (ec) {
+            if (timed_out_)
+                return FAIL(boost::beast::error::timeout, "write");
             return FAIL(ec, "write");
+        }
 
         if (close) {
             // This means we should close the connection, usually because
@@ -140,10 +241,80 @@ public:
     {
         // Send a TCP shutdown
         boost::system::error_code ec;
-        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        socket_.shutdown(tcp::socket::shutdown_send, ec);
 
         // At this point the connection is closed gracefully
     }
+
+private:
+    // Writes the pre-serialized 503 response
+    void do_shed(bool close)
+    {
+        arm_deadline(deadline::WRITE, admission_.config().write_timeout);
+
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(admission_.service_unavailable(close)),
+            boost::beast::bind_front_handler(
+                &session::on_write,
+                shared_from_this(),
+                close));
+    }
+
+    void fail_read(boost::system::error_code ec)
+    {
+        // Report the timeout rather than the cancelled operation
+        if (timed_out_)
+            return FAIL(boost::beast::error::timeout, "read");
+        return FAIL(ec, "read");
+    }
+
+    void arm_deadline(deadline which, std::chrono::milliseconds timeout)
+    {
+        timer_wheel_.cancel(deadline_handle_);
+        deadline_ = which;
+        const uint64_t generation = ++deadline_generation_;
+        std::weak_ptr<session> weak_self = shared_from_this();
+
+        deadline_handle_ = timer_wheel_.schedule(timeout,
+            [weak_self, generation]() {
+                auto self = weak_self.lock();
+                if (!self)
+                    return;
+                // The session state can be touched only from its own strand
+                boost::asio::post(self->socket_.get_executor(),
+                    [self, generation]() {
+                        self->on_deadline(generation);
+                    });
+            });
+    }
+
+    void disarm_deadline()
+    {
+        timer_wheel_.cancel(deadline_handle_);
+        deadline_ = deadline::NONE;
+        ++deadline_generation_;
+    }
+
+    void on_deadline(uint64_t generation)
+    {
+        if (generation != deadline_generation_ || deadline_ == deadline::NONE)
+            return;
+
+        if (deadline_ == deadline::HEADER) {
+            admission_.count_header_timeout();
+        } else if (deadline_ == deadline::BODY) {
+            admission_.count_body_timeout();
+        } else {
+            admission_.count_write_timeout();
+        }
+        deadline_ = deadline::NONE;
+        timed_out_ = true;
+
+        // Pending read or write completes with operation_aborted
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
 };
 
 } // namespace http_server
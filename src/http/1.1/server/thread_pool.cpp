@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <algorithm>
+#include <sstream>
+
+#include <boost/asio/post.hpp>
+
+#include "thread_pool.hpp"
+
+namespace http_server {
+
+thread_pool::thread_pool(boost::asio::io_context& ioc, int min_threads, const thread_pool_config& config)
+    : ioc_(ioc)
+    , min_threads_(std::max(min_threads, 1))
+    , config_(config)
+{
+}
+
+
+thread_pool::~thread_pool()
+{
+    for (auto& w : workers_) {
+        if (w.thread.joinable()) {
+            w.thread.detach();
+        }
+    }
+}
+
+
+void thread_pool::run()
+{
+    for (int i = 0; i < min_threads_; i++) {
+        add_thread();
+    }
+
+    const int max_threads = std::max(config_.max_threads, min_threads_);
+    auto last = std::chrono::steady_clock::now();
+    auto idle_since = last;
+
+    while (!ioc_.stopped()) {
+        std::this_thread::sleep_for(config_.interval);
+
+        const auto now = std::chrono::steady_clock::now();
+        probe();
+        const double utilization = measure_utilization(now - last);
+        last = now;
+        join_finished();
+
+        const auto delay = std::chrono::microseconds( queue_delay_us_.load() );
+        const int nb_threads = nb_threads_.load();
+
+        if ((delay >= config_.grow_delay || utilization >= config_.grow_utilization) && nb_threads < max_threads) {
+            add_thread();
+            nb_threads_added_++;
+            idle_since = now;
+            continue;
+        }
+
+        // Idle means that a thread less would still be enough
+        const bool idle = delay < config_.grow_delay / 4 && utilization * nb_threads < config_.grow_utilization * (nb_threads - 1) / 2;
+        if (!idle) {
+            idle_since = now;
+        } else if (nb_threads > min_threads_ && now - idle_since >= config_.idle_time) {
+            retire_thread();
+            nb_threads_retired_++;
+            idle_since = now;
+        }
+    }
+
+    for (auto& w : workers_) {
+        w.thread.join();
+    }
+    workers_.clear();
+}
+
+
+std::string thread_pool::stats() const
+{
+    const char *sep = "  ";
+    std::ostringstream os;
+
+    os << sep << "http.pool.threads="                   << nb_threads_.load() << '\n';
+    os << sep << "http.pool.minThreads="                << min_threads_ << '\n';
+    os << sep << "http.pool.maxThreads="                << std::max(config_.max_threads, min_threads_) << '\n';
+    os << sep << "http.pool.threadsMax="                << nb_threads_max_.load() << '\n';
+    os << sep << "http.pool.nbThreadsAdded="            << nb_threads_added_.load() << '\n';
+    os << sep << "http.pool.nbThreadsRetired="          << nb_threads_retired_.load() << '\n';
+    os << sep << "http.pool.queueDelayUs="              << queue_delay_us_.load() << '\n';
+    os << sep << "http.pool.queueDelayMaxUs="           << queue_delay_max_us_.load() << '\n';
+    os << sep << "http.pool.utilizationPercent="        << utilization_percent_.load() << '\n';
+
+    return os.str();
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+void thread_pool::add_thread()
+{
+    workers_.emplace_back();
+    worker* w = &workers_.back();
+
+    const int nb = ++nb_threads_;
+    int max = nb_threads_max_.load();
+    while (nb > max && !nb_threads_max_.compare_exchange_weak(max, nb)) {}
+
+    std::lock_guard<std::mutex> lock(workers_lock_);
+    w->thread = std::thread(&thread_pool::worker_run, this, w);
+}
+
+
+void thread_pool::retire_thread()
+{
+    // Whichever thread runs the handler leaves the pool
+    boost::asio::post(ioc_, []() {
+        throw retire();
+    });
+}
+
+
+void thread_pool::worker_run(worker* w)
+{
+    {
+        std::lock_guard<std::mutex> lock(workers_lock_);
+        w->has_clock = pthread_getcpuclockid(pthread_self(), &w->clock) == 0;
+    }
+
+    for (;;) {
+        try {
+            ioc_.run();
+            break;
+        }
+        catch (const retire&) {
+            nb_threads_--;
+            break;
+        }
+    }
+    w->finished = true;
+}
+
+
+/*
+ * The probe measures how long a handler waits before it is executed. If the previous probe is still waiting,
+ * the delay is at least the time since it was posted, so a starving pool is detected without waiting for it.
+ */
+void thread_pool::probe()
+{
+    const int64_t posted = probe_posted_ns_.load();
+    const int64_t now = now_ns();
+
+    if (posted != 0) {
+        queue_delay_us_ = (now - posted) / 1000;
+        return;
+    }
+
+    probe_posted_ns_ = now;
+    boost::asio::post(ioc_, [this, now]() {
+        const int64_t delay_us = (now_ns() - now) / 1000;
+        queue_delay_us_ = delay_us;
+
+        int64_t max = queue_delay_max_us_.load();
+        while (delay_us > max && !queue_delay_max_us_.compare_exchange_weak(max, delay_us)) {}
+
+        probe_posted_ns_ = 0;
+    });
+}
+
+
+// Returns the CPU time used by the pool threads in the elapsed time, divided by the number of threads
+double thread_pool::measure_utilization(std::chrono::steady_clock::duration elapsed)
+{
+    int64_t cpu_ns = 0;
+    int nb = 0;
+    {
+        std::lock_guard<std::mutex> lock(workers_lock_);
+        for (auto& w : workers_) {
+            timespec ts;
+            if (w.finished || !w.has_clock || clock_gettime(w.clock, &ts) != 0) {
+                continue;
+            }
+            const int64_t total_ns = int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+            cpu_ns += total_ns - w.last_cpu_ns;
+            w.last_cpu_ns = total_ns;
+            nb++;
+        }
+    }
+
+    const int64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    const double utilization = (nb > 0 && elapsed_ns > 0) ? double(cpu_ns) / (double(elapsed_ns) * nb) : 0;
+    utilization_percent_ = int(utilization * 100);
+    return utilization;
+}
+
+
+void thread_pool::join_finished()
+{
+    for (auto iter = workers_.begin(); iter != workers_.end(); ) {
+        if (iter->finished) {
+            iter->thread.join();
+            iter = workers_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+} // namespace http_server
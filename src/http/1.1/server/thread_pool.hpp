@@ -0,0 +1,92 @@
+#ifndef HTTPD_THREAD_POOL_HPP
+#define HTTPD_THREAD_POOL_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace http_server {
+
+/// Bounds and thresholds of the elastic thread pool
+struct thread_pool_config {
+    int max_threads = 0;                                        // Upper bound of the pool, the pool has a fixed size when not above the minimum
+    std::chrono::milliseconds interval { 100 };                 // How often the queueing delay is probed
+    std::chrono::microseconds grow_delay { 2000 };              // Queueing delay of a handler that adds a thread
+    double grow_utilization = 0.9;                              // CPU utilization of the pool threads that adds a thread
+    std::chrono::seconds idle_time { 30 };                      // How long the pool has to be idle before a thread is retired
+};
+
+
+/*
+ * Elastic pool of threads running the io_context
+ *
+ * The calling thread of run() monitors the pool: it periodically posts a probe handler and measures how long
+ * the handler waited in the queue, and it measures the CPU time used by the pool threads. When the delay or
+ * the utilization cross the thresholds a thread is added, when the pool is idle long enough a thread is retired.
+ * A thread is retired by posting a handler that throws, so it finishes what it is doing first.
+ */
+class thread_pool {
+public:
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    thread_pool(boost::asio::io_context& ioc, int min_threads, const thread_pool_config& config);
+    ~thread_pool();
+
+    // Starts the minimum number of threads and monitors them until the io_context is stopped
+    void run();
+
+    std::string stats() const;
+
+private:
+    // Thrown by the handler retiring a thread
+    struct retire {};
+
+    struct worker {
+        std::thread thread;
+        clockid_t clock;                                        // CPU time clock of the thread
+        bool has_clock = false;
+        std::atomic<bool> finished { false };
+        int64_t last_cpu_ns = 0;                                // Used only by the monitor
+    };
+
+    void add_thread();
+    void retire_thread();
+    void worker_run(worker* w);
+    void probe();
+    double measure_utilization(std::chrono::steady_clock::duration elapsed);
+    void join_finished();
+
+    static int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    boost::asio::io_context& ioc_;
+    const int min_threads_;
+    const thread_pool_config config_;
+
+    std::list<worker> workers_;                                 // Accessed by the monitor only, threads touch only their own worker
+    std::mutex workers_lock_;                                   // Protects the clock of a starting thread
+
+    std::atomic<int> nb_threads_ { 0 };
+    std::atomic<int64_t> probe_posted_ns_ { 0 };                // When the pending probe was posted (0 when none is pending)
+
+    // Statistics
+    std::atomic<int64_t> queue_delay_us_ { 0 };
+    std::atomic<int64_t> queue_delay_max_us_ { 0 };
+    std::atomic<int> utilization_percent_ { 0 };
+    std::atomic<int> nb_threads_max_ { 0 };
+    std::atomic<uint64_t> nb_threads_added_ { 0 };
+    std::atomic<uint64_t> nb_threads_retired_ { 0 };
+};
+
+} // namespace http_server
+
+#endif // HTTPD_THREAD_POOL_HPP
@@ -0,0 +1,86 @@
+#include "timer_wheel.hpp"
+#include "fail.hpp"
+
+namespace http_server {
+
+timer_wheel::timer_wheel(boost::asio::io_context& ioc, std::chrono::milliseconds tick, std::size_t nb_slots)
+    : timer_(boost::asio::make_strand(ioc))
+    , tick_(tick)
+    , slots_(nb_slots)
+{
+}
+
+
+void timer_wheel::run()
+{
+    do_tick();
+}
+
+
+timer_wheel::handle_t timer_wheel::schedule(std::chrono::milliseconds timeout, callback_t&& callback)
+{
+    // The next tick comes anytime within a tick, so one more tick than rounded up keeps the deadline from firing early
+    const std::size_t ticks = (timeout.count() + tick_.count() - 1) / tick_.count() + 1;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    handle_t handle;
+    handle.slot = (current_ + ticks) % slots_.size();
+    handle.id = next_id_++;
+    slots_[handle.slot].emplace( handle.id, entry{ (ticks - 1) / slots_.size(), std::move(callback) } );
+    return handle;
+}
+
+
+void timer_wheel::cancel(handle_t& handle)
+{
+    if (handle.id == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+    slots_[handle.slot].erase( handle.id );
+    handle = handle_t();
+}
+
+
+void timer_wheel::do_tick()
+{
+    timer_.expires_after(tick_);
+    timer_.async_wait(
+        [this](boost::system::error_code ec) {
+            on_tick(ec);
+        });
+}
+
+
+void timer_wheel::on_tick(boost::system::error_code ec)
+{
+    if (ec) {
+        return FAIL(ec, "timer_wheel");
+    }
+
+    std::vector<entry> expired;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        current_ = (current_ + 1) % slots_.size();
+
+        auto& slot = slots_[current_];
+        for (auto it = slot.begin(); it != slot.end(); ) {
+            if (it->second.rounds > 0) {
+                it->second.rounds--;
+                ++it;
+            } else {
+                expired.push_back( std::move(it->second) );
+                it = slot.erase(it);
+            }
+        }
+    }
+
+    // Callbacks are called without holding the lock, so they can schedule again
+    for (auto& e : expired) {
+        e.callback();
+    }
+
+    do_tick();
+}
+
+} // namespace http_server
@@ -0,0 +1,73 @@
+#ifndef HTTPD_TIMER_WHEEL_HPP
+#define HTTPD_TIMER_WHEEL_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace http_server {
+
+/*
+ * Hashed timer wheel for coarse deadlines (header and body read timeouts).
+ *
+ * Instead of arming one steady_timer per stream for every read, sessions only append
+ * an entry into a slot of the wheel. A single timer advances the wheel once per tick
+ * and runs the callbacks of the expired entries. Deadlines are therefore precise only
+ * to one tick, what is more than enough for the timeouts we need.
+ *
+ * schedule() returns a handle, the entry is removed by cancel() (e.g. when the read finished in time),
+ * so the wheel holds at most one entry per stream. A callback can still run just after it was cancelled
+ * from another thread, so it has to check itself if the deadline is still relevant (e.g. with a generation counter).
+ */
+class timer_wheel {
+public:
+    typedef std::function<void()> callback_t;
+
+    // Identifies a scheduled entry, a default constructed handle refers to nothing
+    struct handle_t {
+        std::size_t slot = 0;
+        uint64_t id = 0;
+    };
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    explicit timer_wheel(boost::asio::io_context& ioc,
+        std::chrono::milliseconds tick = std::chrono::milliseconds(1000), std::size_t nb_slots = 64);
+
+    // Start ticking
+    void run();
+
+    // Call the callback after (at least) timeout, can be called from any thread
+    handle_t schedule(std::chrono::milliseconds timeout, callback_t&& callback);
+
+    // Removes the entry unless it already expired, the handle is reset
+    void cancel(handle_t& handle);
+
+private:
+    void do_tick();
+    void on_tick(boost::system::error_code ec);
+
+private:
+    struct entry {
+        std::size_t rounds;         // How many full wheel turns to wait
+        callback_t callback;
+    };
+
+    boost::asio::steady_timer timer_;
+    const std::chrono::milliseconds tick_;
+
+    std::mutex lock_;
+    std::vector<std::unordered_map<uint64_t, entry>> slots_;
+    std::size_t current_ = 0;
+    uint64_t next_id_ = 1;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_TIMER_WHEEL_HPP
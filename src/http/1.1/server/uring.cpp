@@ -0,0 +1,180 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include "uring.hpp"
+
+namespace http_server {
+
+static int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+uring::uring(unsigned entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    fd_ = io_uring_setup(entries, &params);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+    }
+    features_ = params.features;
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Since 5.4 both rings can be mapped at once
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        int err = errno;
+        ::close(fd_);
+        throw std::system_error(err, std::system_category(), "mmap io_uring SQ ring");
+    }
+
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            int err = errno;
+            munmap(sq_ptr_, sq_size_);
+            ::close(fd_);
+            throw std::system_error(err, std::system_category(), "mmap io_uring CQ ring");
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*) mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        int err = errno;
+        munmap(sq_ptr_, sq_size_);
+        if (!single_mmap) {
+            munmap(cq_ptr_, cq_size_);
+        }
+        ::close(fd_);
+        throw std::system_error(err, std::system_category(), "mmap io_uring SQEs");
+    }
+
+    char* sq = (char*) sq_ptr_;
+    sq_head_    = (unsigned*) (sq + params.sq_off.head);
+    sq_tail_    = (unsigned*) (sq + params.sq_off.tail);
+    sq_mask_    = (unsigned*) (sq + params.sq_off.ring_mask);
+    sq_array_   = (unsigned*) (sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqe_tail_   = *sq_tail_;
+
+    char* cq = (char*) cq_ptr_;
+    cq_head_    = (unsigned*) (cq + params.cq_off.head);
+    cq_tail_    = (unsigned*) (cq + params.cq_off.tail);
+    cq_mask_    = (unsigned*) (cq + params.cq_off.ring_mask);
+    cqes_       = (io_uring_cqe*) (cq + params.cq_off.cqes);
+}
+
+
+uring::~uring()
+{
+    munmap(sqes_, sqes_size_);
+    if (cq_ptr_ != sq_ptr_) {
+        munmap(cq_ptr_, cq_size_);
+    }
+    munmap(sq_ptr_, sq_size_);
+    ::close(fd_);
+}
+
+
+io_uring_sqe* uring::get_sqe()
+{
+    reserve(1);
+
+    const unsigned index = sqe_tail_ & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sqe_tail_++;
+    return sqe;
+}
+
+
+void uring::reserve(unsigned nb)
+{
+    if (sq_space() >= nb) {
+        return;
+    }
+    // The queue is full, let the kernel consume it
+    submit(0);
+    if (sq_space() < nb) {
+        throw std::system_error(EBUSY, std::system_category(), "io_uring submission queue is full");
+    }
+}
+
+
+void uring::submit_and_wait(unsigned wait_nr)
+{
+    submit(wait_nr);
+}
+
+
+void uring::submit(unsigned wait_nr)
+{
+    const unsigned to_submit = sqe_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return;
+    }
+
+    while (io_uring_enter(fd_, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        if (errno == EINTR) {
+            // Interrupted by signal, has to restart
+            continue;
+        }
+        if (errno == EBUSY || errno == EAGAIN) {
+            // Completion queue is full, the caller has to reap completions first
+            return;
+        }
+        throw std::system_error(errno, std::system_category(), "io_uring_enter");
+    }
+}
+
+
+bool uring::register_buffers(const iovec* iovecs, unsigned nb_iovecs)
+{
+    return io_uring_register(fd_, IORING_REGISTER_BUFFERS, iovecs, nb_iovecs) == 0;
+}
+
+
+bool uring::is_supported(unsigned opcode) const
+{
+    const unsigned nb_ops = 256;
+    std::vector<char> buffer(sizeof(io_uring_probe) + nb_ops * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*) buffer.data();
+
+    if (io_uring_register(fd_, IORING_REGISTER_PROBE, probe, nb_ops) < 0) {
+        return false;
+    }
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+} // namespace http_server
@@ -0,0 +1,102 @@
+#ifndef HTTPD_URING_HPP
+#define HTTPD_URING_HPP
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <cstdint>
+
+namespace http_server {
+
+/*
+ * Minimal io_uring wrapper using the raw system calls (liburing is not available on our machines)
+ *
+ * Only what the HTTP backend needs is here: one submission queue, one completion queue,
+ * registered buffers. The ring is not thread safe, it is meant to be used by a single thread.
+ *
+ * See: https://kernel.dk/io_uring.pdf and io_uring(7)
+ */
+class uring {
+public:
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+
+    // Throws std::system_error when the kernel doesn't support io_uring (or it is forbidden)
+    explicit uring(unsigned entries);
+    ~uring();
+
+    /*
+     * Returns a cleared submission entry, submits pending entries if the queue is full.
+     * Throws std::system_error when the kernel doesn't take them (e.g. EBUSY while the completion queue
+     * overflows), the caller has to reap completions before trying again.
+     */
+    io_uring_sqe* get_sqe();
+
+    // Makes room for nb entries, so a linked chain taken by get_sqe() is not split between two submissions
+    void reserve(unsigned nb);
+
+    // Submits all pending entries and waits for at least wait_nr completions
+    void submit_and_wait(unsigned wait_nr);
+
+    // Calls f(const io_uring_cqe&) for all available completions, an entry is consumed even when f throws
+    template <class F>
+    unsigned for_each_cqe(F&& f)
+    {
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail; ++count) {
+            const io_uring_cqe cqe = cqes_[head & *cq_mask_];
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            f( cqe );
+        }
+        return count;
+    }
+
+    // Returns false when the buffers cannot be registered (e.g. RLIMIT_MEMLOCK), in that case use the non-fixed operations
+    bool register_buffers(const iovec* iovecs, unsigned nb_iovecs);
+
+    // Returns false when the opcode is not supported, or the kernel is too old to tell (before 5.6)
+    bool is_supported(unsigned opcode) const;
+
+    uint32_t features() const
+    {
+        return features_;
+    }
+
+private:
+    void submit(unsigned wait_nr);
+
+    unsigned sq_space() const
+    {
+        return sq_entries_ - (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+    }
+
+private:
+    int fd_ = -1;
+    uint32_t features_ = 0;
+
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    std::size_t sq_size_ = 0;
+    std::size_t cq_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+
+    // Submission queue
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    unsigned sq_entries_;
+    unsigned sqe_tail_ = 0;         // Entries prepared, but not yet made visible to the kernel
+
+    // Completion queue
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_URING_HPP
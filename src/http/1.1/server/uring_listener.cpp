@@ -0,0 +1,1016 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <system_error>
+
+#include <boost/asio/strand.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/optional.hpp>
+
+#include "uring_listener.hpp"
+#include "uring.hpp"
+#include "fail.hpp"
+#include "admission.hpp"
+#include "request_handler.hpp"
+
+namespace http_server {
+
+/*
+ * Multishot accept (Linux 5.19) is a flag, IORING_REGISTER_PROBE doesn't tell it. Older kernels reject the flag
+ * already when the accept is submitted, so we submit one on an idle listening socket and look for the error.
+ */
+static bool probe_multishot_accept()
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool supported = false;
+    if (::bind(fd, (const sockaddr*) &addr, sizeof(addr)) == 0 && ::listen(fd, 1) == 0) {
+        uring ring(4);
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        ring.submit_and_wait(0);
+
+        // Without an error the accept is waiting for a connection, closing the ring cancels it
+        supported = true;
+        ring.for_each_cqe([&supported](const io_uring_cqe& cqe) {
+            supported = cqe.res >= 0;
+        });
+    }
+    ::close(fd);
+    return supported;
+}
+
+
+/*
+ * One ring with its connections, everything here is accessed only from the thread of the worker
+ * with the exception of complete() which can be called from any thread.
+ */
+class uring_listener::worker {
+public:
+    worker(const worker&) = delete;
+    worker& operator=(const worker&) = delete;
+
+    explicit worker(uring_listener& listener);
+    ~worker();
+
+    bool registered_buffers() const
+    {
+        return registered_buffers_;
+    }
+
+    // The event loop of the worker thread
+    void run();
+
+    // Sends a response produced by an asynchronous handler, can be called from any thread
+    void complete(uint32_t slot, uint32_t generation, std::string&& data, bool close);
+
+    // Wakes up the worker thread, can be called from any thread
+    void wakeup();
+
+private:
+    // Kind of the operation is stored in the user data of the submission
+    enum class op : uint8_t { ACCEPT = 1, READ, WRITE, WAKEUP, TICK, CANCEL, LINGER };
+
+    // Which deadline is armed at the moment
+    enum class deadline { NONE, HEADER, BODY, WRITE };
+
+    struct connection {
+        int fd = -1;
+        uint32_t generation = 0;            // Invalidates deferred responses for previous connections in the slot
+        admission::address_t address;
+        char* buffer = nullptr;             // Registered read buffer
+        std::size_t buffer_len = 0;         // Bytes read, but not yet parsed
+
+        boost::optional<http::request_parser<http::string_body>> parser;
+        request_t req;
+
+        std::string write_data;
+        std::size_t written = 0;
+        bool close_after_write = false;
+        bool read_linked = false;           // A read is linked after the write
+
+        deadline deadline_kind = deadline::NONE;
+        std::chrono::steady_clock::time_point deadline_time;
+
+        unsigned pending = 0;               // Submitted operations not completed yet, the fd can be closed only when there is none
+        bool closing = false;
+    };
+
+    // A shed connection, its request is read and discarded until they close it or the deadline passes
+    struct lingering {
+        int fd = -1;
+        bool pending = false;               // The read was submitted and not completed yet
+        std::chrono::steady_clock::time_point deadline_time;
+    };
+
+    // The function object used by request_handler to send an HTTP message
+    struct sender {
+        worker& self_;
+        uint32_t slot_;
+
+        template <bool isRequest, class Body, class Fields>
+        void operator()(http::message<isRequest, Body, Fields>&& msg) const
+        {
+            // The connection is closed after the response when the server is draining
+            if (self_.listener_.admission_.draining()) {
+                msg.keep_alive(false);
+            }
+            std::ostringstream os;
+            os << msg;
+            self_.write(self_.connections_[slot_], os.str(), msg.need_eof());
+        }
+
+        std::function<void(response_t&&)> defer() const
+        {
+            worker* self = &self_;
+            const uint32_t slot = slot_;
+            const uint32_t generation = self_.connections_[slot_].generation;
+            return [self, slot, generation](response_t&& res) {
+                if (self->listener_.admission_.draining()) {
+                    res.keep_alive(false);
+                }
+                std::ostringstream os;
+                os << res;
+                self->complete(slot, generation, os.str(), res.need_eof());
+            };
+        }
+
+        tcp::socket release_socket() const
+        {
+            return self_.release_socket(self_.connections_[slot_]);
+        }
+
+        // The connection stays counted by admission, release_socket() leaves it to the slot
+        connection_slot release_slot() const
+        {
+            return connection_slot(self_.listener_.admission_);
+        }
+    };
+
+    // Deferred responses waiting for the worker thread
+    struct completion {
+        uint32_t slot;
+        uint32_t generation;
+        std::string data;
+        bool close;
+    };
+
+    static constexpr unsigned ring_entries = 1024;
+    static constexpr unsigned max_connections = 1024;
+    static constexpr std::size_t buffer_size = 8192;
+    static constexpr long tick_seconds = 1;
+    static constexpr unsigned max_lingering = 64;
+    static constexpr std::size_t linger_buffer_size = 4096;
+
+    static uint64_t make_user_data(op kind, uint32_t slot = 0)
+    {
+        return (uint64_t(kind) << 56) | slot;
+    }
+
+    void on_completion(const io_uring_cqe& cqe);
+    void on_accept(int fd);
+    void on_read(connection& conn, int res);
+    void on_write(connection& conn, int res);
+    void on_wakeup();
+    void on_tick();
+    void on_linger(lingering& l, int res);
+
+    void arm_accept();
+    void arm_wakeup();
+    void arm_tick();
+    void cancel(op kind);
+
+    // Waits for all submitted operations, so the buffers can be freed
+    void drain();
+
+    void start_read(connection& conn);
+    void parse(connection& conn);
+    void write(connection& conn, std::string&& data, bool close);
+    void submit_write(connection& conn);
+    void set_deadline(connection& conn, deadline which);
+
+    void shed(int fd);
+    void start_linger(lingering& l);
+    void close_linger(lingering& l);
+    void close(connection& conn);
+    void release(connection& conn);
+    tcp::socket release_socket(connection& conn);
+
+    uint32_t slot_of(const connection& conn) const
+    {
+        return uint32_t(&conn - connections_.data());
+    }
+
+private:
+    uring_listener& listener_;
+    uring ring_;
+    bool registered_buffers_ = false;
+
+    std::vector<char> buffers_;
+    std::vector<connection> connections_;
+    std::vector<uint32_t> free_slots_;
+
+    // Reads of all the lingering connections share the buffer, what they read is discarded
+    std::vector<lingering> lingering_;
+    std::vector<uint32_t> free_lingering_;
+    char linger_buffer_[linger_buffer_size];
+
+    // Operations in flight not belonging to connections
+    bool accept_armed_ = false;
+    bool wakeup_armed_ = false;
+    bool tick_armed_ = false;
+
+    bool accept_cancelled_ = false;
+    bool accept_backoff_ = false;           // Accept failed, it is armed again on the next tick
+
+    int event_fd_ = -1;
+    uint64_t event_value_ = 0;
+    __kernel_timespec tick_timespec_;
+
+    std::mutex completions_lock_;
+    std::deque<completion> completions_;
+};
+
+
+constexpr unsigned uring_listener::worker::ring_entries;
+constexpr unsigned uring_listener::worker::max_connections;
+constexpr std::size_t uring_listener::worker::buffer_size;
+constexpr unsigned uring_listener::worker::max_lingering;
+constexpr std::size_t uring_listener::worker::linger_buffer_size;
+
+
+uring_listener::worker::worker(uring_listener& listener)
+    : listener_(listener)
+    , ring_(ring_entries)
+    , buffers_(max_connections * buffer_size)
+    , connections_(max_connections)
+    , lingering_(max_lingering)
+{
+    for (unsigned opcode : { IORING_OP_ACCEPT, IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ, IORING_OP_READ_FIXED,
+            IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL }) {
+        if (!ring_.is_supported(opcode)) {
+            throw std::system_error(ENOSYS, std::system_category(), "io_uring opcode " + std::to_string(opcode) + " is not supported");
+        }
+    }
+
+    for (uint32_t i = 0; i < max_lingering; i++) {
+        free_lingering_.push_back(max_lingering - 1 - i);
+    }
+
+    free_slots_.reserve(max_connections);
+    std::vector<iovec> iovecs(max_connections);
+    for (uint32_t i = 0; i < max_connections; i++) {
+        connections_[i].buffer = &buffers_[i * buffer_size];
+        iovecs[i].iov_base = connections_[i].buffer;
+        iovecs[i].iov_len = buffer_size;
+        free_slots_.push_back(max_connections - 1 - i);
+    }
+
+    // Registered buffers save mapping the pages on every read, but they are limited by RLIMIT_MEMLOCK
+    registered_buffers_ = ring_.register_buffers(iovecs.data(), max_connections);
+
+    event_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (event_fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+
+    tick_timespec_.tv_sec = tick_seconds;
+    tick_timespec_.tv_nsec = 0;
+}
+
+
+uring_listener::worker::~worker()
+{
+    for (auto& conn : connections_) {
+        if (conn.fd >= 0) {
+            ::close(conn.fd);
+        }
+    }
+    for (auto& l : lingering_) {
+        if (l.fd >= 0) {
+            ::close(l.fd);
+        }
+    }
+    ::close(event_fd_);
+}
+
+
+void uring_listener::worker::run()
+{
+    while (!listener_.stopping_) {
+        try {
+            // Armed here rather than in on_completion(), so they are not lost when the submission queue is full
+            if (!accept_armed_ && !accept_backoff_ && listener_.accepting_) {
+                arm_accept();
+            }
+            if (!wakeup_armed_) {
+                arm_wakeup();
+            }
+            if (!tick_armed_) {
+                arm_tick();
+            }
+
+            ring_.submit_and_wait(1);
+            listener_.nb_enters_.fetch_add(1, std::memory_order_relaxed);
+
+            ring_.for_each_cqe([this](const io_uring_cqe& cqe) {
+                on_completion(cqe);
+            });
+        }
+        catch (const std::system_error& e) {
+            // The queue is full, an operation which could not be submitted is recovered by the deadline of its connection
+            FAIL(boost::system::error_code(e.code().value(), boost::system::system_category()), e.what());
+        }
+    }
+
+    drain();
+}
+
+
+void uring_listener::worker::drain()
+{
+    for (auto& conn : connections_) {
+        if (conn.fd >= 0) {
+            close(conn);
+        }
+    }
+    for (auto& l : lingering_) {
+        if (l.fd >= 0) {
+            close_linger(l);
+        }
+    }
+
+    const auto in_flight = [this] {
+        if (accept_armed_ || wakeup_armed_ || tick_armed_) {
+            return true;
+        }
+        for (const auto& conn : connections_) {
+            if (conn.pending > 0) {
+                return true;
+            }
+        }
+        for (const auto& l : lingering_) {
+            if (l.pending) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool cancelled = false;
+    while (in_flight()) {
+        try {
+            if (!cancelled) {
+                ring_.reserve(3);
+                cancel(op::ACCEPT);
+                cancel(op::WAKEUP);
+                cancel(op::TICK);
+                cancelled = true;
+            }
+            ring_.submit_and_wait(1);
+            ring_.for_each_cqe([this](const io_uring_cqe& cqe) {
+                on_completion(cqe);
+            });
+        }
+        catch (const std::system_error& e) {
+            FAIL(boost::system::error_code(e.code().value(), boost::system::system_category()), e.what());
+        }
+    }
+}
+
+
+void uring_listener::worker::on_completion(const io_uring_cqe& cqe)
+{
+    const op kind = op(cqe.user_data >> 56);
+    const uint32_t slot = uint32_t(cqe.user_data);
+
+    switch (kind) {
+    case op::ACCEPT:
+        // Multishot accept stops after an error or when the kernel runs out of resources,
+        // single-shot after every connection. run() arms it again.
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            accept_armed_ = false;
+        }
+        if (cqe.res >= 0) {
+            if (listener_.stopping_) {
+                ::close(cqe.res);
+                break;
+            }
+            on_accept(cqe.res);
+        } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECANCELED) {
+            FAIL(boost::system::error_code(-cqe.res, boost::system::system_category()), "accept");
+            // Errors like EMFILE would repeat straight away, so wait for the next tick
+            accept_backoff_ = true;
+        }
+        break;
+
+    case op::READ:
+        connections_[slot].pending--;
+        on_read(connections_[slot], cqe.res);
+        break;
+
+    case op::WRITE:
+        connections_[slot].pending--;
+        on_write(connections_[slot], cqe.res);
+        break;
+
+    case op::WAKEUP:
+        wakeup_armed_ = false;
+        on_wakeup();
+        break;
+
+    case op::TICK:
+        tick_armed_ = false;
+        on_tick();
+        break;
+
+    case op::CANCEL:
+        break;
+
+    case op::LINGER:
+        on_linger(lingering_[slot], cqe.res);
+        break;
+    }
+}
+
+
+void uring_listener::worker::on_accept(int fd)
+{
+    listener_.nb_accepts_.fetch_add(1, std::memory_order_relaxed);
+
+    if (!listener_.admission_.open_connection()) {
+        // Too many connections
+        return shed(fd);
+    }
+    if (free_slots_.empty()) {
+        // The worker is full, the connection is shed as if it was over the limit
+        listener_.admission_.close_connection();
+        return shed(fd);
+    }
+
+    connection& conn = connections_[ free_slots_.back() ];
+    free_slots_.pop_back();
+
+    conn.fd = fd;
+    conn.generation++;
+    conn.buffer_len = 0;
+    conn.closing = false;
+
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (sockaddr*) &addr, &addr_len) == 0) {
+        if (addr.ss_family == AF_INET6) {
+            boost::asio::ip::address_v6::bytes_type bytes;
+            std::memcpy(bytes.data(), &((sockaddr_in6*) &addr)->sin6_addr, bytes.size());
+            conn.address = boost::asio::ip::address_v6(bytes);
+        } else {
+            conn.address = boost::asio::ip::address_v4(ntohl(((sockaddr_in*) &addr)->sin_addr.s_addr));
+        }
+    }
+
+    conn.parser.emplace();
+    set_deadline(conn, deadline::HEADER);
+    start_read(conn);
+}
+
+
+void uring_listener::worker::on_read(connection& conn, int res)
+{
+    if (conn.closing) {
+        return release(conn);
+    }
+
+    // The read linked to a short write is cancelled, on_write submits a new one
+    if (res == -ECANCELED) {
+        return;
+    }
+
+    // Zero means they closed the connection
+    if (res <= 0) {
+        if (res < 0 && res != -ECONNRESET) {
+            FAIL(boost::system::error_code(-res, boost::system::system_category()), "read");
+        }
+        return close(conn);
+    }
+
+    conn.buffer_len += res;
+    parse(conn);
+}
+
+
+void uring_listener::worker::parse(connection& conn)
+{
+    boost::system::error_code ec;
+
+    while (conn.buffer_len > 0 && !conn.parser->is_done()) {
+        const std::size_t used = conn.parser->put(boost::asio::buffer(conn.buffer, conn.buffer_len), ec);
+
+        std::memmove(conn.buffer, conn.buffer + used, conn.buffer_len - used);
+        conn.buffer_len -= used;
+
+        if (ec == http::error::need_more) {
+            ec = {};
+            break;
+        }
+        if (ec) {
+            FAIL(ec, "read");
+            return close(conn);
+        }
+        if (used == 0) {
+            break;
+        }
+    }
+
+    if (!conn.parser->is_done()) {
+        if (conn.buffer_len == buffer_size) {
+            // The header does not fit into the buffer
+            FAIL(http::error::header_limit, "read");
+            return close(conn);
+        }
+        set_deadline(conn, conn.parser->is_header_done() ? deadline::BODY : deadline::HEADER);
+        return start_read(conn);
+    }
+
+    set_deadline(conn, deadline::NONE);
+    conn.req = request_t( conn.parser->release() );
+    conn.req.set_remote_address( conn.address );
+    conn.parser.reset();
+    listener_.nb_requests_.fetch_add(1, std::memory_order_relaxed);
+
+    // Shed the request if the client is sending too fast
+    if (!listener_.admission_.allow_request(conn.address)) {
+        const bool close = !conn.req.keep_alive();
+        return write(conn, std::string( listener_.admission_.service_unavailable(close) ), close);
+    }
+
+    // Send the response
+    listener_.request_handler_.handle_request(listener_.doc_root_, std::move(conn.req), sender{ *this, slot_of(conn) });
+}
+
+
+void uring_listener::worker::write(connection& conn, std::string&& data, bool close)
+{
+    conn.write_data = std::move(data);
+    conn.written = 0;
+    conn.close_after_write = close;
+    submit_write(conn);
+}
+
+
+void uring_listener::worker::submit_write(connection& conn)
+{
+    // The read of the next request is submitted together with the response,
+    // unless the next request is already in the buffer (pipelining)
+    conn.read_linked = !conn.close_after_write && conn.buffer_len == 0;
+
+    // The deadline is set first, it closes the connection if the submission fails
+    set_deadline(conn, conn.read_linked ? deadline::HEADER : deadline::WRITE);
+
+    // Both entries of the link have to go in the same submission
+    ring_.reserve(conn.read_linked ? 2 : 1);
+
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn.fd;
+    sqe->addr = (uint64_t) (conn.write_data.data() + conn.written);
+    sqe->len = unsigned(conn.write_data.size() - conn.written);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = make_user_data(op::WRITE, slot_of(conn));
+    conn.pending++;
+
+    if (conn.read_linked) {
+        sqe->flags |= IOSQE_IO_LINK;
+        conn.parser.emplace();
+        start_read(conn);
+    }
+}
+
+
+void uring_listener::worker::on_write(connection& conn, int res)
+{
+    if (conn.closing) {
+        return release(conn);
+    }
+
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET) {
+            FAIL(boost::system::error_code(-res, boost::system::system_category()), "write");
+        }
+        return close(conn);
+    }
+
+    conn.written += res;
+    if (conn.written < conn.write_data.size()) {
+        // Short write, the linked read was cancelled
+        return submit_write(conn);
+    }
+
+    // We're done with the response so delete it
+    std::string().swap(conn.write_data);
+
+    if (conn.close_after_write) {
+        // This means we should close the connection, usually because
+        // the response indicated the "Connection: close" semantic.
+        ::shutdown(conn.fd, SHUT_WR);
+        return close(conn);
+    }
+
+    if (!conn.read_linked) {
+        // Process the pipelined request
+        conn.parser.emplace();
+        set_deadline(conn, deadline::HEADER);
+        parse(conn);
+    }
+}
+
+
+void uring_listener::worker::start_read(connection& conn)
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    const uint32_t slot = slot_of(conn);
+    if (registered_buffers_) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = uint16_t(slot);
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->fd = conn.fd;
+    sqe->addr = (uint64_t) (conn.buffer + conn.buffer_len);
+    sqe->len = unsigned(buffer_size - conn.buffer_len);
+    sqe->user_data = make_user_data(op::READ, slot);
+    conn.pending++;
+}
+
+
+void uring_listener::worker::set_deadline(connection& conn, deadline which)
+{
+    // The deadline is kept while more data of the same part of the request is read
+    if (which == conn.deadline_kind) {
+        return;
+    }
+    conn.deadline_kind = which;
+    if (which == deadline::HEADER) {
+        conn.deadline_time = std::chrono::steady_clock::now() + listener_.admission_.config().header_timeout;
+    } else if (which == deadline::BODY) {
+        conn.deadline_time = std::chrono::steady_clock::now() + listener_.admission_.config().body_timeout;
+    } else if (which == deadline::WRITE) {
+        conn.deadline_time = std::chrono::steady_clock::now() + listener_.admission_.config().write_timeout;
+    }
+}
+
+
+void uring_listener::worker::arm_accept()
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener_.listen_fd_;
+    sqe->ioprio = listener_.multishot_accept_ ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(op::ACCEPT);
+    accept_armed_ = true;
+    accept_cancelled_ = false;
+}
+
+
+void uring_listener::worker::arm_wakeup()
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = event_fd_;
+    sqe->addr = (uint64_t) &event_value_;
+    sqe->len = sizeof(event_value_);
+    sqe->user_data = make_user_data(op::WAKEUP);
+    wakeup_armed_ = true;
+}
+
+
+void uring_listener::worker::arm_tick()
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) &tick_timespec_;
+    sqe->len = 1;
+    sqe->user_data = make_user_data(op::TICK);
+    tick_armed_ = true;
+}
+
+
+void uring_listener::worker::cancel(op kind)
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_user_data(kind);
+    sqe->user_data = make_user_data(op::CANCEL);
+}
+
+
+void uring_listener::worker::complete(uint32_t slot, uint32_t generation, std::string&& data, bool close)
+{
+    {
+        std::lock_guard<std::mutex> lock(completions_lock_);
+        completions_.push_back({ slot, generation, std::move(data), close });
+    }
+    wakeup();
+}
+
+
+void uring_listener::worker::wakeup()
+{
+    const uint64_t one = 1;
+    if (::write(event_fd_, &one, sizeof(one)) < 0) {
+        FAIL(boost::system::error_code(errno, boost::system::system_category()), "eventfd write");
+    }
+}
+
+
+void uring_listener::worker::on_wakeup()
+{
+    if (!listener_.accepting_ && accept_armed_ && !accept_cancelled_) {
+        // Stop the accept
+        cancel(op::ACCEPT);
+        accept_cancelled_ = true;
+    }
+
+    std::deque<completion> completions;
+    {
+        std::lock_guard<std::mutex> lock(completions_lock_);
+        completions.swap(completions_);
+    }
+
+    for (auto& c : completions) {
+        connection& conn = connections_[c.slot];
+        // The connection could be closed meanwhile
+        if (conn.generation != c.generation || conn.fd < 0 || conn.closing) {
+            continue;
+        }
+        write(conn, std::move(c.data), c.close);
+    }
+}
+
+
+void uring_listener::worker::on_tick()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    accept_backoff_ = false;
+
+    for (auto& l : lingering_) {
+        if (l.fd >= 0 && now >= l.deadline_time) {
+            close_linger(l);
+        }
+    }
+
+    for (auto& conn : connections_) {
+        if (conn.fd < 0 || conn.closing || conn.deadline_kind == deadline::NONE || now < conn.deadline_time) {
+            continue;
+        }
+        if (conn.deadline_kind == deadline::HEADER) {
+            listener_.admission_.count_header_timeout();
+        } else if (conn.deadline_kind == deadline::BODY) {
+            listener_.admission_.count_body_timeout();
+        } else {
+            listener_.admission_.count_write_timeout();
+        }
+        FAIL(boost::beast::error::timeout, conn.deadline_kind == deadline::WRITE ? "write" : "read");
+        conn.deadline_kind = deadline::NONE;
+
+        // Pending operations complete and the connection is released
+        close(conn);
+    }
+}
+
+
+void uring_listener::worker::shed(int fd)
+{
+    const std::string& response = listener_.admission_.service_unavailable(true);
+    if (::send(fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 || free_lingering_.empty()) {
+        ::close(fd);
+        return;
+    }
+    ::shutdown(fd, SHUT_WR);
+
+    // Closing with the request unread would reset the connection and the client could lose the response
+    lingering& l = lingering_[ free_lingering_.back() ];
+    free_lingering_.pop_back();
+    l.fd = fd;
+    l.deadline_time = std::chrono::steady_clock::now() + std::chrono::seconds(tick_seconds);
+    start_linger(l);
+}
+
+
+void uring_listener::worker::start_linger(lingering& l)
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = l.fd;
+    sqe->addr = (uint64_t) linger_buffer_;
+    sqe->len = linger_buffer_size;
+    sqe->user_data = make_user_data(op::LINGER, uint32_t(&l - lingering_.data()));
+    l.pending = true;
+}
+
+
+void uring_listener::worker::on_linger(lingering& l, int res)
+{
+    l.pending = false;
+
+    // Until they close the connection (zero) or the deadline closed it
+    if (res > 0 && l.fd >= 0 && std::chrono::steady_clock::now() < l.deadline_time) {
+        return start_linger(l);
+    }
+    close_linger(l);
+}
+
+
+void uring_listener::worker::close_linger(lingering& l)
+{
+    if (l.fd < 0) {
+        return;
+    }
+    if (l.pending) {
+        // Makes the read complete, on_linger closes it
+        ::shutdown(l.fd, SHUT_RDWR);
+        l.deadline_time = std::chrono::steady_clock::time_point();
+        return;
+    }
+    ::close(l.fd);
+    l.fd = -1;
+    free_lingering_.push_back(uint32_t(&l - lingering_.data()));
+}
+
+
+void uring_listener::worker::close(connection& conn)
+{
+    if (!conn.closing) {
+        conn.closing = true;
+        // Makes the pending operations complete
+        ::shutdown(conn.fd, SHUT_RDWR);
+    }
+    release(conn);
+}
+
+
+void uring_listener::worker::release(connection& conn)
+{
+    if (conn.pending > 0) {
+        return;
+    }
+    ::close(conn.fd);
+    conn.fd = -1;
+    conn.closing = false;
+    conn.deadline_kind = deadline::NONE;
+    conn.parser.reset();
+    conn.req = request_t();
+    std::string().swap(conn.write_data);
+
+    listener_.admission_.close_connection();
+    free_slots_.push_back(slot_of(conn));
+}
+
+
+tcp::socket uring_listener::worker::release_socket(connection& conn)
+{
+    const int fd = conn.fd;
+
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    const bool v6 = getsockname(fd, (sockaddr*) &addr, &addr_len) == 0 && addr.ss_family == AF_INET6;
+
+    // Give up the connection, the slot is not used before the stream handler returns
+    conn.fd = -1;
+    conn.deadline_kind = deadline::NONE;
+    conn.parser.reset();
+    free_slots_.push_back(slot_of(conn));
+
+    return tcp::socket(boost::asio::make_strand(listener_.ioc_), v6 ? tcp::v6() : tcp::v4(), fd);
+}
+
+
+uring_listener::uring_listener(
+        boost::asio::io_context& ioc,
+        tcp::endpoint endpoint,
+        std::string const& doc_root,
+        const request_handler& req_handler,
+        admission& admission,
+        int threads,
+        int listen_fd)
+        : ioc_(ioc)
+        , doc_root_(doc_root)
+        , request_handler_(req_handler)
+        , admission_(admission)
+{
+    multishot_accept_ = probe_multishot_accept();
+
+    // Create the rings first, so we fall back before touching the port
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back( new worker(*this) );
+    }
+    registered_buffers_ = workers_.front()->registered_buffers();
+
+    if (listen_fd >= 0) {
+        // The socket is already bound and listening
+        listen_fd_ = listen_fd;
+        return;
+    }
+
+    listen_fd_ = ::socket(endpoint.protocol().family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        THROW_FAIL(boost::system::error_code(errno, boost::system::system_category()), "open");
+    }
+
+    // Allow address reuse
+    const int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    // Bind to the server address
+    if (::bind(listen_fd_, (const sockaddr*) endpoint.data(), (socklen_t) endpoint.size()) < 0) {
+        int err = errno;
+        ::close(listen_fd_);
+        THROW_FAIL(boost::system::error_code(err, boost::system::system_category()), "bind");
+    }
+
+    // Start listening for connections
+    if (::listen(listen_fd_, SOMAXCONN) < 0) {
+        int err = errno;
+        ::close(listen_fd_);
+        THROW_FAIL(boost::system::error_code(err, boost::system::system_category()), "listen");
+    }
+}
+
+
+uring_listener::~uring_listener()
+{
+    // The workers finish their operations and exit
+    stopping_ = true;
+    for (auto& w : workers_) {
+        w->wakeup();
+    }
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    if (listen_fd_ >= 0) {
+        ::close(listen_fd_);
+    }
+}
+
+
+void uring_listener::run()
+{
+    for (auto& w : workers_) {
+        worker* ptr = w.get();
+        threads_.emplace_back(
+            [ptr] {
+                ptr->run();
+            });
+    }
+}
+
+
+void uring_listener::stop()
+{
+    accepting_ = false;
+    for (auto& w : workers_) {
+        w->wakeup();
+    }
+}
+
+
+std::string uring_listener::stats() const
+{
+    const char *sep = "  ";
+    std::ostringstream os;
+
+    const uint64_t nb_requests = nb_requests_.load();
+    const uint64_t nb_enters = nb_enters_.load();
+
+    os << sep << "http.uring.workers="              << workers_.size() << '\n';
+    os << sep << "http.uring.registeredBuffers="    << registered_buffers_ << '\n';
+    os << sep << "http.uring.multishotAccept="      << multishot_accept_ << '\n';
+    os << sep << "http.uring.nbAccepts="            << nb_accepts_.load() << '\n';
+    os << sep << "http.uring.nbRequests="           << nb_requests << '\n';
+    os << sep << "http.uring.nbEnters="             << nb_enters << '\n';
+    os << sep << "http.uring.entersPerRequest="     << (nb_requests > 0 ? double(nb_enters) / nb_requests : 0) << '\n';
+
+    return os.str();
+}
+
+} // namespace http_server
@@ -0,0 +1,80 @@
+#ifndef HTTPD_URING_LISTENER_HPP
+#define HTTPD_URING_LISTENER_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+namespace http_server {
+
+// Forward declarations
+class request_handler;
+class admission;
+
+/*
+ * HTTP backend built directly on io_uring, an alternative to the listener/session pair running on the Asio reactor.
+ *
+ * Every worker thread has its own ring with:
+ *   - a multishot accept on the shared listening socket (one submission for all connections) when the kernel supports it,
+ *   - a registered read buffer for every connection slot (IORING_OP_READ_FIXED),
+ *   - the response send linked with the read of the next request (IOSQE_IO_LINK), so one submission serves a keep-alive request,
+ *   - one periodic timeout checking the read and write deadlines.
+ *
+ * Requests are dispatched through the same request_handler as with Asio. Asynchronous handlers complete through
+ * an eventfd watched by the ring, and stream handlers get an Asio socket running in the io_context of the server.
+ */
+class uring_listener {
+public:
+    uring_listener(const uring_listener&) = delete;
+    uring_listener& operator=(const uring_listener&) = delete;
+
+    // Throws std::system_error if io_uring cannot be used. The listen_fd socket is adopted when it is not -1.
+    uring_listener(boost::asio::io_context& ioc, tcp::endpoint endpoint, std::string const& doc_root, const request_handler& req_handler,
+        admission& admission, int threads, int listen_fd = -1);
+    ~uring_listener();
+
+    // Starts the worker threads
+    void run();
+
+    // Stops accepting incoming connections, can be called from any thread
+    void stop();
+
+    int native_handle() const
+    {
+        return listen_fd_;
+    }
+
+    std::string stats() const;
+
+private:
+    class worker;
+    friend class worker;
+
+    boost::asio::io_context& ioc_;
+    std::string const& doc_root_;
+    const request_handler& request_handler_;
+    admission& admission_;
+
+    int listen_fd_ = -1;
+    bool multishot_accept_ = false;         // Linux 5.19, otherwise the accept is submitted for every connection
+    std::atomic<bool> accepting_ { true };
+    std::atomic<bool> stopping_ { false };  // Worker threads exit, set only by the destructor
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    // Statistics shared by all workers
+    std::atomic<uint64_t> nb_enters_ { 0 };             // io_uring_enter() system calls
+    std::atomic<uint64_t> nb_requests_ { 0 };
+    std::atomic<uint64_t> nb_accepts_ { 0 };
+    bool registered_buffers_ = false;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_URING_LISTENER_HPP
@@ -0,0 +1,173 @@
+#include <boost/asio/post.hpp>
+
+#include "websocket_session.hpp"
+#include "fail.hpp"
+
+namespace websocket = boost::beast::websocket;
+
+namespace http_server {
+
+websocket_session::websocket_session(tcp::socket&& socket, connection_slot&& slot)
+    : ws_(std::move(socket))
+    , slot_(std::move(slot))
+{
+}
+
+
+void websocket_session::run(const request_t& req)
+{
+    req_ = req;
+
+    // Ping when the connection is idle, so dead FUs are detected
+    ws_.set_option( websocket::stream_base::timeout::suggested(boost::beast::role_type::server) );
+
+    ws_.async_accept(req_,
+        boost::beast::bind_front_handler(
+            &websocket_session::on_accept,
+            shared_from_this()));
+}
+
+
+void websocket_session::send(std::string&& message)
+{
+    auto sp = std::make_shared<std::string>(std::move(message));
+
+    boost::asio::post(ws_.get_executor(),
+        [self = shared_from_this(), sp]() {
+            if (self->is_closing_) {
+                return;
+            }
+            self->queue_.push_back( std::move(*sp) );
+            // Messages sent before the handshake are written after it
+            if (self->is_open_ && self->queue_.size() == 1) {
+                self->do_write();
+            }
+        });
+}
+
+
+void websocket_session::close()
+{
+    boost::asio::post(ws_.get_executor(),
+        [self = shared_from_this()]() {
+            if (self->is_closing_) {
+                return;
+            }
+            self->is_closing_ = true;
+            if (self->is_open_ && self->queue_.empty()) {
+                self->do_close();
+            }
+        });
+}
+
+
+/**************************************************************************
+ * PRIVATE
+ */
+
+
+void websocket_session::on_accept(boost::system::error_code ec)
+{
+    if (ec) {
+        FAIL(ec, "websocket accept");
+        return finish();
+    }
+    is_open_ = true;
+    req_ = {};
+
+    on_open();
+
+    if (!queue_.empty()) {
+        do_write();
+    } else if (is_closing_) {
+        do_close();
+    }
+    do_read();
+}
+
+
+void websocket_session::do_read()
+{
+    ws_.async_read(buffer_,
+        boost::beast::bind_front_handler(
+            &websocket_session::on_read,
+            shared_from_this()));
+}
+
+
+void websocket_session::on_read(boost::system::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec) {
+        // Closed by the client or by us
+        if (ec != websocket::error::closed && ec != boost::asio::error::operation_aborted && ec != boost::asio::error::eof) {
+            FAIL(ec, "websocket read");
+        }
+        return finish();
+    }
+
+    std::string message = boost::beast::buffers_to_string(buffer_.data());
+    buffer_.consume(buffer_.size());
+
+    if (!is_closing_) {
+        on_message( std::move(message) );
+    }
+    do_read();
+}
+
+
+void websocket_session::do_write()
+{
+    ws_.text(true);
+    ws_.async_write(boost::asio::buffer(queue_.front()),
+        boost::beast::bind_front_handler(
+            &websocket_session::on_write,
+            shared_from_this()));
+}
+
+
+void websocket_session::on_write(boost::system::error_code ec, std::size_t bytes_transferred)
+{
+    boost::ignore_unused(bytes_transferred);
+
+    if (is_finished_) {
+        return;
+    }
+
+    if (ec) {
+        FAIL(ec, "websocket write");
+        return finish();
+    }
+
+    queue_.pop_front();
+    if (!queue_.empty()) {
+        do_write();
+    } else if (is_closing_) {
+        do_close();
+    }
+}
+
+
+void websocket_session::do_close()
+{
+    ws_.async_close(websocket::close_code::normal,
+        [self = shared_from_this()](boost::system::error_code ec) {
+            boost::ignore_unused(ec);
+            self->finish();
+        });
+}
+
+
+void websocket_session::finish()
+{
+    if (is_finished_) {
+        return;
+    }
+    is_finished_ = true;
+    is_closing_ = true;
+    queue_.clear();
+    on_close();
+}
+
+} // namespace http_server
@@ -0,0 +1,77 @@
+#ifndef HTTPD_WEBSOCKET_SESSION_HPP
+#define HTTPD_WEBSOCKET_SESSION_HPP
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "admission.hpp"
+#include "request.hpp"
+
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+namespace http_server {
+
+/*
+ * Base class for WebSocket connections taken over from a stream request handler
+ *
+ * Derived classes receive text messages in on_message() and can send messages with send()
+ * from any thread, messages are written in the order they were sent. All virtual functions
+ * are called from the strand of the connection.
+ */
+class websocket_session : public std::enable_shared_from_this<websocket_session> {
+public:
+    websocket_session(const websocket_session&) = delete;
+    websocket_session& operator=(const websocket_session&) = delete;
+
+    websocket_session(tcp::socket&& socket, connection_slot&& slot);
+    virtual ~websocket_session() = default;
+
+    // Accepts the upgrade request, the response is sent by the WebSocket stream
+    void run(const request_t& req);
+
+    // Can be called from any thread
+    void send(std::string&& message);
+
+    // Closes the connection after all queued messages are written, can be called from any thread
+    void close();
+
+    auto get_executor()
+    {
+        return ws_.get_executor();
+    }
+
+protected:
+    virtual void on_open() {}
+    virtual void on_message(std::string&& message) = 0;
+    virtual void on_close() {}
+
+private:
+    void on_accept(boost::system::error_code ec);
+    void do_read();
+    void on_read(boost::system::error_code ec, std::size_t bytes_transferred);
+    void do_write();
+    void on_write(boost::system::error_code ec, std::size_t bytes_transferred);
+    void do_close();
+    void finish();
+
+private:
+    boost::beast::websocket::stream<boost::beast::tcp_stream> ws_;
+    boost::beast::flat_buffer buffer_;
+    // The upgrade request has to live until it is accepted
+    http::request<http::string_body> req_;
+
+    // Counted by admission until the session is destroyed
+    connection_slot slot_;
+
+    std::deque<std::string> queue_;
+    bool is_open_ = false;
+    bool is_closing_ = false;
+    bool is_finished_ = false;
+};
+
+} // namespace http_server
+
+#endif // HTTPD_WEBSOCKET_SESSION_HPP
@@ -1,13 +1,22 @@
 #include <iostream>
+#include <cstdlib>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
 #include "bu/RunDirectoryManager.h"
+#include "bu/FileFeed.h"
+#include "bu/FUAccounting.h"
+#include "bu/Handoff.h"
 #include "http/1.1/server/server.hpp"
+#include "http/1.1/server/event_stream.hpp"
 
 #include "tools/tools.h"
 #include "tools/log.h"
+#include "tools/metrics.h"
+#include "tools/probes.h"
+#include "tools/recorder/recorder.h"
 #include "tools/time.h"
 
 #include "config.h"
@@ -32,75 +41,13 @@ namespace po = boost::program_options;
 // Global initialization for simplicity, at the moment
 bu::RunDirectoryManager runDirectoryManager;
 
-/*****************************************************************************/
-
-#define EXISTS(b)   (b ? "yes" : "NO !!!")
+// Counters of every FU asking for files (see /stats/fu)
+bu::FUAccounting fuAccounting;
 
-void diagnoseRenameFailure(const std::string& fileName, const std::string& filePrefix, const fs::path& runDirectoryPath, const fs::path& fileFrom, const fs::path fileTo)
-{
-    LOG(DEBUG) << "---- DIAGNOSE ----";
-    try {
-        LOG(DEBUG) << "fileName         = \"" << fileName << '\"';
-        LOG(DEBUG) << "filePrefix       = \"" << filePrefix << '\"';
-        LOG(DEBUG) << "runDirectoryPath = " << runDirectoryPath << ", exists = " << EXISTS(fs::is_directory(runDirectoryPath));
-        LOG(DEBUG) << "fileFrom         = " << fileFrom << ", exists = " << EXISTS(fs::is_regular_file(fileFrom));
-        LOG(DEBUG) << "fileTo           = " << fileTo;
-        fs::path fuDirectory = fileTo.parent_path();
-        LOG(DEBUG) << "fuDirectory      = " << fuDirectory << ", exists = " << EXISTS(fs::is_directory(fuDirectory));
-    }
-    catch (fs::filesystem_error& e) {
-        LOG(ERROR) << "DIAGNOSE failed with: " << e.what();
-    }
-}
-
-/*
- * This will rename the index file based on filePrefix variable and if necessary create output directory specified in filePrefix.
- */
-void renameIndexFile(int runNumber, const std::string& filePrefix, const std::string& fileName)
-{
-    const fs::path runDirectoryPath = bu::getRunDirectory( runNumber ); 
-    const fs::path fileFrom = runDirectoryPath / fileName;
-    const fs::path fileTo = runDirectoryPath / ( filePrefix + fileName );
-    bool retry = false;
-    do {
-        try {
-            fs::rename( fileFrom, fileTo );
-            if (retry) {
-                LOG(DEBUG) << "Index file rename was succesfull.";
-            }
-            break;
-        }
-        catch (fs::filesystem_error& e) {
-            if (e.code() == boost::system::errc::no_such_file_or_directory) {
-                if (!retry) {
-                    const fs::path fuPath = runDirectoryPath / filePrefix;
-                    LOG(DEBUG) << "Index file rename failed, probably the directory for renamed files is missing, trying to create it: " << fuPath << '.';
-                    try {
-                        fs::create_directory( fuPath );
-                        // TODO: fix this with boost properly
-                        chmod( fuPath.string().c_str(), 0777 );
-                        LOG(DEBUG) << "Directory was created.";
-                        retry = true;
-                        continue;
-                    }
-                    catch (fs::filesystem_error& e) {
-                        LOG(ERROR) << "Creating directory " << fuPath << " failed.";
-                    }
-                } 
-            }
-
-            // Changing global state for the ERROR in thread unsafe. So for the moment we just abort.
-            //runDirectoryManager.setError( runNumber, e.what() );
-
-            std::string errorStr { "Index file rename failed: " };
-            errorStr += e.what(); 
-            LOG(FATAL) << errorStr << '.';
-            diagnoseRenameFailure( fileName, filePrefix, runDirectoryPath, fileFrom, fileTo);
-            RETHROW( std::runtime_error, errorStr );
-        }
-    } while (retry);
-}
+// Nanoseconds spent in the /popfile handler
+tools::metrics::histogram popFileLatency;
 
+/*****************************************************************************/
 
 unsigned long getParamUL(const http_server::request_t& req, const std::string& key, bool isOptional = false, unsigned long defaultValue = -1)
 {
@@ -125,23 +72,120 @@ unsigned long getParamUL(const http_server::request_t& req, const std::string& k
 }
 
 
+/*
+ * Statistics are "key=value" lines grouped in sections (e.g. "runNumber=N" or "http:"), section lines are not indented.
+ * These functions are used to send only the changed values to /stats/stream subscribers.
+ */
+typedef std::vector< std::tuple<std::string, std::string, std::string> > StatsLines_t;     // section, key, value
+
+StatsLines_t parseStats(const std::string& text)
+{
+    StatsLines_t lines;
+    std::string section;
+    std::istringstream is(text);
+    std::string line;
+
+    while (std::getline(is, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        const bool isIndented = (line[0] == ' ');
+        if (!isIndented && (line.compare(0, 10, "runNumber=") == 0 || line.back() == ':')) {
+            section = line;
+            continue;
+        }
+        const std::size_t begin = line.find_first_not_of(' ');
+        const std::size_t sep = line.find('=', begin);
+        if (sep == std::string::npos) {
+            continue;
+        }
+        lines.emplace_back( isIndented ? section : "", line.substr(begin, sep - begin), line.substr(sep + 1) );
+    }
+    return lines;
+}
+
+
+std::string jsonEscape(const std::string& str)
+{
+    std::string result;
+    result.reserve( str.size() );
+    for (const char ch : str) {
+        switch (ch) {
+            case '"':   result += "\\\""; break;
+            case '\\':  result += "\\\\"; break;
+            default:    result += ch;
+        }
+    }
+    return result;
+}
+
+
+// Returns {"section": {"key": "value", ...}, ...}, sections are kept in the order they first appeared
+std::string statsToJson(const StatsLines_t& lines)
+{
+    std::vector<std::string> sections;
+    std::map<std::string, std::ostringstream> keyValues;
+    for (const auto& line : lines) {
+        auto emplaceResult = keyValues.emplace( std::get<0>(line), std::ostringstream() );
+        std::ostringstream& os = emplaceResult.first->second;
+        if (emplaceResult.second) {
+            sections.push_back( std::get<0>(line) );
+        } else {
+            os << ',';
+        }
+        os << '"' << jsonEscape(std::get<1>(line)) << "\":\"" << jsonEscape(std::get<2>(line)) << '"';
+    }
+
+    std::ostringstream os;
+    os << '{';
+    for (const auto& section : sections) {
+        if (&section != &sections.front()) {
+            os << ',';
+        }
+        os << '"' << jsonEscape(section) << "\":{" << keyValues[section].str() << '}';
+    }
+    os << '}';
+    return os.str();
+}
+
+
 /*
  * The web application(s) are defined here
  */
-void createWebApplications(http_server::request_handler& app)
+void createWebApplications(http_server::server& server, std::chrono::milliseconds statsStreamInterval)
 {
+    http_server::request_handler& app = server.request_handler();
+
     app.add("/popfile",
     [](const http_server::request_t& req, http_server::response_t& res)
     {
+        tools::metrics::timer latencyTimer(popFileLatency);
+
         res.set(http::field::content_type, "text/plain");
         res.body().append("version=\"" BUFU_FILEBROKER_VERSION "\"\n");
 
         // Parse query parameters
         int runNumber;
         int stopLS = -1;
+        std::string group;
+        std::string fu;
+        unsigned int done = 0;
+        bu::RunDirectoryObserver::LSPartition partition;
         try {
             runNumber   = getParamUL(req, "runnumber");
             stopLS      = getParamUL(req, "stopls", /*isOptional*/ true);
+            done        = getParamUL(req, "done", /*isOptional*/ true, 0);
+            if (req.query("fu", fu) && !bu::isValidFUName(fu)) {
+                throw std::invalid_argument("ERROR: Wrong fu name, it can have up to 64 characters of [A-Za-z0-9_-]");
+            }
+            partition.mod   = getParamUL(req, "lsmod", /*isOptional*/ true, 0);
+            if (partition.mod > 0) {
+                partition.part  = getParamUL(req, "lspart");
+                partition.block = getParamUL(req, "lsblock", /*isOptional*/ true, 1);
+            }
+            if (req.query("group", group) && !bu::isConsumerGroup(group)) {
+                throw std::invalid_argument("ERROR: Unknown consumer group: '" + group + '\'');
+            }
         }
         catch (std::logic_error& e) {
             res.body().append(e.what());
@@ -151,27 +195,64 @@ void createWebApplications(http_server::request_handler& app)
 
         // Get file
         std::ostringstream os;
-        const std::string filePrefix = bu::getIndexFilePrefix();
         bu::FileInfo file;
         bu::RunDirectoryObserver::State state;
         //TODO: HACK: Raw file mode is hardcoded
         bu::RunDirectoryObserver::FileMode fileMode = bu::RunDirectoryObserver::FileMode::RAW;
         int lastEoLS;
-
-        std::tie( file, state, lastEoLS ) = runDirectoryManager.popRunFile( runNumber, stopLS );
+        bu::RunDirectoryObserver::RetryHint hint;
 
         std::string fileExtension;
-        // Rename the file before it is given to FU
-        if (file.type != bu::FileInfo::FileType::EMPTY) { 
-            // TODO: Make file rename it optional
-            switch (fileMode) {
-                case bu::RunDirectoryObserver::FileMode::JSN:   fileExtension = ".jsn"; break;
-                case bu::RunDirectoryObserver::FileMode::RAW:   fileExtension = ".raw"; break;
+        std::string filePrefix = bu::getIndexFilePrefix();
+        std::string renamedFilePrefix;
+        bu::FileMetadata metadata;
+        bool isMetadata = false;
+
+        if (group.empty()) {
+            try {
+                if (partition.mod > 0) {
+                    std::tie( file, state, lastEoLS ) = runDirectoryManager.popPartitionFile( runNumber, partition, stopLS, &hint );
+                } else if (fu.empty()) {
+                    std::tie( file, state, lastEoLS ) = runDirectoryManager.popRunFile( runNumber, stopLS, &hint );
+                } else {
+                    std::tie( file, state, lastEoLS ) = runDirectoryManager.popRunFile( runNumber, fu, done, stopLS, &hint );
+                }
+            }
+            catch (const std::invalid_argument& e) {
+                res.body().append(e.what());
+                res.result(http::status::bad_request);
+                return;
+            }
+
+            // Rename the file before it is given to FU
+            if (file.type != bu::FileInfo::FileType::EMPTY) { 
+                // TODO: Make file rename it optional
+                fileExtension = bu::RunDirectoryObserver::fileExtension( fileMode );
+                bu::renameIndexFile( runNumber, filePrefix, file.fileName() + fileExtension );
+                isMetadata = runDirectoryManager.getFileMetadata( runNumber, file, metadata );
+            }
+        } else {
+            // Consumer groups don't rename, the file is where the primary FUs left it (renamed or not yet)
+            std::tie( file, state, lastEoLS ) = runDirectoryManager.popGroupFile( runNumber, group, stopLS, &hint );
+
+            if (file.type != bu::FileInfo::FileType::EMPTY) { 
+                fileExtension = bu::RunDirectoryObserver::fileExtension( fileMode );
+                /*
+                 * A primary FU can rename the file any time, so both paths are sent. The group has to try
+                 * fileprefix first and then renamedfileprefix, the file is always in one of them in this order.
+                 */
+                renamedFilePrefix = filePrefix;
+                filePrefix.clear();
+                isMetadata = runDirectoryManager.getFileMetadata( runNumber, file, metadata, /*isGiven*/ false );
             }
-            renameIndexFile( runNumber, filePrefix, file.fileName() + fileExtension );
         }
 
+        fuAccounting.onReply( fu, req.remote_address().to_string(), file, hint.isWaitingForEoLS );
+
         os << "runnumber="  << runNumber << '\n';
+        if (!group.empty()) {
+            os << "group="      << group << '\n';
+        }
         os << "filemode="   << fileMode << '\n';
         os << "state="      << state << '\n';
 
@@ -183,11 +264,26 @@ void createWebApplications(http_server::request_handler& app)
             assert( (uint32_t)runNumber == file.runNumber );
             os << "file=\""         << file.fileName() << "\"\n";
             os << "fileprefix=\""   << filePrefix << "\"\n";
+            if (!group.empty()) {
+                os << "renamedfileprefix=\"" << renamedFilePrefix << "\"\n";
+            }
             os << "fileextension=\""<< fileExtension << "\"\n";
             os << "lumisection="    << file.lumiSection << '\n';
             os << "index="          << file.index << '\n';
+            // Known only when the header was already read, otherwise FU has to read it
+            if (isMetadata) {
+                os << "eventcount="     << metadata.eventCount << '\n';
+                os << "filesize="       << metadata.fileSize << '\n';
+                os << "headersize="     << metadata.headerSize << '\n';
+            }
         } else { 
             os << "lumisection="    << lastEoLS << '\n';
+            if (hint.retryAfterMs >= 0) {
+                os << "retryafterms="   << hint.retryAfterMs << '\n';
+            }
+            if (hint.nextEoLSMs >= 0) {
+                os << "nexteolsms="     << hint.nextEoLSMs << '\n';
+            }
         }
         os << "lasteols="           << lastEoLS << '\n';
 
@@ -210,7 +306,7 @@ void createWebApplications(http_server::request_handler& app)
     });
 
 
-    auto getStats = [](const http_server::request_t& req, http_server::response_t& res)
+    auto getStats = [&server](const http_server::request_t& req, http_server::response_t& res)
     {
         int runNumber = -1;
         {
@@ -232,6 +328,7 @@ void createWebApplications(http_server::request_handler& app)
             res.body().append( runDirectoryManager.getStats(runNumber) );
         } else {
             // Return statistics for all runs
+            res.body().append( server.stats() );
             res.body().append( runDirectoryManager.getStats() );
         }
     };
@@ -247,28 +344,134 @@ void createWebApplications(http_server::request_handler& app)
     });  
 
 
-    // HTML version of /stats
+    // Counters of every FU, to find FUs asking in a loop without getting files, or FUs that starve
+    app.add("/stats/fu",
+    [](const http_server::request_t& req, http_server::response_t& res)
+    {
+        (void)req;
+        res.set(http::field::content_type, "text/plain");
+        res.body().append("version=\"" BUFU_FILEBROKER_VERSION "\"\n");
+        res.body().append( fuAccounting.getStats() );
+    });
+
+
+    // Metrics in the Prometheus text format
+    app.add("/metrics",
+    [](const http_server::request_t& req, http_server::response_t& res)
+    {
+        (void)req;
+        res.set(http::field::content_type, "text/plain; version=0.0.4");
+
+        tools::metrics::exposition exposition;
+        exposition.gauge( "bufu_info", "Version of the broker", tools::metrics::exposition::label("version", BUFU_FILEBROKER_VERSION), 1 );
+        exposition.counter( "bufu_log_dropped_total", "Log messages dropped because the buffer was full", "", tools::log::logger::instance().getNbDropped() );
+        exposition.histogram( "bufu_popfile_seconds", "Time spent in the /popfile handler", "", popFileLatency.collect(), 1e-9, 10, 34 );
+        exposition.histogram( "bufu_rename_seconds", "Time to rename an index file before it is given to FU", "", bu::getRenameLatency().collect(), 1e-9, 10, 34 );
+        runDirectoryManager.getMetrics( exposition );
+
+        res.body().append( exposition.str() );
+    });
+
+
+    // Statistics pushed as server-sent events. There is only one producer no matter how many subscribers are connected.
+    auto statsStream = std::make_shared<http_server::event_stream>( server.io_context(), statsStreamInterval,
+    [&server, previous = std::map<std::string, std::string>()](http_server::event_stream& stream) mutable
+    {
+        std::string text = "version=\"" BUFU_FILEBROKER_VERSION "\"\n";
+        text += server.stats();
+        text += runDirectoryManager.getStats();
+
+        const StatsLines_t lines = parseStats( text );
+        StatsLines_t changes;
+        for (const auto& line : lines) {
+            std::string& value = previous[ std::get<0>(line) + '\n' + std::get<1>(line) ];
+            if (value != std::get<2>(line)) {
+                value = std::get<2>(line);
+                changes.push_back( line );
+            }
+        }
+
+        if (!changes.empty()) {
+            stream.publish( "update", statsToJson(changes) );
+            stream.set_snapshot( "snapshot", statsToJson(lines) );
+        }
+    });
+    statsStream->run();
+
+
+    app.add_stream("/stats/stream",
+    [statsStream](const http_server::request_t& req, tcp::socket&& socket, http_server::connection_slot&& slot)
+    {
+        (void)req;
+        statsStream->subscribe( std::move(socket), std::move(slot) );
+    });
+
+
+    // HTML version of /stats, the page is updated from /stats/stream
     app.add("/html/stats",
-    [getStats](const http_server::request_t& req, http_server::response_t& res)
+    [](const http_server::request_t& req, http_server::response_t& res)
     {
+        std::string runNumber;
+        if (req.query("runnumber", runNumber)) {
+            try {
+                // Starts the observer if it doesn't exist yet
+                runNumber = std::to_string( std::stoul(runNumber) );
+                runDirectoryManager.getStats( std::stoul(runNumber) );
+            }
+            catch(const std::exception& e) {
+                res.body().append( "ERROR: Cannot parse query parameter: '" + runNumber + '\'' );
+                res.result(http::status::bad_request);
+                return;
+            }
+        }
+
         res.body().append( "<html>\n" );
         res.body().append( "<head>\n" );
         res.body().append( "<title>BUFU File Server</title>" );
-        res.body().append( "<meta http-equiv=\"refresh\" content=\"1\" />" );
         res.body().append( "</head>\n" );
         res.body().append( "<body>\n" );
-        res.body().append( "<pre>\n" );
-
-        res.body().append("version=\"" BUFU_FILEBROKER_VERSION "\"\n");
-
-        getStats( req, res );
-
+        res.body().append( "<pre id=\"stats\">\n" );
+        res.body().append( "version=\"" BUFU_FILEBROKER_VERSION "\"\n" );
         res.body().append( "</pre>\n" );
+        res.body().append( "<script>\n" );
+        res.body().append( "var runNumber = \"" + runNumber + "\";\n" );
+        res.body().append(
+            "var stats = {};\n"
+            "function render() {\n"
+            "  var text = '';\n"
+            "  for (var section in stats) {\n"
+            "    if (runNumber && section && section !== 'runNumber=' + runNumber) continue;\n"
+            "    if (section) text += section + '\\n';\n"
+            "    for (var key in stats[section]) text += (section ? '  ' : '') + key + '=' + stats[section][key] + '\\n';\n"
+            "    if (section) text += '\\n';\n"
+            "  }\n"
+            "  document.getElementById('stats').textContent = text;\n"
+            "}\n"
+            "var source = new EventSource('/stats/stream');\n"
+            "source.addEventListener('snapshot', function(e) { stats = JSON.parse(e.data); render(); });\n"
+            "source.addEventListener('update', function(e) {\n"
+            "  var changes = JSON.parse(e.data);\n"
+            "  for (var section in changes) {\n"
+            "    if (!(section in stats)) stats[section] = {};\n"
+            "    for (var key in changes[section]) stats[section][key] = changes[section][key];\n"
+            "  }\n"
+            "  render();\n"
+            "});\n"
+        );
+        res.body().append( "</script>\n" );
         res.body().append( "</body>\n" );
         res.body().append( "</html>\n" );
     });        
 
 
+    // FUs holding a persistent connection get files pushed
+    app.add_stream("/ws/files",
+    [](const http_server::request_t& req, tcp::socket&& socket, http_server::connection_slot&& slot)
+    {
+        std::make_shared<bu::FileFeed>( std::move(socket), std::move(slot), runDirectoryManager, req )->run( req );
+    });
+
+
     app.add("/index.html",
     [](const http_server::request_t& req, http_server::response_t& res)
     {
@@ -289,6 +492,76 @@ void createWebApplications(http_server::request_handler& app)
     });
 
 
+    /*
+     * Shows the log levels, or changes them:
+     *   ?level=INFO                  - the default level
+     *   ?module=NAME&level=DEBUG     - the level of one module (the source file name, e.g. RunDirectoryObserver)
+     *   ?module=NAME&level=default   - the module follows the default level again
+     */
+    app.add("/admin/loglevel",
+    [](const http_server::request_t& req, http_server::response_t& res)
+    {
+        res.set(http::field::content_type, "text/plain");
+        res.body().append("version=\"" BUFU_FILEBROKER_VERSION "\"\n");
+
+        std::string module;
+        std::string levelName;
+        req.query("module", module);
+        if (req.query("level", levelName)) {
+            LOG_LEVEL level;
+            if (!module.empty() && levelName == "default") {
+                tools::log::resetLevel( module );
+            } else if (!tools::log::parseLevel( levelName, level )) {
+                res.body().append( "ERROR: Unknown log level: '" + levelName + "', use TRACE, DEBUG, INFO, WARNING, ERROR or FATAL" );
+                res.result(http::status::bad_request);
+                return;
+            } else if (module.empty()) {
+                tools::log::setLevel( level );
+            } else {
+                tools::log::setLevel( module, level );
+            }
+            LOG(INFO) << "Log level of " << (module.empty() ? "default" : module) << " set to " << levelName;
+        }
+
+        std::ostringstream os;
+        os << "default=" << tools::log::getLevelName( (LOG_LEVEL)tools::log::defaultLevel().load() ) << '\n';
+        for (const auto& pair : tools::log::modules::instance().getLevels()) {
+            os << pair.first << '=';
+            if (pair.second < 0) {
+                os << "default";
+            } else {
+                os << tools::log::getLevelName( (LOG_LEVEL)pair.second );
+            }
+            os << '\n';
+        }
+        res.body().append( os.str() );
+    });
+
+
+    /*
+     * The flight recorder: the last events of every thread, as text
+     *   ?format=binary               - the dump as it is written on a crash (for bufu_recorder_decode)
+     */
+    app.add("/admin/recorder",
+    [](const http_server::request_t& req, http_server::response_t& res)
+    {
+        const std::string data = tools::recorder::dumpToString();
+
+        std::string format;
+        if (req.query("format", format) && format == "binary") {
+            res.set(http::field::content_type, "application/octet-stream");
+            res.body() = data;
+            return;
+        }
+
+        res.set(http::field::content_type, "text/plain");
+        res.body().append("version=\"" BUFU_FILEBROKER_VERSION "\"\n");
+        std::ostringstream os;
+        tools::recorder::decode( data, os );
+        res.body().append( os.str() );
+    });
+
+
     app.add("/restart",
     [](const http_server::request_t& req, http_server::response_t& res)
     {
@@ -332,6 +605,7 @@ void serverRunner(http_server::server& s)
 int main(int argc, char *argv[])
 {
     LOG(INFO) << "BUFU File Broker v" << BUFU_FILEBROKER_VERSION;
+    LOG(INFO) << "USDT probes: " << (tools::probes::isEnabled() ? "enabled" : "compiled out");
 
     std::string address;
     std::string port;
@@ -339,6 +613,30 @@ int main(int argc, char *argv[])
     std::string docRoot; 
     std::string indexFilePrefix;
     bool debugHTTPRequests = false;
+    http_server::admission_config admission;
+    unsigned int headerTimeout;
+    unsigned int bodyTimeout;
+    unsigned int writeTimeout;
+    unsigned int statsStreamInterval;
+    std::string backendName;
+    std::string handoffSocket;
+    unsigned int handoffDrainTimeout;
+    http_server::thread_pool_config pool;
+    unsigned int poolGrowDelay;
+    unsigned int poolIdleTime;
+    int retryMinMs;
+    int retryMaxMs;
+    int speculativeLS;
+    int watchRuns;
+    std::vector<std::string> consumerGroups;
+    std::string scheduling;
+    bu::Scheduler::Config schedulerConfig;
+    unsigned int fuFileTimeout;
+    bool noFileMetadata = false;
+    std::string logLevel;
+    std::vector<std::string> logModules;
+    std::string recorderFile;
+    http_server::backend backend = http_server::backend::ASIO;
 
     try {
         po::options_description desc("Options (default values are in brackets)");
@@ -346,10 +644,36 @@ int main(int argc, char *argv[])
             ("help,h", "this help message.")
             ("bind", po::value<std::string>(&address)->default_value("0.0.0.0"), "bind to a specific address.")
             ("port", po::value<std::string>(&port)->default_value("8080"), "listen on a port.")
-            ("threads", po::value<int>(&nbThreads)->default_value(1), "number of threads serving HTTP requests.")
+            ("threads", po::value<int>(&nbThreads)->default_value(1), "number of threads serving HTTP requests (the minimum when --max-threads is higher).")
+            ("max-threads", po::value<int>(&pool.max_threads)->default_value(0), "maximum number of threads serving HTTP requests, threads are added under load and retired when idle.")
+            ("pool-grow-delay", po::value<unsigned int>(&poolGrowDelay)->default_value(2000), "microseconds a handler waits in the queue before a thread is added.")
+            ("pool-idle-time", po::value<unsigned int>(&poolIdleTime)->default_value(30), "seconds the threads are idle before one is retired.")
             ("docroot", po::value<std::string>(&docRoot)->default_value("/fff/ramdisk"), "path from where the files are served.")
             ("index-file-prefix", po::value<std::string>(&indexFilePrefix)->default_value("fu/"), "file prefix used when index files are renamed.")
+            ("retry-min-ms", po::value<int>(&retryMinMs)->default_value(10), "lower bound of retryafterms recommended to FUs in empty /popfile replies.")
+            ("retry-max-ms", po::value<int>(&retryMaxMs)->default_value(1000), "upper bound of retryafterms recommended to FUs in empty /popfile replies.")
+            ("speculative-ls", po::value<int>(&speculativeLS)->default_value(0), "give index files up to this many lumisections ahead while waiting for a late EoLS (0 keeps the strict order).")
+            ("watch-runs", po::value<int>(&watchRuns)->default_value(0), "start observers for the newest N run directories as soon as they appear in docroot, before FUs ask (0 disables).")
+            ("consumer-group", po::value<std::vector<std::string>>(&consumerGroups)->composing(), "name of a consumer group getting every file through /popfile?group=NAME without renaming, can be repeated.")
+            ("scheduling", po::value<std::string>(&scheduling)->default_value("fcfs"), "comma separated scheduling policies for FUs identified by /popfile?fu=NAME: fcfs, roundrobin, weighted, affinity, cap.")
+            ("fu-max-outstanding", po::value<unsigned int>(&schedulerConfig.maxOutstanding)->default_value(4), "files one FU can have at once with the cap policy.")
+            ("fu-file-timeout", po::value<unsigned int>(&fuFileTimeout)->default_value(60), "seconds after which a file not reported done (/popfile?done=N) stops counting as outstanding.")
+            ("no-file-metadata", po::bool_switch(&noFileMetadata), "don't read headers of RAW files on discovery, FUs then get only the file name without eventcount and filesize.")
+            ("log-level", po::value<std::string>(&logLevel)->default_value("DEBUG"), "messages below this level are not logged: TRACE, DEBUG, INFO, WARNING, ERROR, FATAL (can be changed with /admin/loglevel).")
+            ("log-module", po::value<std::vector<std::string>>(&logModules)->composing(), "level of one module as NAME=LEVEL, the module is the source file name (e.g. RunDirectoryObserver=INFO), can be repeated.")
+            ("recorder-file", po::value<std::string>(&recorderFile)->default_value("/tmp/bufu_filebroker-%p.recorder"), "file for the flight recorder dump on a crash, %p is replaced by the process ID (empty disables, see also /admin/recorder).")
             ("debug-http-requests", po::bool_switch(&debugHTTPRequests), "print debug information when HTTP request is received.")
+            ("max-connections", po::value<unsigned int>(&admission.max_connections)->default_value(0), "maximum number of open HTTP connections, 0 is unlimited.")
+            ("client-rate", po::value<double>(&admission.client_rate)->default_value(0), "maximum requests per second from one client address, 0 is unlimited.")
+            ("client-burst", po::value<double>(&admission.client_burst)->default_value(10), "how many requests a client can send at once above the client-rate.")
+            ("retry-after", po::value<unsigned int>(&admission.retry_after)->default_value(1), "seconds reported in Retry-After of shed requests.")
+            ("header-timeout", po::value<unsigned int>(&headerTimeout)->default_value(30), "seconds to receive HTTP request header (and keep-alive idle time).")
+            ("body-timeout", po::value<unsigned int>(&bodyTimeout)->default_value(30), "seconds to receive HTTP request body.")
+            ("write-timeout", po::value<unsigned int>(&writeTimeout)->default_value(30), "seconds to send HTTP response, a client that doesn't read it is disconnected.")
+            ("stats-stream-interval", po::value<unsigned int>(&statsStreamInterval)->default_value(1000), "milliseconds between updates sent to /stats/stream subscribers.")
+            ("backend", po::value<std::string>(&backendName)->default_value("asio"), "network backend of the HTTP server: asio or io_uring.")
+            ("handoff-socket", po::value<std::string>(&handoffSocket)->default_value(""), "Unix socket path for zero-downtime restarts, a new process takes over the running one through it (empty disables).")
+            ("handoff-drain-timeout", po::value<unsigned int>(&handoffDrainTimeout)->default_value(30), "seconds the previous process serves its open connections after the handoff.")
         ;
 
         po::variables_map vm;        
@@ -362,20 +686,121 @@ int main(int argc, char *argv[])
             return 0;
         }
 
+        LOG_LEVEL level;
+        if (!tools::log::parseLevel( logLevel, level )) {
+            throw std::invalid_argument("unknown log level '" + logLevel + "'");
+        }
+        tools::log::setLevel( level );
+        for (const auto& logModule : logModules) {
+            const std::size_t pos = logModule.find('=');
+            if (pos == std::string::npos || !tools::log::parseLevel( logModule.substr(pos + 1), level )) {
+                throw std::invalid_argument("log module has to be NAME=LEVEL, got '" + logModule + "'");
+            }
+            tools::log::setLevel( logModule.substr(0, pos), level );
+        }
+
+        const std::size_t pidPos = recorderFile.find("%p");
+        if (pidPos != std::string::npos) {
+            recorderFile.replace( pidPos, 2, std::to_string(getpid()) );
+        }
+        tools::recorder::setDumpFile( recorderFile );
+        if (!recorderFile.empty()) {
+            LOG(INFO) << "Flight recorder: dumped to " << recorderFile << " on a crash";
+        }
+        // The log is written out on a crash even without the recorder file
+        tools::recorder::installSignalHandlers();
+        tools::log::installTerminateHandler();
+
         bu::setBaseDirectory( docRoot );
         bu::setIndexFilePrefix( indexFilePrefix );
+        bu::setRetryBounds( retryMinMs, retryMaxMs );
+        bu::setSpeculativeLS( speculativeLS );
+        bu::setConsumerGroups( consumerGroups );
+
+        schedulerConfig.fileTimeout = std::chrono::seconds( fuFileTimeout );
+        std::vector<std::string> policies;
+        boost::split( policies, scheduling, boost::is_any_of(",") );
+        runDirectoryManager.setScheduler( policies, schedulerConfig );
+        if (!noFileMetadata) {
+            runDirectoryManager.readFileMetadata();
+        }
+
+        admission.header_timeout = std::chrono::seconds( headerTimeout );
+        admission.body_timeout = std::chrono::seconds( bodyTimeout );
+        admission.write_timeout = std::chrono::seconds( writeTimeout );
+        pool.grow_delay = std::chrono::microseconds( poolGrowDelay );
+        pool.idle_time = std::chrono::seconds( poolIdleTime );
+
+        if (backendName == "io_uring") {
+            backend = http_server::backend::IO_URING;
+        } else if (backendName != "asio") {
+            throw std::invalid_argument("unknown backend '" + backendName + "', use asio or io_uring");
+        }
     }
     catch(std::exception& e) {
         LOG(ERROR) << "ERROR: " << e.what();
         return 1;
     }
 
+    // Take over the listening socket and the runs from the running process (if any)
+    int listenFd = -1;
+    std::unique_ptr<bu::Handoff> handoff;
+    if (!handoffSocket.empty()) {
+        try {
+            handoff.reset( new bu::Handoff(handoffSocket) );
+            bu::Handoff::Snapshots_t snapshots;
+            if (handoff->takeOver( listenFd, snapshots )) {
+                runDirectoryManager.restore( snapshots );
+            }
+        }
+        catch(const std::exception& e) {
+            LOG(ERROR) << "Handoff: Taking over failed: " << e.what();
+            return 1;
+        }
+    }
+
+    // Prepare the runs before FUs ask for them (after the handoff, so the restored runs are kept)
+    if (watchRuns > 0) {
+        runDirectoryManager.watchBaseDirectory( watchRuns );
+    }
+
     // Initialise the server.
     // Note: docRoot is not used here
-    http_server::server s(address, port, docRoot, nbThreads, debugHTTPRequests);
+    http_server::server s(address, port, docRoot, nbThreads, debugHTTPRequests, admission, backend, listenFd, pool);
 
     // Add handlers
-    createWebApplications( s.request_handler() );
+    createWebApplications( s, std::chrono::milliseconds(statsStreamInterval) );
+
+    if (handoff) {
+        // The previous process drains once it acknowledges, connections are accepted from then on (the server threads are started below)
+        try {
+            handoff->confirm();
+        }
+        catch(const std::exception& e) {
+            // Threads of the observers are never stopped (as when draining below)
+            LOG(ERROR) << "Handoff: Confirming failed, the previous process continues: " << e.what();
+            tools::log::flush();
+            std::quick_exit(1);
+        }
+
+        // Wait for the next process
+        handoff->serve( s.listen_fd(), runDirectoryManager, 
+        [&s, handoffDrainTimeout]()
+        {
+            s.drain();
+            LOG(INFO) << "Handoff: Draining " << s.nb_connections() << " connection(s).";
+
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(handoffDrainTimeout);
+            while (s.nb_connections() > 0 && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+
+            // Threads of the observers and the server are never stopped, so we don't wait for them
+            LOG(INFO) << "Handoff: Finished with " << s.nb_connections() << " open connection(s), exiting.";
+            tools::log::flush();
+            std::quick_exit(0);
+        });
+    }
 
     LOG(INFO) << "Server: Starting HTTP server with " << nbThreads << " thread(s) at " << address << ':' << port << docRoot << " and using " << indexFilePrefix << " as index file prefix."; 
 
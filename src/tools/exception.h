@@ -1,6 +1,7 @@
 #ifndef _EXCEPTION_H_
 #define _EXCEPTION_H_
 
+#include <cstring>
 #include <iostream>
 
 /*
@@ -18,6 +19,7 @@
  */
 
 #include "tools/exception/stacktrace.h"
+#include "tools/recorder/recorder.h"
 
 #define DEBUG_EXCEPTIONS
 
@@ -59,6 +61,9 @@
 		} \
 		catch(const std::exception& e) { \
 			tools::exception::temporary::print_exception(e); \
+			tools::exception::temporary::record_exception(e); \
+			tools::recorder::dumpToFile( 0 ); \
+			tools::log::flush(); \
 			std::rethrow_exception(std::current_exception()); \
 		} \
 
@@ -88,6 +93,20 @@ namespace tools {
 					print_exception(e, level+1);
 				} catch(...) {}
 			}
+
+			// Records every nested exception into the flight recorder, the messages start with the source
+			// location and the function, so their end is kept when they are too long
+			static void record_exception(const std::exception& e)
+			{
+				const std::size_t size = std::strlen(e.what());
+				const std::size_t skip = size > tools::recorder::event::textSize ? size - tools::recorder::event::textSize : 0;
+				tools::recorder::recordText( tools::recorder::type::EXCEPTION, e.what() + skip, size - skip );
+				try {
+					std::rethrow_if_nested(e);
+				} catch(const std::exception& e) {
+					record_exception(e);
+				} catch(...) {}
+			}
 		};
 	}
 }
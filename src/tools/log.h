@@ -1,13 +1,30 @@
 #pragma once
 
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
 #include <iostream>
-#include <sstream>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "tools/exception.h"    // For TOOLS_DEBUG_INFO
+#include "tools/synchronized/ring.h"
 /*
  * Simple logging macros, replace later with boost when we have a version with logging...
+ *
+ * Logging doesn't block: the message is formatted in the calling thread and put into the ring buffer
+ * of that thread, a background thread writes the buffers to stdout. When the buffer is full,
+ * the message is dropped and counted (reported in the log later).
  */
 
 //#include <boost/log/trivial.hpp>
@@ -21,8 +38,35 @@ enum LOG_LEVEL {
     FATAL
 };
 
-//#define LOG(severity)   ( tools::log::debug() << "[0x" << std::hex << std::this_thread::get_id() << std::dec << "] " << severity << " [" TOOLS_DEBUG_INFO ", " << __PRETTY_FUNCTION__ << "]: " ) 
-#define LOG(severity)   ( tools::log::log() << "[0x" << std::hex << std::this_thread::get_id() << std::dec << "] " << severity << __func__ << ": " ) 
+/*
+ * Levels below LOG_MIN_LEVEL are removed at compile time (e.g. -DLOG_MIN_LEVEL=INFO),
+ * the others are compared with the runtime level of the module (see tools::log::setLevel).
+ * Arguments of a disabled LOG are not evaluated at all.
+ *
+ * The module is the name of the source file without the extension (e.g. RunDirectoryObserver),
+ * it is looked up only once per call site.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+
+#define TOOLS_LOG_SITE()    ( []() -> tools::log::module& { static tools::log::module& site = tools::log::getModule(__FILE__); return site; }() )
+
+#define TOOLS_LOG_ENABLED(severity) \
+    ( (severity) >= LOG_MIN_LEVEL && tools::log::isEnabled( severity, TOOLS_LOG_SITE() ) )
+
+//#define LOG(severity)   ( tools::log::debug() << "[0x" << std::hex << std::this_thread::get_id() << std::dec << "] " << severity << " [" TOOLS_DEBUG_INFO ", " << __PRETTY_FUNCTION__ << "]: " )
+#define LOG(severity) \
+    !TOOLS_LOG_ENABLED(severity) ? (void)0 : tools::log::voidify() & tools::log::log() << severity << __func__ << ": "
+
+/*
+ * The same, for noisy call sites: at most perSecond messages are logged per second, the number
+ * of suppressed messages is added to the next logged one. It can be used only as a statement.
+ */
+#define LOG_RATE(severity, perSecond) \
+    for (tools::log::rateLimiter* limiter_ = TOOLS_LOG_ENABLED(severity) ? tools::log::rateLimiter::allow( []() -> tools::log::rateLimiter& { static tools::log::rateLimiter limiter; return limiter; }(), perSecond ) : nullptr; \
+         limiter_ != nullptr; limiter_ = nullptr) \
+        tools::log::log( *limiter_ ) << severity << __func__ << ": "
 
 
 namespace tools {
@@ -44,28 +88,548 @@ inline std::ostream& operator<< (std::ostream& os, enum LOG_LEVEL severity)
 }
 
 
-// From: https://stackoverflow.com/questions/2179623/how-does-qdebug-stuff-add-a-newline-automatically/2179782#2179782
+/*
+ * Runtime levels: every module has its own level or follows the default one
+ */
+struct module {
+    std::atomic<int> level { -1 };                  // -1 follows the default level
+};
+
+inline std::atomic<int>& defaultLevel()
+{
+    static std::atomic<int> level { TRACE };
+    return level;
+}
+
+class modules {
+public:
+    static modules& instance() {
+        static modules instance;
+        return instance;
+    }
+
+    module& get(const std::string& name) {
+        std::lock_guard<std::mutex> lock(modulesLock);
+        std::unique_ptr<module>& m = modules_[ name ];
+        if (!m) {
+            m.reset( new module() );
+        }
+        return *m;
+    }
+
+    // Module name and its level (-1 when it follows the default one)
+    std::vector< std::pair<std::string, int> > getLevels() {
+        std::vector< std::pair<std::string, int> > levels;
+        std::lock_guard<std::mutex> lock(modulesLock);
+        for (const auto& pair : modules_) {
+            levels.emplace_back( pair.first, pair.second->level.load() );
+        }
+        return levels;
+    }
+
+private:
+    modules() = default;
+
+    std::map< std::string, std::unique_ptr<module> > modules_;
+    std::mutex modulesLock;
+};
+
+// The module of a source file, e.g. "src/bu/bu.cc" is "bu"
+inline module& getModule(const char* file)
+{
+    const char* name = std::strrchr(file, '/');
+    name = (name != nullptr) ? name + 1 : file;
+    const char* extension = std::strchr(name, '.');
+    return modules::instance().get( extension != nullptr ? std::string(name, extension) : std::string(name) );
+}
+
+inline bool isEnabled(enum LOG_LEVEL severity, const module& m)
+{
+    int level = m.level.load(std::memory_order_relaxed);
+    if (level < 0) {
+        level = defaultLevel().load(std::memory_order_relaxed);
+    }
+    return severity >= level;
+}
+
+inline const char* getLevelName(enum LOG_LEVEL level)
+{
+    static const char* names[] = { "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL" };
+    return names[level];
+}
+
+// Returns false for an unknown name, the names are case insensitive
+inline bool parseLevel(std::string name, enum LOG_LEVEL& level)
+{
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    for (int i = TRACE; i <= FATAL; ++i) {
+        if (name == getLevelName( (enum LOG_LEVEL)i )) {
+            level = (enum LOG_LEVEL)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void setLevel(enum LOG_LEVEL level)
+{
+    defaultLevel().store(level);
+}
+
+// The module doesn't have to log anything yet, it gets the level when it does
+inline void setLevel(const std::string& module, enum LOG_LEVEL level)
+{
+    modules::instance().get( module ).level.store( level );
+}
+
+// The module follows the default level again
+inline void resetLevel(const std::string& module)
+{
+    modules::instance().get( module ).level.store( -1 );
+}
+
+/*
+ * Allows at most perSecond messages in every second
+ */
+struct rateLimiter {
+    std::atomic<int64_t> second { 0 };
+    std::atomic<uint32_t> count { 0 };
+    std::atomic<uint64_t> nbSuppressed { 0 };
+
+    // Returns the limiter when the message can be logged, nullptr otherwise
+    static rateLimiter* allow(rateLimiter& limiter, uint32_t perSecond) {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        int64_t current = limiter.second.load(std::memory_order_relaxed);
+        if (current != ts.tv_sec && limiter.second.compare_exchange_strong(current, ts.tv_sec)) {
+            limiter.count.store(0, std::memory_order_relaxed);
+        }
+        if (limiter.count.fetch_add(1, std::memory_order_relaxed) < perSecond) {
+            return &limiter;
+        }
+        limiter.nbSuppressed.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+};
+
+// Makes the type of the LOG expression void, & binds weaker than << and stronger than ?:
+struct voidify {
+    template<class T>
+    void operator&(const T&) {}
+};
+
+
+// A message, or a part of a longer one, in the buffer of a thread
+struct entry {
+    static const std::size_t textSize = 240;
+
+    int64_t timeMs;                     // Wall clock time of the message
+    uint16_t size;
+    bool isContinued;                   // The next entry is the continuation of this message
+    char text[textSize];
+};
+
+
+struct threadBuffer {
+    static const std::size_t capacity = 1024;       // Entries, 256 KiB per thread
+
+    explicit threadBuffer(std::string&& prefix) : prefix(std::move(prefix)), ring(capacity) {}
+
+    const std::string prefix;           // Thread ID, the same for all messages of the thread
+    tools::synchronized::ring<entry> ring;
+    std::atomic<uint64_t> nbDropped { 0 };
+    std::atomic<bool> isClosed { false };           // The thread finished, the buffer is removed when drained
+    std::string partial;                            // The beginning of a message not fully drained yet (used by the logger thread)
+};
+
+
+class logger {
+public:
+    static logger& instance() {
+        static logger instance;
+        return instance;
+    }
+
+    // Set when the logger was destroyed at exit, messages are then written directly
+    static std::atomic<bool>& isStopped() {
+        static std::atomic<bool> stopped { false };
+        return stopped;
+    }
+
+    logger(const logger&) = delete;
+    logger& operator=(const logger&) = delete;
+
+    // The remaining messages are written out
+    ~logger() {
+        isStopped().store(true);
+        stopRequest.store(true);
+        if (runnerThread.joinable()) {
+            runnerThread.join();
+        }
+        drain();
+    }
+
+    // Puts the message into the buffer of the calling thread, it is dropped whole when it doesn't fit
+    void write(const std::string& message) {
+        threadBuffer& buffer = localBuffer();
+
+        // A cached clock, updated by the kernel every tick, reading it is not a syscall
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        const int64_t timeMs = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+        // Only this thread pushes, so the free space can only grow meanwhile
+        const std::size_t textSize = entry::textSize;
+        const std::size_t nbEntries = std::max<std::size_t>(1, (message.size() + textSize - 1) / textSize);
+        if (buffer.ring.capacity() - buffer.ring.size_approx() < nbEntries) {
+            buffer.nbDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        for (std::size_t i = 0; i < nbEntries; ++i) {
+            entry e;
+            const std::size_t offset = i * textSize;
+            e.timeMs = timeMs;
+            e.size = std::min(textSize, message.size() - offset);
+            e.isContinued = (i + 1 < nbEntries);
+            std::memcpy(e.text, message.data() + offset, e.size);
+            buffer.ring.try_push( std::move(e) );
+        }
+    }
+
+    // Writes out everything logged so far
+    void flush() {
+        // The logger thread can be in drain() already (e.g. std::terminate from there)
+        if (std::this_thread::get_id() == runnerThread.get_id()) {
+            return;
+        }
+        drain();
+    }
+
+    /*
+     * Best effort from a fatal signal handler: writes out what is in the buffers without taking a lock or allocating.
+     * The rings are MPMC, so the entries are taken either by us or by the logger thread. The time is in UTC.
+     */
+    static void drainOnSignal() {
+        entry entries[8];
+        for (auto& slot : signalBuffers()) {
+            threadBuffer* buffer = slot.load(std::memory_order_acquire);
+            if (buffer == nullptr) {
+                continue;
+            }
+            std::size_t nbEntries;
+            while ((nbEntries = buffer->ring.try_pop_batch(entries, 8)) > 0) {
+                for (std::size_t i = 0; i < nbEntries; ++i) {
+                    char time[32];
+                    writeRaw( time, formatTimeUTC(entries[i].timeMs, time) );
+                    writeRaw( buffer->prefix.data(), buffer->prefix.size() );
+                    writeRaw( entries[i].text, entries[i].size );
+                    if (!entries[i].isContinued) {
+                        writeRaw( "\n", 1 );
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t getNbDropped() {
+        std::lock_guard<std::mutex> lock(buffersLock);
+        uint64_t nbDropped = nbDroppedClosed;
+        for (const auto& buffer : buffers) {
+            nbDropped += buffer->nbDropped.load(std::memory_order_relaxed);
+        }
+        return nbDropped;
+    }
+
+private:
+    logger() {
+        runnerThread = std::thread(&logger::runner, this);
+        tools::recorder::fatalSignalHook().store( &logger::drainOnSignal );
+    }
+
+    // The buffers for drainOnSignal(), which can't take buffersLock. Threads over the limit are not drained there.
+    static std::atomic<threadBuffer*> (&signalBuffers())[256] {
+        static std::atomic<threadBuffer*> slots[256];
+        return slots;
+    }
+
+    // "YYYY-mm-dd HH:MM:SS.mmm UTC " without localtime_r, which is not async-signal-safe
+    static std::size_t formatTimeUTC(int64_t timeMs, char* text) {
+        const int64_t seconds = timeMs / 1000;
+        const int64_t secondsOfDay = seconds % 86400;
+        // Civil date from the days since the epoch (Howard Hinnant's days_from_civil inverted)
+        const int64_t z = seconds / 86400 + 719468;
+        const int64_t era = z / 146097;
+        const int64_t doe = z - era * 146097;
+        const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const int64_t mp = (5 * doy + 2) / 153;
+        const int64_t day = doy - (153 * mp + 2) / 5 + 1;
+        const int64_t month = mp < 10 ? mp + 3 : mp - 9;
+        const int64_t year = yoe + era * 400 + (month <= 2);
+
+        const int64_t fields[] = { year, month, day, secondsOfDay / 3600, secondsOfDay / 60 % 60, secondsOfDay % 60, timeMs % 1000 };
+        const int widths[] = { 4, 2, 2, 2, 2, 2, 3 };
+        const char separators[] = "-- ::. ";
+        std::size_t pos = 0;
+        for (int f = 0; f < 7; ++f) {
+            for (int w = widths[f] - 1, value = (int)fields[f]; w >= 0; --w, value /= 10) {
+                text[pos + w] = '0' + value % 10;
+            }
+            pos += widths[f];
+            text[pos++] = separators[f];
+        }
+        std::memcpy(text + pos, "UTC ", 4);
+        return pos + 4;
+    }
+
+    // Releases the buffer when the thread finishes
+    struct bufferHolder {
+        std::shared_ptr<threadBuffer> buffer;
+        ~bufferHolder() { buffer->isClosed.store(true, std::memory_order_release); }
+    };
+
+    threadBuffer& localBuffer() {
+        thread_local bufferHolder holder { registerBuffer() };
+        return *holder.buffer;
+    }
+
+    std::shared_ptr<threadBuffer> registerBuffer() {
+        std::ostringstream os;
+        os << "[0x" << std::hex << std::this_thread::get_id() << std::dec << "] ";
+        auto buffer = std::make_shared<threadBuffer>( os.str() );
+
+        std::lock_guard<std::mutex> lock(buffersLock);
+        buffers.push_back( buffer );
+        for (auto& slot : signalBuffers()) {
+            threadBuffer* empty = nullptr;
+            if (slot.compare_exchange_strong(empty, buffer.get())) {
+                break;
+            }
+        }
+        return buffer;
+    }
+
+    void runner() {
+        while (!stopRequest.load()) {
+            // Sleep only when there was nothing to write
+            if (!drain()) {
+                std::this_thread::sleep_for( std::chrono::milliseconds(5) );
+            }
+        }
+    }
+
+    // Writes the content of all buffers, returns false when there was nothing
+    bool drain() {
+        std::lock_guard<std::mutex> drainGuard(drainLock);
+
+        std::vector< std::shared_ptr<threadBuffer> > snapshot;
+        {
+            std::lock_guard<std::mutex> lock(buffersLock);
+            snapshot = buffers;
+        }
 
-static std::mutex lock;
+        output.clear();
+        entry entries[32];
+        for (const auto& buffer : snapshot) {
+            std::size_t nbEntries;
+            while ((nbEntries = buffer->ring.try_pop_batch(entries, 32)) > 0) {
+                for (std::size_t i = 0; i < nbEntries; ++i) {
+                    // The message is written when it is complete, the rest can still be on the way
+                    if (entries[i].isContinued || !buffer->partial.empty()) {
+                        buffer->partial.append( entries[i].text, entries[i].size );
+                        if (entries[i].isContinued) {
+                            continue;
+                        }
+                        // All parts have the same time
+                        appendTime( entries[i].timeMs );
+                        output += buffer->prefix;
+                        output += buffer->partial;
+                        buffer->partial.clear();
+                    } else {
+                        appendTime( entries[i].timeMs );
+                        output += buffer->prefix;
+                        output.append( entries[i].text, entries[i].size );
+                    }
+                    output += '\n';
+                }
+            }
+        }
+
+        // Report dropped messages and forget buffers of finished threads
+        {
+            std::lock_guard<std::mutex> lock(buffersLock);
+            uint64_t nbDropped = nbDroppedClosed;
+            for (auto iter = buffers.begin(); iter != buffers.end();) {
+                nbDropped += (*iter)->nbDropped.load(std::memory_order_relaxed);
+                if ((*iter)->isClosed.load(std::memory_order_acquire) && (*iter)->ring.size_approx() == 0 && (*iter)->partial.empty()) {
+                    nbDroppedClosed += (*iter)->nbDropped.load(std::memory_order_relaxed);
+                    for (auto& slot : signalBuffers()) {
+                        threadBuffer* closed = iter->get();
+                        if (slot.compare_exchange_strong(closed, nullptr)) {
+                            break;
+                        }
+                    }
+                    iter = buffers.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
+            if (nbDropped > nbDroppedReported) {
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+                appendTime( (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+                output += "[logger] WARNING drain: Log buffers were full, dropped messages: " + std::to_string(nbDropped - nbDroppedReported) + '\n';
+                nbDroppedReported = nbDropped;
+            }
+        }
+
+        if (output.empty()) {
+            return false;
+        }
+        writeAll( output );
+        return true;
+    }
+
+    // Local time with milliseconds, the conversion is done once per second
+    void appendTime(int64_t timeMs) {
+        const time_t seconds = timeMs / 1000;
+        if (seconds != lastSeconds) {
+            struct tm local;
+            localtime_r( &seconds, &local );
+            strftime( lastSecondsText, sizeof(lastSecondsText), "%Y-%m-%d %H:%M:%S", &local );
+            lastSeconds = seconds;
+        }
+        char text[32];
+        snprintf( text, sizeof(text), "%s.%03d ", lastSecondsText, (int)(timeMs % 1000) );
+        output += text;
+    }
+
+public:
+    static void writeAll(const std::string& text) {
+        writeRaw( text.data(), text.size() );
+    }
+
+    static void writeRaw(const char* data, std::size_t size) {
+        while (size > 0) {
+            const ssize_t written = ::write( STDOUT_FILENO, data, size );
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+private:
+    std::vector< std::shared_ptr<threadBuffer> > buffers;
+    std::mutex buffersLock;
+    uint64_t nbDroppedClosed = 0;       // Dropped by finished threads
+    uint64_t nbDroppedReported = 0;
+
+    // Used only by drain()
+    std::mutex drainLock;
+    std::string output;
+    time_t lastSeconds = 0;
+    char lastSecondsText[24] = "";
+
+    std::thread runnerThread;
+    std::atomic<bool> stopRequest { false };
+};
+
+
+// Writes out everything logged so far, needed before std::quick_exit (the logger is not destroyed then)
+inline void flush()
+{
+    logger::instance().flush();
+}
+
+
+// std::terminate writes out the log before the previous handler (by default it prints the exception and aborts)
+inline void installTerminateHandler()
+{
+    static std::terminate_handler previous = nullptr;
+    previous = std::set_terminate( []() {
+        flush();
+        if (previous) {
+            previous();
+        }
+        std::abort();
+    } );
+}
+
+
+// From: https://stackoverflow.com/questions/2179623/how-does-qdebug-stuff-add-a-newline-automatically/2179782#2179782
 
 struct log {
     log() {
+        // The stream of the thread is reused, unless a message is logged while formatting another one
+        if (!localStream().isUsed) {
+            stream = &localStream();
+            stream->isUsed = true;
+            stream->os.str("");
+        } else {
+            ownStream.reset( new threadStream() );
+            stream = ownStream.get();
+        }
+    }
+
+    // Logged by LOG_RATE, the messages suppressed since the last one are reported
+    explicit log(rateLimiter& limiter) : log() {
+        nbSuppressed = limiter.nbSuppressed.exchange(0, std::memory_order_relaxed);
     }
 
     ~log() {
-        std::lock_guard<std::mutex> guard(lock);
-        std::cout << os.str() << std::endl;
+        if (nbSuppressed > 0) {
+            stream->os << " (" << nbSuppressed << " similar messages suppressed)";
+        }
+        const std::string message = stream->os.str();
+        if (severity >= ERROR) {
+            // Without the level, the event says it is an error
+            const std::size_t skip = std::min<std::size_t>(8, message.size());
+            tools::recorder::recordText( tools::recorder::type::ERROR, message.data() + skip, message.size() - skip );
+        }
+        if (logger::isStopped().load()) {
+            logger::writeAll( message + '\n' );
+        } else {
+            logger::instance().write( message );
+        }
+        stream->isUsed = false;
     }
 
 public:
     // accepts just about anything
     template<class T>
     log& operator<<(const T& x) {
-        os << x;
+        stream->os << x;
         return *this;
     }
+
+    // The level starts the message, errors also go to the flight recorder
+    log& operator<<(enum LOG_LEVEL level) {
+        severity = level;
+        stream->os << level;
+        return *this;
+    }
+
 private:
-    std::ostringstream os;
+    struct threadStream {
+        std::ostringstream os;
+        bool isUsed = false;
+    };
+
+    static threadStream& localStream() {
+        thread_local threadStream stream;
+        return stream;
+    }
+
+    threadStream* stream;
+    std::unique_ptr<threadStream> ownStream;
+    uint64_t nbSuppressed = 0;
+    enum LOG_LEVEL severity = TRACE;
 };
 
 
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Metrics in the Prometheus text format (see /metrics)
+ *
+ * A histogram counts values in log2 buckets: bucket 0 holds 0 and 1, bucket i values in (2^(i-1), 2^i].
+ * Recording is two relaxed atomic increments in the shard of the calling thread, so it is cheap enough
+ * to stay on the hot path. The shards are summed only when the histogram is collected.
+ *
+ * Counters and gauges are not kept here, they are taken from the existing statistics when exported.
+ */
+
+namespace tools {
+namespace metrics {
+
+// Monotonic time in nanoseconds (the clock used by timer)
+inline uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+class histogram {
+public:
+    static const int nbBuckets = 64;                // The last bucket takes everything above 2^62
+    static const int nbShards = 16;
+
+    // Bucket of the value, the upper bound of bucket i is 2^i
+    static int bucketOf(uint64_t value) {
+        if (value <= 1) {
+            return 0;
+        }
+        const int bucket = 64 - __builtin_clzll(value - 1);
+        return bucket < nbBuckets ? bucket : nbBuckets - 1;
+    }
+
+    void record(uint64_t value) {
+        shard& s = shards[ shardIndex() ];
+        s.buckets[ bucketOf(value) ].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    struct snapshot {
+        uint64_t buckets[nbBuckets] = {};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // A snapshot can be used as a plain histogram when it is updated under a lock (e.g. one per client)
+        void record(uint64_t value) {
+            buckets[ bucketOf(value) ]++;
+            count++;
+            sum += value;
+        }
+
+        /*
+         * Value below which the fraction (0 - 1) of values lies, 0 when empty. The bucket is found exactly,
+         * the value is interpolated linearly within the bucket, so the error is at most the bucket width.
+         */
+        double percentile(double fraction) const {
+            if (count == 0) {
+                return 0;
+            }
+            const double rank = fraction * count;
+            uint64_t cumulative = 0;
+            for (int i = 0; i < nbBuckets; ++i) {
+                if (buckets[i] > 0 && cumulative + buckets[i] >= rank) {
+                    const double lower = (i == 0) ? 0 : (double)(1ULL << (i - 1));
+                    const double upper = (double)(1ULL << i);
+                    return lower + (upper - lower) * (rank - cumulative) / buckets[i];
+                }
+                cumulative += buckets[i];
+            }
+            return (double)(1ULL << (nbBuckets - 1));
+        }
+    };
+
+    // Not atomic as a whole, values recorded meanwhile may be missing in the count or in the sum
+    snapshot collect() const {
+        snapshot result;
+        for (const shard& s : shards) {
+            for (int i = 0; i < nbBuckets; ++i) {
+                const uint64_t n = s.buckets[i].load(std::memory_order_relaxed);
+                result.buckets[i] += n;
+                result.count += n;
+            }
+            result.sum += s.sum.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+private:
+    // Threads are spread over the shards in the order they record for the first time
+    static int shardIndex() {
+        static std::atomic<unsigned int> nextIndex { 0 };
+        thread_local const int index = nextIndex.fetch_add(1, std::memory_order_relaxed) % nbShards;
+        return index;
+    }
+
+    struct shard {
+        std::atomic<uint64_t> buckets[nbBuckets] = {};
+        std::atomic<uint64_t> sum { 0 };
+        char pad[64];                               // Neighbouring shards don't share a cache line
+    };
+
+    shard shards[nbShards];
+};
+
+
+// Records the time from construction to destruction in nanoseconds
+class timer {
+public:
+    explicit timer(histogram& h) : h(h), start(std::chrono::steady_clock::now()) {}
+
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+
+    ~timer() {
+        h.record( elapsedNs() );
+    }
+
+    uint64_t elapsedNs() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    histogram& h;
+    const std::chrono::steady_clock::time_point start;
+};
+
+
+/*
+ * Builds the text exposition. Samples of one metric can be added from different places (e.g. one per run),
+ * they are written together under one HELP and TYPE line in the order the metrics were first added.
+ *
+ * Labels are given already formatted, e.g. label("runnumber", 100) gives: runnumber="100"
+ */
+class exposition {
+public:
+    static std::string label(const std::string& name, const std::string& value) {
+        std::string result = name + "=\"";
+        for (const char ch : value) {
+            switch (ch) {
+                case '"':   result += "\\\""; break;
+                case '\\':  result += "\\\\"; break;
+                case '\n':  result += "\\n"; break;
+                default:    result += ch;
+            }
+        }
+        return result + '"';
+    }
+
+    static std::string label(const std::string& name, long value) {
+        return label( name, std::to_string(value) );
+    }
+
+    void counter(const std::string& name, const std::string& help, const std::string& labels, double value) {
+        sample( family(name, help, "counter"), name, labels, value );
+    }
+
+    void gauge(const std::string& name, const std::string& help, const std::string& labels, double value) {
+        sample( family(name, help, "gauge"), name, labels, value );
+    }
+
+    /*
+     * Buckets from minBucket to maxBucket are written (the rest is in +Inf), the same range has to be used
+     * for all samples of the metric. Values are multiplied by scale, e.g. 1e-9 for nanoseconds to seconds.
+     */
+    void histogram(const std::string& name, const std::string& help, const std::string& labels, const tools::metrics::histogram::snapshot& data, double scale, int minBucket, int maxBucket) {
+        std::ostringstream& os = family(name, help, "histogram");
+        const std::string sep = labels.empty() ? "" : ",";
+
+        uint64_t cumulative = 0;
+        for (int i = 0; i < minBucket; ++i) {
+            cumulative += data.buckets[i];
+        }
+        for (int i = minBucket; i <= maxBucket; ++i) {
+            cumulative += data.buckets[i];
+            std::ostringstream le;
+            le << std::setprecision(12) << (double)(1ULL << i) * scale;
+            sample( os, name + "_bucket", labels + sep + label("le", le.str()), cumulative );
+        }
+        sample( os, name + "_bucket", labels + sep + "le=\"+Inf\"", data.count );
+        sample( os, name + "_sum", labels, data.sum * scale );
+        sample( os, name + "_count", labels, data.count );
+    }
+
+    std::string str() const {
+        std::string text;
+        for (const auto& name : names) {
+            text += families.at(name).str();
+        }
+        return text;
+    }
+
+private:
+    std::ostringstream& family(const std::string& name, const std::string& help, const char* type) {
+        auto emplaceResult = families.emplace( name, std::ostringstream() );
+        std::ostringstream& os = emplaceResult.first->second;
+        if (emplaceResult.second) {
+            names.push_back( name );
+            os << std::setprecision(12);
+            os << "# HELP " << name << ' ' << help << '\n';
+            os << "# TYPE " << name << ' ' << type << '\n';
+        }
+        return os;
+    }
+
+    static void sample(std::ostringstream& os, const std::string& name, const std::string& labels, double value) {
+        os << name;
+        if (!labels.empty()) {
+            os << '{' << labels << '}';
+        }
+        os << ' ' << value << '\n';
+    }
+
+    std::vector<std::string> names;
+    std::map<std::string, std::ostringstream> families;
+};
+
+} // namespace metrics
+} // namespace tools
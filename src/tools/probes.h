@@ -0,0 +1,54 @@
+#pragma once
+
+/*
+ * Static tracepoints (USDT) on the hot paths, for bpftrace, perf or systemtap in production, e.g.:
+ *   bpftrace -l 'usdt:/usr/bin/bufu_filebroker:*'
+ *   bpftrace -e 'usdt:/usr/bin/bufu_filebroker:bufu:file_pop { @state[arg1] = count(); }'
+ *   perf buildid-cache --add /usr/bin/bufu_filebroker && perf record -e sdt_bufu:rename_end ...
+ *
+ * A probe is a nop instruction and an ELF note describing where its arguments are, nothing is done until
+ * a tracer attaches. The arguments are still computed, so they have to be integers or pointers that are
+ * already at hand (e.g. std::string::c_str()).
+ *
+ * The probes need <sys/sdt.h> (systemtap-sdt-devel), without it or with TOOLS_NO_PROBES they are compiled out.
+ *
+ * Probes of the provider "bufu":
+ *   inotify_read        runNumber, nbEvents
+ *   file_parse          runNumber, lumiSection, index, type
+ *   file_push           runNumber, lumiSection, index, type
+ *   file_pop            runNumber, state, lumiSection, index, type      (lumiSection is lastEoLS for an empty reply)
+ *   rename_start        runNumber, fileName
+ *   rename_end          runNumber, fileName
+ *   http_request_start  path
+ *   http_request_end    path, status                                    (only requests answered synchronously)
+ *
+ * type is bu::FileInfo::FileType and state bu::RunDirectoryObserver::State as integers.
+ */
+
+#if !defined(TOOLS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TOOLS_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef TOOLS_PROBES_ENABLED
+#define TOOLS_PROBE(name, ...)      STAP_PROBEV(bufu, name, __VA_ARGS__)
+#else
+#define TOOLS_PROBE(name, ...)      do {} while (0)
+#endif
+
+namespace tools {
+namespace probes {
+
+constexpr bool isEnabled()
+{
+#ifdef TOOLS_PROBES_ENABLED
+    return true;
+#else
+    return false;
+#endif
+}
+
+} // namespace probes
+} // namespace tools
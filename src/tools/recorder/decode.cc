@@ -0,0 +1,27 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "tools/recorder/recorder.h"
+
+/*
+ * Prints a flight recorder dump as text, e.g.:
+ *   bufu_recorder_decode /tmp/bufu_filebroker-12345.recorder
+ */
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <recorder dump>\n";
+        return 2;
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open " << argv[1] << '\n';
+        return 1;
+    }
+    const std::string data( (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>() );
+
+    return tools::recorder::decode(data, std::cout) ? 0 : 1;
+}
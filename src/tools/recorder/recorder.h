@@ -0,0 +1,492 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Flight recorder: the last events of every thread are kept in memory and written to a file when the broker
+ * crashes (BACKTRACE_AND_RETHROW or a fatal signal), so it is known what the threads were doing before.
+ * The same data can be taken from a running broker with /admin/recorder.
+ *
+ * Every thread records fixed size binary events into its own ring buffer, the oldest events are overwritten.
+ * Recording is a clock read and a copy of 64 bytes without any lock, so the recorder is always on.
+ * Buffers are never freed (a buffer of a finished thread is given to the next new thread) and the dump
+ * uses only write(2), so it can be done from a signal handler. An event recorded during the dump can be torn.
+ *
+ * The dump is binary (see writeDump), bufu_recorder_decode or decode() turn it into text.
+ */
+
+namespace tools {
+namespace recorder {
+
+/*
+ * Event types and their arguments:
+ *   INOTIFY_READ   runNumber, nbEvents
+ *   POP            runNumber, state, lumiSection, index, type     (lumiSection is lastEoLS for an empty reply)
+ *   RENAME         runNumber, lumiSection, index, durationUs, isOk
+ *   ERROR          text                                           (logged errors, cut to event::textSize)
+ *   EXCEPTION      text                                           (the exception in BACKTRACE_AND_RETHROW)
+ *
+ * type is bu::FileInfo::FileType and state bu::RunDirectoryObserver::State as integers.
+ * New types are added at the end, so older dumps can still be decoded.
+ */
+enum class type : uint32_t {
+    NONE,
+    INOTIFY_READ,
+    POP,
+    RENAME,
+    ERROR,
+    EXCEPTION
+};
+
+
+struct event {
+    static const std::size_t nbArgs = 13;
+    static const std::size_t textSize = nbArgs * sizeof(uint32_t);
+
+    uint64_t timeNs;                    // Wall clock time
+    uint32_t type;
+    union {
+        uint32_t args[nbArgs];
+        char text[textSize];            // Not terminated when it takes the whole size
+    };
+};
+
+static_assert(sizeof(event) == 64, "Recorder events are expected to fill one cache line");
+
+
+struct threadBuffer {
+    static const std::size_t capacity = 1024;       // Events, 64 KiB per thread, a power of 2
+
+    event events[capacity];
+    std::atomic<uint64_t> head { 0 };               // Number of events recorded, only the thread writes it
+    uint64_t threadId = 0;                          // pthread_self(), as in the log
+    uint32_t tid = 0;                               // Kernel thread ID, as in gdb or top
+    std::atomic<bool> isUsed { false };             // Owned by a running thread
+};
+
+
+// The dump: header, then for every buffer: bufferHeader and its events from the oldest one
+struct dumpHeader {
+    char magic[8];                      // "BUFUFR1"
+    uint32_t version;
+    int32_t signal;                     // The fatal signal, 0 when dumped for another reason
+    uint64_t timeNs;
+    uint32_t pid;
+    uint32_t nbBuffers;
+};
+
+struct bufferHeader {
+    uint64_t threadId;
+    uint32_t tid;
+    uint32_t isUsed;                    // 0 when the thread has finished
+    uint64_t nbEvents;
+};
+
+static const char dumpMagic[8] = "BUFUFR1";
+static const uint32_t dumpVersion = 1;
+
+
+inline uint64_t nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static const std::size_t maxBuffers = 256;          // Threads recording at the same time, others are not recorded
+
+// Zero initialized before anything runs, so the slots can be read by a signal handler at any time
+inline std::atomic<threadBuffer*>* buffers()
+{
+    static std::atomic<threadBuffer*> slots[maxBuffers];
+    return slots;
+}
+
+// A free buffer of a finished thread is reused, otherwise a new one is added, nullptr when all slots are taken
+inline threadBuffer* acquireBuffer()
+{
+    threadBuffer* buffer = nullptr;
+    for (std::size_t i = 0; i < maxBuffers && buffer == nullptr; ++i) {
+        threadBuffer* candidate = buffers()[i].load(std::memory_order_acquire);
+        bool isUsed = false;
+        if (candidate != nullptr && candidate->isUsed.compare_exchange_strong(isUsed, true)) {
+            buffer = candidate;
+        }
+    }
+    if (buffer == nullptr) {
+        std::unique_ptr<threadBuffer> newBuffer( new threadBuffer() );
+        newBuffer->isUsed.store(true);
+        for (std::size_t i = 0; i < maxBuffers; ++i) {
+            threadBuffer* expected = nullptr;
+            if (buffers()[i].compare_exchange_strong(expected, newBuffer.get())) {
+                buffer = newBuffer.release();
+                break;
+            }
+        }
+        if (buffer == nullptr) {
+            return nullptr;
+        }
+    }
+    buffer->threadId = (uint64_t)pthread_self();
+    buffer->tid = (uint32_t)syscall(SYS_gettid);
+    buffer->head.store(0, std::memory_order_release);
+    return buffer;
+}
+
+// Gives the buffer back when the thread finishes, its events stay in the dump until it is reused
+struct bufferHolder {
+    threadBuffer* buffer = acquireBuffer();
+    ~bufferHolder() {
+        if (buffer != nullptr) {
+            buffer->isUsed.store(false, std::memory_order_release);
+        }
+    }
+};
+
+inline threadBuffer* localBuffer()
+{
+    thread_local bufferHolder holder;
+    return holder.buffer;
+}
+
+
+// Not for a signal handler: the first event of a thread allocates its buffer
+inline void record(type t, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0, uint32_t a4 = 0)
+{
+    threadBuffer* buffer = localBuffer();
+    if (buffer == nullptr) {
+        return;
+    }
+    const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    event& e = buffer->events[ head & (threadBuffer::capacity - 1) ];
+    e.timeNs = nowNs();
+    e.type = (uint32_t)t;
+    e.args[0] = a0;
+    e.args[1] = a1;
+    e.args[2] = a2;
+    e.args[3] = a3;
+    e.args[4] = a4;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+inline void recordText(type t, const char* text, std::size_t size)
+{
+    threadBuffer* buffer = localBuffer();
+    if (buffer == nullptr) {
+        return;
+    }
+    const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    event& e = buffer->events[ head & (threadBuffer::capacity - 1) ];
+    e.timeNs = nowNs();
+    e.type = (uint32_t)t;
+    size = std::min(size, event::textSize);
+    std::memcpy(e.text, text, size);
+    if (size < event::textSize) {
+        e.text[size] = '\0';
+    }
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+inline void recordText(type t, const char* text)
+{
+    recordText(t, text, std::strlen(text));
+}
+
+
+/*
+ * Writes the dump by calls of write(const void* data, size_t size). Nothing is allocated or locked here,
+ * so with a signal safe write it can run in a signal handler.
+ */
+template<typename Write>
+void writeDump(int signal, Write&& write)
+{
+    dumpHeader header;
+    std::memcpy(header.magic, dumpMagic, sizeof(header.magic));
+    header.version = dumpVersion;
+    header.signal = signal;
+    header.timeNs = nowNs();
+    header.pid = (uint32_t)getpid();
+    header.nbBuffers = 0;
+
+    threadBuffer* snapshot[maxBuffers];
+    for (std::size_t i = 0; i < maxBuffers; ++i) {
+        snapshot[i] = buffers()[i].load(std::memory_order_acquire);
+        if (snapshot[i] != nullptr) {
+            header.nbBuffers++;
+        }
+    }
+    write(&header, sizeof(header));
+
+    for (std::size_t i = 0; i < maxBuffers; ++i) {
+        const threadBuffer* buffer = snapshot[i];
+        if (buffer == nullptr) {
+            continue;
+        }
+        const uint64_t head = buffer->head.load(std::memory_order_acquire);
+        const uint64_t nbEvents = std::min<uint64_t>(head, threadBuffer::capacity);
+
+        bufferHeader bh;
+        bh.threadId = buffer->threadId;
+        bh.tid = buffer->tid;
+        bh.isUsed = buffer->isUsed.load(std::memory_order_relaxed);
+        bh.nbEvents = nbEvents;
+        write(&bh, sizeof(bh));
+
+        // From the oldest event, in two parts when the ring wraps
+        const std::size_t begin = (head - nbEvents) & (threadBuffer::capacity - 1);
+        const std::size_t first = std::min<std::size_t>(nbEvents, threadBuffer::capacity - begin);
+        write(&buffer->events[begin], first * sizeof(event));
+        if (first < nbEvents) {
+            write(&buffer->events[0], (nbEvents - first) * sizeof(event));
+        }
+    }
+}
+
+inline std::string dumpToString()
+{
+    std::string data;
+    writeDump(0, [&data](const void* p, std::size_t size) { data.append( (const char*)p, size ); });
+    return data;
+}
+
+
+/*
+ * The file for the dump is set at startup, the dump itself must not allocate.
+ * An empty name disables the dump on a crash.
+ */
+inline char* dumpFileName()
+{
+    static char name[4096] = "";
+    return name;
+}
+
+inline void setDumpFile(const std::string& name)
+{
+    const std::size_t size = std::min(name.size(), (std::size_t)4095);
+    std::memcpy(dumpFileName(), name.data(), size);
+    dumpFileName()[size] = '\0';
+}
+
+// Signal safe, returns false when the dump is disabled or the file can't be written
+inline bool dumpToFile(int signal)
+{
+    if (dumpFileName()[0] == '\0') {
+        return false;
+    }
+    const int fd = ::open(dumpFileName(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool isOk = true;
+    writeDump(signal, [fd, &isOk](const void* p, std::size_t size) {
+        const char* data = (const char*)p;
+        while (isOk && size > 0) {
+            const ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                isOk = false;
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    });
+    ::close(fd);
+    return isOk;
+}
+
+
+// Called by onFatalSignal after the dump (the logger writes out its buffers, see tools/log.h), has to be async-signal-safe
+inline std::atomic<void (*)()>& fatalSignalHook()
+{
+    static std::atomic<void (*)()> hook { nullptr };
+    return hook;
+}
+
+/*
+ * Fatal signals dump the recorder, then the default action is done (a core dump, if enabled).
+ * A stack overflow can't be dumped, the handlers don't have an alternate stack.
+ */
+inline void onFatalSignal(int signal)
+{
+    const int savedErrno = errno;
+    dumpToFile(signal);
+    if (void (*hook)() = fatalSignalHook().load()) {
+        hook();
+    }
+    errno = savedErrno;
+    // The handler was reset by SA_RESETHAND
+    raise(signal);
+}
+
+inline void installSignalHandlers()
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = onFatalSignal;
+    action.sa_flags = SA_RESETHAND | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    for (const int signal : { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT }) {
+        sigaction(signal, &action, nullptr);
+    }
+}
+
+
+inline const char* getTypeName(uint32_t t)
+{
+    static const char* names[] = { "NONE", "INOTIFY_READ", "POP", "RENAME", "ERROR", "EXCEPTION" };
+    return t < sizeof(names) / sizeof(names[0]) ? names[t] : "UNKNOWN";
+}
+
+// The same order as bu::RunDirectoryObserver::State and bu::FileInfo::FileType
+inline const char* getStateName(uint32_t state)
+{
+    static const char* names[] = { "INIT", "STARTING", "READY", "EOLS", "EOR", "ERROR", "NORUN" };
+    return state < sizeof(names) / sizeof(names[0]) ? names[state] : "UNKNOWN";
+}
+
+inline const char* getFileTypeName(uint32_t fileType)
+{
+    static const char* names[] = { "INDEX", "EOLS", "EOR", "EMPTY" };
+    return fileType < sizeof(names) / sizeof(names[0]) ? names[fileType] : "UNKNOWN";
+}
+
+
+/*
+ * Writes the dump as text, the events of all threads merged by their time.
+ * Returns false when the data is not a complete dump (what could be decoded is written).
+ */
+inline bool decode(const std::string& data, std::ostream& os)
+{
+    const auto formatTime = [](uint64_t timeNs) {
+        const time_t seconds = timeNs / 1000000000;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        char text[64];
+        const std::size_t size = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+        snprintf(text + size, sizeof(text) - size, ".%06u", (unsigned)(timeNs % 1000000000 / 1000));
+        return std::string(text);
+    };
+
+    dumpHeader header;
+    if (data.size() < sizeof(header)) {
+        os << "Not a recorder dump: too short\n";
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, dumpMagic, sizeof(header.magic)) != 0) {
+        os << "Not a recorder dump: wrong magic\n";
+        return false;
+    }
+    if (header.version != dumpVersion) {
+        os << "Unsupported recorder dump version: " << header.version << '\n';
+        return false;
+    }
+
+    os << "pid=" << header.pid << '\n';
+    os << "time=" << formatTime(header.timeNs) << '\n';
+    os << "signal=" << header.signal;
+    if (header.signal != 0) {
+        os << " (" << strsignal(header.signal) << ')';
+    }
+    os << '\n';
+    os << "nbThreads=" << header.nbBuffers << '\n';
+
+    struct threadEvent {
+        const bufferHeader* thread;
+        event e;
+    };
+    std::vector<bufferHeader> threads;
+    threads.reserve(header.nbBuffers);
+    std::vector<threadEvent> events;
+
+    bool isComplete = true;
+    std::size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.nbBuffers; ++i) {
+        if (data.size() - offset < sizeof(bufferHeader)) {
+            isComplete = false;
+            break;
+        }
+        threads.emplace_back();
+        std::memcpy(&threads.back(), data.data() + offset, sizeof(bufferHeader));
+        offset += sizeof(bufferHeader);
+
+        const bufferHeader& thread = threads.back();
+        for (uint64_t j = 0; j < thread.nbEvents; ++j) {
+            if (data.size() - offset < sizeof(event)) {
+                isComplete = false;
+                break;
+            }
+            threadEvent te;
+            te.thread = &thread;
+            std::memcpy(&te.e, data.data() + offset, sizeof(event));
+            offset += sizeof(event);
+            events.push_back(te);
+        }
+        if (!isComplete) {
+            break;
+        }
+    }
+
+    os << '\n';
+    for (const bufferHeader& thread : threads) {
+        os << "thread=[0x" << std::hex << thread.threadId << std::dec << "] tid=" << thread.tid
+           << " nbEvents=" << thread.nbEvents << (thread.isUsed ? "" : " (finished)") << '\n';
+    }
+    os << '\n';
+
+    std::stable_sort(events.begin(), events.end(), [](const threadEvent& a, const threadEvent& b) { return a.e.timeNs < b.e.timeNs; });
+
+    for (const threadEvent& te : events) {
+        const event& e = te.e;
+        os << formatTime(e.timeNs) << " [0x" << std::hex << te.thread->threadId << std::dec << "] " << getTypeName(e.type);
+        switch ((type)e.type) {
+            case type::INOTIFY_READ:
+                os << " run=" << e.args[0] << " nbEvents=" << e.args[1];
+                break;
+            case type::POP:
+                os << " run=" << e.args[0] << " state=" << getStateName(e.args[1]) << " ls=" << e.args[2]
+                   << " index=" << e.args[3] << " type=" << getFileTypeName(e.args[4]);
+                break;
+            case type::RENAME:
+                os << " run=" << e.args[0] << " ls=" << e.args[1] << " index=" << e.args[2]
+                   << " durationUs=" << e.args[3] << (e.args[4] ? " ok" : " FAILED");
+                break;
+            case type::ERROR:
+            case type::EXCEPTION:
+                os << ' ' << std::string(e.text, strnlen(e.text, event::textSize));
+                break;
+            default:
+                for (std::size_t i = 0; i < 5; ++i) {
+                    os << ' ' << e.args[i];
+                }
+        }
+        os << '\n';
+    }
+
+    if (!isComplete) {
+        os << "The dump is truncated\n";
+    }
+    return isComplete;
+}
+
+} // namespace recorder
+} // namespace tools
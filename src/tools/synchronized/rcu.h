@@ -0,0 +1,217 @@
+#ifndef _SYNCHRONIZED_RCU_H_
+#define _SYNCHRONIZED_RCU_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace tools {
+    namespace synchronized {
+
+        /*
+        * Epoch based RCU (read-copy-update) domain.
+        *
+        * Every thread that reads has its own reader slot, so reading is a store and a fence in the slot
+        * of the thread (no shared cache line is written). The slot holds the global epoch seen when the read
+        * section was entered, 0 outside of a read section. Read sections can be nested.
+        *
+        * An object replaced by a writer is retired with the current epoch and the epoch is incremented.
+        * It is deleted when all readers are either outside of a read section or entered it in a later epoch,
+        * because such readers can only see the new object. Deleting is deferred, writers never wait for readers.
+        *
+        * Slots are never freed, a slot of a finished thread is reused by a new one.
+        * There is only one domain (a thread has one slot), shared by all rcu objects.
+        */
+        class rcu_domain {
+        public:
+            rcu_domain(const rcu_domain&) = delete;
+            rcu_domain& operator=(const rcu_domain&) = delete;
+
+            // There are no readers anymore, so everything retired can be deleted
+            ~rcu_domain() {
+                for (auto& object : retired_) {
+                    object.second();
+                }
+            }
+
+            void read_lock() noexcept {
+                reader& r = local_reader();
+                if (r.nesting++ == 0) {
+                    // A reader seeing the new epoch sees also the pointer published before it was incremented
+                    r.epoch.store( epoch_.load(std::memory_order_acquire), std::memory_order_relaxed );
+                    // The epoch has to be visible to writers before the protected pointer is read
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                }
+            }
+
+            void read_unlock() noexcept {
+                reader& r = local_reader();
+                if (--r.nesting == 0) {
+                    r.epoch.store( 0, std::memory_order_release );
+                }
+            }
+
+            /*
+            * Called after the object was replaced, deleter is called when no reader can see the object anymore.
+            * Writers have to be serialized by the caller.
+            */
+            void retire(std::function<void()>&& deleter) {
+                std::lock_guard<std::mutex> lock(retired_lock_);
+                retired_.emplace_back( epoch_.fetch_add(1, std::memory_order_seq_cst), std::move(deleter) );
+                reclaim();
+            }
+
+            // Number of retired objects not deleted yet
+            std::size_t retired_size() {
+                std::lock_guard<std::mutex> lock(retired_lock_);
+                return retired_.size();
+            }
+
+            static rcu_domain& global() {
+                static rcu_domain domain;
+                return domain;
+            }
+
+        private:
+            rcu_domain() = default;
+
+            struct reader {
+                std::atomic<uint64_t> epoch { 0 };
+                std::atomic<bool> in_use { true };
+                unsigned int nesting = 0;                       // Used only by the owning thread
+                reader* next = nullptr;
+                char padding[64];                               // Slots of different threads don't share a cache line
+            };
+
+            // Releases the slot when the thread finishes
+            struct reader_holder {
+                reader* r;
+                ~reader_holder() { r->in_use.store(false, std::memory_order_release); }
+            };
+
+            reader& local_reader() {
+                thread_local reader_holder holder { acquire_reader() };
+                return *holder.r;
+            }
+
+            reader* acquire_reader() {
+                for (reader* r = readers_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+                    bool in_use = false;
+                    if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(in_use, true)) {
+                        return r;
+                    }
+                }
+                reader* r = new reader();
+                r->next = readers_.load(std::memory_order_relaxed);
+                while (!readers_.compare_exchange_weak(r->next, r)) {}
+                return r;
+            }
+
+            // Deletes retired objects no reader can see, called locked
+            void reclaim() {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                uint64_t oldest = UINT64_MAX;
+                for (reader* r = readers_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+                    const uint64_t epoch = r->epoch.load(std::memory_order_seq_cst);
+                    if (epoch != 0 && epoch < oldest) {
+                        oldest = epoch;
+                    }
+                }
+
+                // Readers in the retire epoch or earlier can still see the object
+                std::size_t kept = 0;
+                for (auto& object : retired_) {
+                    if (object.first < oldest) {
+                        object.second();
+                    } else {
+                        retired_[kept++] = std::move(object);
+                    }
+                }
+                retired_.resize( kept );
+            }
+
+        private:
+            std::atomic<uint64_t> epoch_ { 1 };                 // 0 means outside of a read section
+            std::atomic<reader*> readers_ { nullptr };
+
+            std::vector< std::pair<uint64_t, std::function<void()>> > retired_;
+            std::mutex retired_lock_;
+        };
+
+
+        /*
+        * Read-mostly value protected by RCU. Readers get a const pointer valid for the lifetime of read_guard,
+        * without taking a lock. Writers copy the value, modify the copy and publish it atomically,
+        * the old value is deleted later by the domain.
+        *
+        * Use as:
+        *   {
+        *       auto guard = value.read();
+        *       guard->find(...);
+        *   }
+        *   value.update( [](T& copy) { copy.insert(...); } );
+        */
+        template< typename T >
+        class rcu {
+        public:
+            class read_guard {
+            public:
+                explicit read_guard(const rcu& owner) : domain_(owner.domain_) {
+                    domain_.read_lock();
+                    value_ = owner.value_.load(std::memory_order_acquire);
+                }
+                ~read_guard() {
+                    if (value_ != nullptr) {
+                        domain_.read_unlock();
+                    }
+                }
+
+                read_guard(read_guard&& other) noexcept : domain_(other.domain_), value_(other.value_) {
+                    other.value_ = nullptr;
+                }
+                read_guard(const read_guard&) = delete;
+                read_guard& operator=(const read_guard&) = delete;
+
+                const T* get() const noexcept { return value_; }
+                const T* operator->() const noexcept { return value_; }
+                const T& operator*() const noexcept { return *value_; }
+
+            private:
+                rcu_domain& domain_;
+                const T* value_;
+            };
+
+            rcu() : domain_(rcu_domain::global()), value_(new T()) {}
+            ~rcu() { delete value_.load(); }
+
+            rcu(const rcu&) = delete;
+            rcu& operator=(const rcu&) = delete;
+
+            read_guard read() const {
+                return read_guard(*this);
+            }
+
+            // Publishes a modified copy of the value, writers are serialized
+            template< typename F >
+            void update(F&& modify) {
+                std::lock_guard<std::mutex> lock(update_lock_);
+                const T* old = value_.load(std::memory_order_relaxed);
+                T* copy = new T(*old);
+                modify( *copy );
+                value_.store( copy, std::memory_order_seq_cst );
+                domain_.retire( [old]() { delete old; } );
+            }
+
+        private:
+            rcu_domain& domain_;
+            std::atomic<const T*> value_;
+            std::mutex update_lock_;
+        };
+
+    }
+}
+
+#endif // _SYNCHRONIZED_RCU_H_
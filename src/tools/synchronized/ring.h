@@ -0,0 +1,170 @@
+#ifndef _SYNCHRONIZED_RING_H_
+#define _SYNCHRONIZED_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace tools {
+    namespace synchronized {
+
+        /*
+        * Bounded lock-free MPMC (multiple producers - multiple consumers) queue.
+        * Source: Dmitry Vyukov, "Bounded MPMC queue" (1024cores.net)
+        *
+        * Every cell has a sequence number telling in which lap it is free for a producer (sequence == position)
+        * or full for a consumer (sequence == position + 1). Producers and consumers claim a position
+        * with a CAS on their own counter, so they don't touch each other's cache lines unless the ring is
+        * (almost) full or empty. The counters are padded to separate cache lines.
+        *
+        * Nothing blocks: try_push fails when the ring is full, try_pop when it is empty.
+        * The batch variants claim consecutive cells with one CAS and return how many items were moved.
+        *
+        * T has to be default constructible and move assignable, the best are small trivially copyable types
+        * (e.g. bu::FileInfo).
+        */
+        template< typename T >
+        class ring {
+        public:
+            // The capacity has to be a power of two
+            explicit ring(std::size_t capacity) : mask_(capacity - 1), cells_(capacity) {
+                if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+                    throw std::invalid_argument("ring capacity has to be a power of two");
+                }
+                for (std::size_t i = 0; i < capacity; ++i) {
+                    cells_[i].sequence.store(i, std::memory_order_relaxed);
+                }
+            }
+
+            ring(const ring&) = delete;
+            ring& operator=(const ring&) = delete;
+
+            std::size_t capacity() const { return mask_ + 1; }
+
+            bool try_push(T&& data) {
+                return push_batch(&data, 1) == 1;
+            }
+
+            bool try_push(const T& data) {
+                T copy(data);
+                return try_push( std::move(copy) );
+            }
+
+            bool try_pop(T& data) {
+                return pop_batch(&data, 1) == 1;
+            }
+
+            /*
+            * Pushes up to count items from data (they are moved out), returns how many were pushed.
+            * Less are pushed only when the ring is full.
+            */
+            std::size_t try_push_batch(T* data, std::size_t count) {
+                return push_batch(data, count);
+            }
+
+            // Pops up to count items into data, returns how many were popped
+            std::size_t try_pop_batch(T* data, std::size_t count) {
+                return pop_batch(data, count);
+            }
+
+            // Not exact when other threads push or pop meanwhile
+            std::size_t size_approx() const {
+                const std::size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+                const std::size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+                return enqueue > dequeue ? enqueue - dequeue : 0;
+            }
+
+        private:
+            struct cell {
+                std::atomic<std::size_t> sequence;
+                T data;
+            };
+
+            std::size_t push_batch(T* data, std::size_t count) {
+                std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+                while (true) {
+                    // Count the cells free in this lap
+                    std::size_t free = 0;
+                    while (free < count) {
+                        const std::size_t sequence = cells_[(pos + free) & mask_].sequence.load(std::memory_order_acquire);
+                        if (sequence != pos + free) {
+                            break;
+                        }
+                        free++;
+                    }
+
+                    if (free == 0) {
+                        const std::size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                        if ((std::ptrdiff_t)(sequence - pos) < 0) {
+                            return 0;           // Full
+                        }
+                        // Another producer was faster
+                        pos = enqueue_pos_.load(std::memory_order_relaxed);
+                        continue;
+                    }
+
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + free, std::memory_order_relaxed)) {
+                        for (std::size_t i = 0; i < free; ++i) {
+                            cell& c = cells_[(pos + i) & mask_];
+                            c.data = std::move( data[i] );
+                            c.sequence.store(pos + i + 1, std::memory_order_release);
+                        }
+                        return free;
+                    }
+                    // CAS failed, pos was reloaded
+                }
+            }
+
+            std::size_t pop_batch(T* data, std::size_t count) {
+                std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+                while (true) {
+                    // Count the cells full in this lap
+                    std::size_t full = 0;
+                    while (full < count) {
+                        const std::size_t sequence = cells_[(pos + full) & mask_].sequence.load(std::memory_order_acquire);
+                        if (sequence != pos + full + 1) {
+                            break;
+                        }
+                        full++;
+                    }
+
+                    if (full == 0) {
+                        const std::size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                        if ((std::ptrdiff_t)(sequence - (pos + 1)) < 0) {
+                            return 0;           // Empty
+                        }
+                        // Another consumer was faster
+                        pos = dequeue_pos_.load(std::memory_order_relaxed);
+                        continue;
+                    }
+
+                    if (dequeue_pos_.compare_exchange_weak(pos, pos + full, std::memory_order_relaxed)) {
+                        for (std::size_t i = 0; i < full; ++i) {
+                            cell& c = cells_[(pos + i) & mask_];
+                            data[i] = std::move( c.data );
+                            // Free for the producer in the next lap
+                            c.sequence.store(pos + i + mask_ + 1, std::memory_order_release);
+                        }
+                        return full;
+                    }
+                }
+            }
+
+        private:
+            static const std::size_t cache_line = 64;
+
+            char pad0_[cache_line];
+            const std::size_t mask_;
+            std::vector<cell> cells_;
+            char pad1_[cache_line];
+            std::atomic<std::size_t> enqueue_pos_ { 0 };
+            char pad2_[cache_line];
+            std::atomic<std::size_t> dequeue_pos_ { 0 };
+            char pad3_[cache_line];
+        };
+
+    }
+}
+
+#endif // _SYNCHRONIZED_RING_H_
@@ -2,6 +2,8 @@
 #define SPINLOCK_H
 
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 /*
  * IMPORTANT NOTE: 
@@ -57,6 +59,89 @@ namespace tools {
             }
         };
 
+
+        // Tells the CPU we are spinning (saves power and the sibling hyper-thread gets the pipeline)
+        inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield" ::: "memory");
+#endif
+        }
+
+
+        /*
+        * Adaptive lock: spins with exponential backoff for a bounded time and then sleeps in the kernel (futex),
+        * so a short critical section doesn't pay for a syscall and a long one doesn't burn the CPU.
+        * 
+        * The state is 0 - unlocked, 1 - locked, 2 - locked and there may be sleeping threads (unlock has to wake one).
+        * Source: Ulrich Drepper, "Futexes Are Tricky" (mutex, take 3)
+        * 
+        * It can be used as the Mutex of tools::synchronized::queue.
+        */
+        class adaptive_spinlock {
+        private:
+            std::atomic<int> state_ { 0 };
+
+            // How many times the lock is tried before sleeping, the pauses between tries double up to max_backoff
+            static constexpr int spin_tries = 16;
+            static constexpr int max_backoff = 64;
+
+            int* futex_word() noexcept {
+                // std::atomic<int> has the same representation as int on Linux
+                return reinterpret_cast<int*>(&state_);
+            }
+
+            void futex_wait(int value) noexcept {
+                syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+            }
+
+            void futex_wake() noexcept {
+                syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+
+        public:
+            adaptive_spinlock() noexcept = default;
+            ~adaptive_spinlock() = default;
+
+            adaptive_spinlock(const adaptive_spinlock&) = delete;
+            adaptive_spinlock& operator=(const adaptive_spinlock&) = delete;
+
+            bool try_lock() noexcept {
+                int expected = 0;
+                return state_.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed);
+            }
+
+            void lock() noexcept {
+                // Spin: wait until the lock looks free (reading doesn't steal the cache line from the owner) and try
+                int backoff = 1;
+                for (int i = 0; i < spin_tries; ++i) {
+                    if (state_.load(std::memory_order_relaxed) == 0 && try_lock()) {
+                        return;
+                    }
+                    for (int j = 0; j < backoff; ++j) {
+                        cpu_relax();
+                    }
+                    if (backoff < max_backoff) {
+                        backoff *= 2;
+                    }
+                }
+
+                // Park: mark the lock as having sleepers and sleep until it is unlocked
+                int state = state_.exchange(2, std::memory_order_acquire);
+                while (state != 0) {
+                    futex_wait(2);
+                    state = state_.exchange(2, std::memory_order_acquire);
+                }
+            }
+
+            void unlock() noexcept {
+                if (state_.exchange(0, std::memory_order_release) == 2) {
+                    futex_wake();
+                }
+            }
+        };
+
     }
 }
 
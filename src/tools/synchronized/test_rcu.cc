@@ -0,0 +1,148 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rcu.h"
+
+/*
+ * Tests the RCU and compares the lookup of a run observer in the way RunDirectoryManager does it:
+ *   mutex - map protected by a mutex, the shared_ptr is copied out
+ *   rcu   - map protected by RCU, the observer is used within the read section
+ *
+ * 32 threads ask for files of a few runs, a "pop" is a short work done on the observer.
+ */
+
+const int nbThreads = 32;
+const int nbRuns = 4;
+const int nbLookups = 200000;
+
+// Stands for RunDirectoryObserver, poisoned when destroyed
+struct Observer {
+    std::atomic<uint64_t> nbPops { 0 };
+    int alive = 1;
+    ~Observer() { alive = 0; }
+
+    void pop() { nbPops.fetch_add(1, std::memory_order_relaxed); }
+};
+typedef std::shared_ptr<Observer> ObserverPtr;
+typedef std::unordered_map<int, ObserverPtr> Observers_t;
+
+
+// Readers must never see a deleted map or observer while the writer keeps replacing them
+void test_reclamation()
+{
+    tools::synchronized::rcu<Observers_t> observers;
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> nbReads(0);
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 8; ++i) {
+        readers.emplace_back( [&]() {
+            while (!done) {
+                auto guard = observers.read();
+                for (const auto& pair : *guard) {
+                    assert( pair.second->alive == 1 );
+                }
+                nbReads++;
+            }
+        });
+    }
+
+    for (int i = 0; i < 20000; ++i) {
+        observers.update( [i](Observers_t& map) {
+            map.erase( i - nbRuns );
+            map.emplace( i, std::make_shared<Observer>() );
+        });
+    }
+    done = true;
+    for (auto& th : readers) th.join();
+
+    // Nobody is reading, the next update deletes everything retired before
+    observers.update( [](Observers_t&) {} );
+    assert( tools::synchronized::rcu_domain::global().retired_size() <= 1 );
+    assert( observers.read()->size() == nbRuns );
+
+    std::cout << "Reclamation test passed, reads: " << nbReads << std::endl;
+}
+
+
+// Nested read sections keep the value alive until the outermost one ends
+void test_nesting()
+{
+    tools::synchronized::rcu<Observers_t> observers;
+    observers.update( [](Observers_t& map) { map.emplace( 1, std::make_shared<Observer>() ); } );
+
+    auto outer = observers.read();
+    const Observers_t* map = outer.get();
+    {
+        auto inner = observers.read();
+        assert( inner.get() == map );
+    }
+    observers.update( [](Observers_t& map) { map.clear(); } );
+    assert( map->at(1)->alive == 1 );
+    assert( observers.read()->empty() );
+
+    std::cout << "Nesting test passed" << std::endl;
+}
+
+
+template< typename F >
+double timeThreads(F&& lookup)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nbThreads; ++i) {
+        threads.emplace_back( [&lookup, i]() {
+            for (int n = 0; n < nbLookups; ++n) {
+                lookup( 1 + (i + n) % nbRuns );
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void benchmark()
+{
+    Observers_t map;
+    for (int run = 1; run <= nbRuns; ++run) {
+        map.emplace( run, std::make_shared<Observer>() );
+    }
+
+    std::mutex lock;
+    const double mutexTime = timeThreads( [&](int runNumber) {
+        ObserverPtr observer;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            observer = map.find( runNumber )->second;
+        }
+        observer->pop();
+    });
+
+    tools::synchronized::rcu<Observers_t> observers;
+    observers.update( [&map](Observers_t& copy) { copy = map; } );
+    const double rcuTime = timeThreads( [&](int runNumber) {
+        auto guard = observers.read();
+        guard->find( runNumber )->second->pop();
+    });
+
+    const double nbAll = (double)nbThreads * nbLookups;
+    std::cout << "Lookups with " << nbThreads << " threads and " << nbRuns << " runs:" << std::endl;
+    std::cout << "  mutex + shared_ptr: " << mutexTime << " s, " << mutexTime / nbAll * 1e9 << " ns per lookup" << std::endl;
+    std::cout << "  rcu:                " << rcuTime   << " s, " << rcuTime   / nbAll * 1e9 << " ns per lookup" << std::endl;
+}
+
+
+int main()
+{
+    test_nesting();
+    test_reclamation();
+    benchmark();
+}
@@ -0,0 +1,185 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring.h"
+#include "queue.h"
+
+/*
+ * Tests of the bounded MPMC ring and a benchmark against tools::synchronized::queue.
+ */
+
+// The same size and layout as bu::FileInfo
+struct File {
+    uint32_t runNumber = 0;
+    uint32_t lumiSection = 0;
+    uint32_t index = 0;
+    uint32_t type = 0;
+};
+
+
+void test_single_thread()
+{
+    tools::synchronized::ring<int> ring(4);
+    int data = 0;
+
+    assert( !ring.try_pop(data) );
+    for (int i = 0; i < 4; ++i) {
+        assert( ring.try_push( std::move(i) ) );
+    }
+    assert( !ring.try_push(100) );
+    assert( ring.size_approx() == 4 );
+
+    // Wrap around several laps, the order is kept
+    for (int i = 4; i < 100; ++i) {
+        assert( ring.try_pop(data) && data == i - 4 );
+        assert( ring.try_push( std::move(i) ) );
+    }
+
+    // Batches stop at the end of the data
+    int out[8];
+    assert( ring.try_pop_batch(out, 8) == 4 );
+    for (int i = 0; i < 4; ++i) {
+        assert( out[i] == 96 + i );
+    }
+    int in[6] = { 0, 1, 2, 3, 4, 5 };
+    assert( ring.try_push_batch(in, 6) == 4 );
+    assert( ring.try_push_batch(in, 6) == 0 );
+    assert( ring.try_pop_batch(out, 3) == 3 && out[2] == 2 );
+    assert( ring.try_pop(data) && data == 3 );
+    assert( !ring.try_pop(data) );
+
+    bool isThrown = false;
+    try {
+        tools::synchronized::ring<int> bad(6);
+    }
+    catch (const std::invalid_argument&) {
+        isThrown = true;
+    }
+    assert( isThrown );
+
+    std::cout << "Single thread test passed" << std::endl;
+}
+
+
+/*
+ * Producers push files with increasing index, every item has to be popped exactly once
+ * and a consumer has to see the items of one producer in the order they were pushed.
+ */
+void test_mpmc(int nbProducers, int nbConsumers, std::size_t batch)
+{
+    const uint32_t perProducer = 200000;
+    tools::synchronized::ring<File> ring(256);
+    std::atomic<uint64_t> sum(0);
+    std::atomic<uint32_t> popped(0);
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < nbProducers; ++p) {
+        threads.emplace_back( [&, p]() {
+            std::vector<File> files(batch);
+            uint32_t index = 0;
+            while (index < perProducer) {
+                std::size_t count = 0;
+                for (; count < batch && index + count < perProducer; ++count) {
+                    files[count].runNumber = p;
+                    files[count].index = index + count;
+                }
+                const std::size_t pushed = ring.try_push_batch(files.data(), count);
+                if (pushed == 0) {
+                    std::this_thread::yield();
+                }
+                index += pushed;
+            }
+        });
+    }
+    for (int c = 0; c < nbConsumers; ++c) {
+        threads.emplace_back( [&]() {
+            std::vector<File> files(batch);
+            std::vector<int64_t> last(nbProducers, -1);
+            while (popped.load() < perProducer * nbProducers) {
+                const std::size_t count = ring.try_pop_batch(files.data(), batch);
+                if (count == 0) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (std::size_t i = 0; i < count; ++i) {
+                    const File& file = files[i];
+                    assert( (int64_t)file.index > last[file.runNumber] );
+                    last[file.runNumber] = file.index;
+                    sum += file.index;
+                }
+                popped += count;
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    assert( popped == perProducer * nbProducers );
+    assert( sum == (uint64_t)nbProducers * perProducer * (perProducer - 1) / 2 );
+
+    std::cout << "MPMC test passed: " << nbProducers << " producers, " << nbConsumers << " consumers, batch " << batch << std::endl;
+}
+
+
+// Producers and consumers move the given number of files, returns nanoseconds per file
+template< typename Push, typename Pop >
+double benchmark(int nbThreads, Push&& push, Pop&& pop)
+{
+    const int perThread = 1000000 / nbThreads;
+    std::atomic<int> popped(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nbThreads; ++i) {
+        threads.emplace_back( [&]() {
+            File file;
+            for (int n = 0; n < perThread; ++n) {
+                while (!push(file)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        threads.emplace_back( [&]() {
+            File file;
+            while (popped.load(std::memory_order_relaxed) < perThread * nbThreads) {
+                if (pop(file)) {
+                    popped.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return seconds / ((double)perThread * nbThreads) * 1e9;
+}
+
+
+int main()
+{
+    test_single_thread();
+    test_mpmc(1, 1, 1);
+    test_mpmc(4, 4, 1);
+    test_mpmc(4, 2, 16);
+    test_mpmc(2, 4, 7);
+
+    std::cout << "\nNanoseconds per file, N producers and N consumers (" << std::thread::hardware_concurrency() << " CPUs)\n";
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "queue" << std::setw(12) << "ring" << '\n';
+    for (const int nbThreads : { 1, 2, 4, 8 }) {
+        tools::synchronized::queue<File> queue;
+        tools::synchronized::ring<File> ring(1024);
+
+        std::cout << std::fixed << std::setprecision(1) << std::setw(8) << nbThreads
+            << std::setw(12) << benchmark( nbThreads, [&](File file) { return queue.push( std::move(file) ); }, [&](File& file) { return queue.pop(file); } )
+            << std::setw(12) << benchmark( nbThreads, [&](File file) { return ring.try_push( std::move(file) ); }, [&](File& file) { return ring.try_pop(file); } )
+            << std::endl;
+    }
+}
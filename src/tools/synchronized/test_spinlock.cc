@@ -1,76 +1,122 @@
-
-#include <future>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
 
 #include "boost/smart_ptr/detail/spinlock.hpp"
 
 #include "spinlock.h"
-#include "../tools.h"
+#include "queue.h"
 
+/*
+ * Benchmark of the locks across thread counts and critical section lengths.
+ * Every thread takes the lock in a loop, the critical section is a number of dependent increments
+ * and the same amount of work is done outside of the lock.
+ *
+ * Prints nanoseconds per critical section (lower is better).
+ */
 
-// Synchronize std::cout
-//tools::synchronized::spinlock outLock;
+const int nbLocks = 1000000;               // Critical sections in total, split among threads
 
 volatile int value = 0;
 
-template<typename Mutex>
-int loop(int index, bool inc, int limit)
+inline void work(int length)
 {
-    (void)index;
-    static Mutex lock;
-
-    //outLock.lock();
-    //std::cout << "Started " << index << ": " << inc << " " << limit << std::endl;
-    //outLock.unlock();
-
-    for (int i = 0; i < limit; ++i) {
-        std::lock_guard<Mutex> guard(lock);
-        if (inc) {
-            ++value;
-        } else {
-            --value;
-        }
+    for (int i = 0; i < length; ++i) {
+        value = value + 1;
     }
-    return 0;
 }
 
 
 template<typename Mutex>
-void test_lock()
+double benchmark(int nbThreads, int length)
 {
-    value = 0;
-    /*
-    auto f0 = std::async(std::launch::async, std::bind( loop<Mutex>, 0, true, 10000000));
-    auto f1 = std::async(std::launch::async, std::bind( loop<Mutex>, 1, true, 10000000));
-    auto f2 = std::async(std::launch::async, std::bind( loop<Mutex>, 2, false, 10000000));
-
-    f0.wait();
-    f1.wait();
-    f2.wait();
-    */
+    Mutex lock {};                      // boost::detail::spinlock is a POD, value-initialized it is unlocked
+    long counter = 0;
+    const int perThread = nbLocks / nbThreads;
 
+    const auto start = std::chrono::steady_clock::now();
     std::vector<std::thread> threads;
-
-    for (int i=1; i<=10; ++i) {
-        threads.push_back( std::thread( loop<Mutex>, i, (i <= 6 ? true : false), 1000000 ) );
+    for (int i = 0; i < nbThreads; ++i) {
+        threads.emplace_back( [&]() {
+            for (int n = 0; n < perThread; ++n) {
+                {
+                    std::lock_guard<Mutex> guard(lock);
+                    counter++;
+                    work(length);
+                }
+                work(length);
+            }
+        });
     }
+    for (auto& th : threads) th.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    assert( counter == (long)perThread * nbThreads );
+    (void)counter;
+    return seconds / ((double)perThread * nbThreads) * 1e9;
+}
+
 
+// The queue with the lock as its Mutex, every thread pushes and pops
+template<typename Mutex>
+double benchmarkQueue(int nbThreads)
+{
+    tools::synchronized::queue<int, Mutex> queue;
+    const int perThread = nbLocks / nbThreads / 2;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nbThreads; ++i) {
+        threads.emplace_back( [&]() {
+            int data;
+            for (int n = 0; n < perThread; ++n) {
+                queue.push( std::move(n) );
+                queue.pop( data );
+            }
+        });
+    }
     for (auto& th : threads) th.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    //std::cout << value << std::endl;
-    assert( value == 2000000 );
+    return seconds / ((double)perThread * nbThreads * 2) * 1e9;
 }
 
 
 int main()
 {
-    std::cout << "Test with custom spinlock: " << tools::timeFunction( test_lock<tools::synchronized::spinlock> ) << std::endl;
-    std::cout << "Test with boost spinlock:  " << tools::timeFunction( test_lock<boost::detail::spinlock> ) << std::endl;
-    std::cout << "Test with mutex:           " << tools::timeFunction( test_lock<std::mutex> ) << std::endl;
+    const std::vector<int> threadCounts = { 1, 2, 4, 8, 16 };
+    const std::vector<int> lengths = { 0, 10, 100 };
+
+    std::cout << "Nanoseconds per critical section (" << std::thread::hardware_concurrency() << " CPUs)\n";
+    std::cout << std::setw(8) << "threads" << std::setw(8) << "length"
+              << std::setw(12) << "mutex" << std::setw(12) << "spinlock" << std::setw(12) << "boost" << std::setw(12) << "adaptive" << '\n';
+
+    for (const int length : lengths) {
+        for (const int nbThreads : threadCounts) {
+            std::cout << std::fixed << std::setprecision(1)
+                << std::setw(8) << nbThreads << std::setw(8) << length
+                << std::setw(12) << benchmark<std::mutex>( nbThreads, length )
+                << std::setw(12) << benchmark<tools::synchronized::spinlock>( nbThreads, length )
+                << std::setw(12) << benchmark<boost::detail::spinlock>( nbThreads, length )
+                << std::setw(12) << benchmark<tools::synchronized::adaptive_spinlock>( nbThreads, length )
+                << std::endl;
+        }
+    }
 
-    std::cout << "Test with custom spinlock: " << tools::timeFunction( test_lock<tools::synchronized::spinlock> ) << std::endl;
-    std::cout << "Test with boost spinlock:  " << tools::timeFunction( test_lock<boost::detail::spinlock> ) << std::endl;
-    std::cout << "Test with mutex:           " << tools::timeFunction( test_lock<std::mutex> ) << std::endl;   
+    // NOTE: boost::detail::spinlock is left out, it may deadlock in the queue (see spinlock.h)
+    std::cout << "\nNanoseconds per queue operation\n";
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "mutex" << std::setw(12) << "spinlock" << std::setw(12) << "adaptive" << '\n';
+    for (const int nbThreads : threadCounts) {
+        std::cout << std::fixed << std::setprecision(1)
+            << std::setw(8) << nbThreads
+            << std::setw(12) << benchmarkQueue<std::mutex>( nbThreads )
+            << std::setw(12) << benchmarkQueue<tools::synchronized::spinlock>( nbThreads )
+            << std::setw(12) << benchmarkQueue<tools::synchronized::adaptive_spinlock>( nbThreads )
+            << std::endl;
+    }
 }